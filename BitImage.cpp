@@ -0,0 +1,181 @@
+#include <string.h>
+#include <math.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define WORD_BITS 64
+#define ALL_ONES (~(uint64)0)
+
+void BitImage::create(int rows, int cols) {
+    this->rows = rows;
+    this->cols = cols;
+    stride = (cols + WORD_BITS - 1) / WORD_BITS;
+    words.assign((size_t)rows*stride, 0);
+}
+
+void BitImage::clearPadding() {
+    int tail = cols % WORD_BITS;
+    if (tail == 0) {
+        return;
+    }
+    uint64 mask = ((uint64)1 << tail) - 1;
+    for (int r = 0; r < rows; r++) {
+        ptr(r)[stride-1] &= mask;
+    }
+}
+
+void BitImage::pack(const Mat &image, int thresh, bool invert, int maxval) {
+    CV_Assert(image.type() == CV_8UC1);
+    create(image.rows, image.cols);
+    this->maxval = maxval;
+    for (int r = 0; r < rows; r++) {
+        const uchar *pSrc = image.ptr<uchar>(r);
+        uint64 *pDst = ptr(r);
+        for (int w = 0; w < stride; w++) {
+            int c0 = w * WORD_BITS;
+            int n = min(WORD_BITS, cols - c0);
+            uint64 word = 0;
+            for (int b = 0; b < n; b++) {
+                word |= (uint64)(pSrc[c0+b] > thresh) << b;
+            }
+            pDst[w] = invert ? ~word : word;
+        }
+    }
+    if (invert) {
+        clearPadding();
+    }
+}
+
+void BitImage::unpack(Mat &image) const {
+    image.create(rows, cols, CV_8UC1);
+    uchar value = saturate_cast<uchar>(maxval);
+    for (int r = 0; r < rows; r++) {
+        const uint64 *pSrc = ptr(r);
+        uchar *pDst = image.ptr<uchar>(r);
+        for (int w = 0; w < stride; w++) {
+            int c0 = w * WORD_BITS;
+            int n = min(WORD_BITS, cols - c0);
+            uint64 word = pSrc[w];
+            for (int b = 0; b < n; b++) {
+                pDst[c0+b] = ((word >> b) & 1) ? value : 0;
+            }
+        }
+    }
+}
+
+bool BitImage::isSupportedShape(int shape) {
+    return shape == MORPH_RECT || shape == MORPH_CROSS;
+}
+
+/**
+ * Combine each pixel with its horizontal neighbours [c-anchor, c+kwidth-1-anchor]
+ * by shifting whole words. Pixels outside the row are the identity of the operation.
+ */
+void BitImage::rowPass(bool isErode, int kwidth, int anchor, BitImage &dst) const {
+    uint64 fill = isErode ? ALL_ONES : 0;
+    int maxShift = max(anchor, kwidth-1-anchor);
+    int pad = maxShift / WORD_BITS + 1;
+    vector<uint64> buf(stride + 2*pad);
+    int tail = cols % WORD_BITS;
+    uint64 tailFill = tail && isErode ? ~(((uint64)1 << tail) - 1) : 0;
+
+    dst.create(rows, cols);
+    dst.maxval = maxval;
+    for (int r = 0; r < rows; r++) {
+        for (int i = 0; i < pad; i++) {
+            buf[i] = fill;
+            buf[pad+stride+i] = fill;
+        }
+        memcpy(&buf[pad], ptr(r), stride*sizeof(uint64));
+        buf[pad+stride-1] |= tailFill;
+
+        uint64 *pDst = dst.ptr(r);
+        for (int w = 0; w < stride; w++) {
+            uint64 acc = fill;
+            for (int d = -anchor; d < kwidth-anchor; d++) {
+                int bit = (pad + w)*WORD_BITS + d;
+                int q = bit / WORD_BITS;
+                int s = bit % WORD_BITS;
+                uint64 v = s ? (buf[q] >> s) | (buf[q+1] << (WORD_BITS-s)) : buf[q];
+                acc = isErode ? (acc & v) : (acc | v);
+            }
+            pDst[w] = acc;
+        }
+    }
+    dst.clearPadding();
+}
+
+/**
+ * Combine each row with rows [r-anchor, r+kheight-1-anchor] that lie within the image
+ */
+void BitImage::colPass(bool isErode, int kheight, int anchor, BitImage &dst) const {
+    uint64 fill = isErode ? ALL_ONES : 0;
+    dst.create(rows, cols);
+    dst.maxval = maxval;
+    for (int r = 0; r < rows; r++) {
+        int r0 = max(0, r-anchor);
+        int r1 = min(rows, r+kheight-anchor);
+        uint64 *pDst = dst.ptr(r);
+        for (int w = 0; w < stride; w++) {
+            pDst[w] = fill;
+        }
+        for (int rr = r0; rr < r1; rr++) {
+            const uint64 *pSrc = ptr(rr);
+            if (isErode) {
+                for (int w = 0; w < stride; w++) {
+                    pDst[w] &= pSrc[w];
+                }
+            } else {
+                for (int w = 0; w < stride; w++) {
+                    pDst[w] |= pSrc[w];
+                }
+            }
+        }
+    }
+    dst.clearPadding();
+}
+
+void BitImage::morphologyOnce(bool isErode, int shape, Size ksize, Point anchor) {
+    CV_Assert(isSupportedShape(shape));
+    BitImage horizontal;
+    BitImage result;
+    rowPass(isErode, ksize.width, anchor.x, horizontal);
+    if (shape == MORPH_RECT) {
+        horizontal.colPass(isErode, ksize.height, anchor.y, result);
+    } else {
+        // cross is the union of a horizontal and a vertical line through the anchor
+        colPass(isErode, ksize.height, anchor.y, result);
+        for (size_t i = 0; i < result.words.size(); i++) {
+            result.words[i] = isErode ?
+                (result.words[i] & horizontal.words[i]) :
+                (result.words[i] | horizontal.words[i]);
+        }
+    }
+    words.swap(result.words);
+}
+
+void BitImage::morphology(bool isErode, int shape, Size ksize, int iterations) {
+    if (shape == MORPH_RECT) {
+        // iterated rectangles are a single rectangle
+        Size folded((ksize.width-1)*iterations+1, (ksize.height-1)*iterations+1);
+        Point anchor((ksize.width/2)*iterations, (ksize.height/2)*iterations);
+        morphologyOnce(isErode, shape, folded, anchor);
+    } else {
+        for (int i = 0; i < iterations; i++) {
+            morphologyOnce(isErode, shape, ksize, Point(ksize.width/2, ksize.height/2));
+        }
+    }
+}
+
+void BitImage::erode(int shape, Size ksize, int iterations) {
+    morphology(true, shape, ksize, iterations);
+}
+
+void BitImage::dilate(int shape, Size ksize, int iterations) {
+    morphology(false, shape, ksize, iterations);
+}
@@ -0,0 +1,185 @@
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/features2d/features2d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+#include "MatUtil.hpp"
+#include "version.h"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+typedef struct CalibrationEntry {
+    time_t mtime;
+    Ptr<Calibration> calibration;
+} CalibrationEntry;
+
+static Mutex calibrationMutex;
+static map<string, CalibrationEntry> calibrationCache;
+
+static Mat json_Mat(json_t *pCalibrate, const char *key) {
+    Mat result;
+    vector<double> v = jo_vectord(pCalibrate, key, vector<double>(), emptyMap);
+    if (v.size()) {
+        result = Mat(v, true);
+    }
+    return result;
+}
+
+Calibration::Calibration(json_t *pCalibrate) {
+    cameraMatrix = json_Mat(pCalibrate, "cameraMatrix");
+    if (cameraMatrix.rows == 9) {
+        cameraMatrix = cameraMatrix.reshape(1, 3);
+    } else {
+        cameraMatrix = Mat();
+    }
+    distCoeffs = json_Mat(pCalibrate, "distCoeffs");
+    switch (distCoeffs.rows) {
+    case 4:
+    case 5:
+    case 8:
+        break;
+    default:
+        distCoeffs = Mat();
+        break;
+    }
+    perspective = json_Mat(pCalibrate, "perspective");
+    if (perspective.rows == 9) {
+        perspective = perspective.reshape(1, 3);
+    } else {
+        perspective = Mat();
+    }
+}
+
+bool Calibration::undistortMaps(Size size, Mat &map1, Mat &map2) {
+    if (cameraMatrix.empty() || distCoeffs.empty()) {
+        return false;
+    }
+    AutoLock lock(mapMutex);
+    if (undistortSize != size) {
+        LOGTRACE2("Calibration::undistortMaps() %dx%d", size.width, size.height);
+        // same maps that undistort() computes on every call
+        initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(), cameraMatrix, size,
+                                CV_16SC2, undistortMap1, undistortMap2);
+        undistortSize = size;
+    }
+    map1 = undistortMap1;
+    map2 = undistortMap2;
+    return true;
+}
+
+bool Calibration::perspectiveMaps(Size size, Mat &map1, Mat &map2) {
+    if (perspective.empty()) {
+        return false;
+    }
+    AutoLock lock(mapMutex);
+    if (perspectiveSize != size) {
+        LOGTRACE2("Calibration::perspectiveMaps() %dx%d", size.width, size.height);
+        Mat inverse = perspective.inv();
+        const double *m = inverse.ptr<double>(0);
+        Mat mapXY(size, CV_32FC2);
+        for (int y = 0; y < size.height; y++) {
+            Vec2f *pXY = mapXY.ptr<Vec2f>(y);
+            for (int x = 0; x < size.width; x++) {
+                double w = m[6]*x + m[7]*y + m[8];
+                w = w ? 1.0/w : 0;
+                pXY[x][0] = (float)((m[0]*x + m[1]*y + m[2])*w);
+                pXY[x][1] = (float)((m[3]*x + m[4]*y + m[5])*w);
+            }
+        }
+        convertMaps(mapXY, Mat(), perspectiveMap1, perspectiveMap2, CV_16SC2);
+        perspectiveSize = size;
+    }
+    map1 = perspectiveMap1;
+    map2 = perspectiveMap2;
+    return true;
+}
+
+static time_t fileModified(const char *path) {
+    struct stat st;
+    if (stat(path, &st)) {
+        return 0;
+    }
+    return st.st_mtime;
+}
+
+string CalibrationStore::save(const char *path, json_t *pCalibrate) {
+    string errMsg;
+    if (!json_is_object(pCalibrate)) {
+        errMsg = "CalibrationStore::save() expected calibrate JSON object";
+        return errMsg;
+    }
+
+    json_t *pRoot = json_object();
+    json_object_set(pRoot, "version", json_integer(CalibrationStore::VERSION));
+    char buf[100];
+    snprintf(buf, sizeof(buf), "%d.%d.%d", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+    json_object_set(pRoot, "FireSight", json_string(buf));
+    json_object_set(pRoot, "calibrate", pCalibrate);
+
+    AutoLock lock(calibrationMutex);
+    if (json_dump_file(pRoot, path, JSON_PRESERVE_ORDER|JSON_INDENT(2))) {
+        errMsg = "CalibrationStore::save() could not write ";
+        errMsg += path;
+    } else {
+        LOGTRACE1("CalibrationStore::save(%s)", path);
+    }
+    calibrationCache.erase(path);
+    json_decref(pRoot);
+
+    return errMsg;
+}
+
+Ptr<Calibration> CalibrationStore::load(const char *path, string &errMsg) {
+    AutoLock lock(calibrationMutex);
+    time_t mtime = fileModified(path);
+    map<string, CalibrationEntry>::iterator it = calibrationCache.find(path);
+    if (it != calibrationCache.end() && it->second.mtime == mtime) {
+        return it->second.calibration;
+    }
+
+    Ptr<Calibration> result;
+    json_error_t jerr;
+    json_t *pRoot = json_load_file(path, 0, &jerr);
+    if (!pRoot) {
+        errMsg = "CalibrationStore::load() could not read ";
+        errMsg += path;
+        errMsg += ": ";
+        errMsg += jerr.text;
+    } else {
+        json_t *pVersion = json_object_get(pRoot, "version");
+        json_t *pCalibrate = json_object_get(pRoot, "calibrate");
+        if (!json_is_integer(pVersion) || json_integer_value(pVersion) != CalibrationStore::VERSION) {
+            char buf[255];
+            snprintf(buf, sizeof(buf), "CalibrationStore::load() %s expected version:%d",
+                     path, CalibrationStore::VERSION);
+            errMsg = buf;
+        } else if (!json_is_object(pCalibrate)) {
+            errMsg = "CalibrationStore::load() expected calibrate JSON object in ";
+            errMsg += path;
+        } else {
+            result = new Calibration(pCalibrate);
+            CalibrationEntry entry;
+            entry.mtime = mtime;
+            entry.calibration = result;
+            calibrationCache[path] = entry;
+            LOGTRACE1("CalibrationStore::load(%s)", path);
+        }
+        json_decref(pRoot);
+    }
+    if (!errMsg.empty()) {
+        LOGERROR1("%s", errMsg.c_str());
+    }
+
+    return result;
+}
+
+void CalibrationStore::clear() {
+    AutoLock lock(calibrationMutex);
+    calibrationCache.clear();
+}
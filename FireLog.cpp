@@ -26,11 +26,18 @@ static bool logTID = 0;
 
 #define LOGMAX 255
 
+#ifdef _MSC_VER
+#define LOG_THREAD_LOCAL __declspec(thread)
+#else
+#define LOG_THREAD_LOCAL __thread
+#endif
+
 using namespace std;
 
 FILE *logFile = NULL;
 int logLevel = FIRELOG_WARN;
-static char lastMessage[5][LOGMAX+1];
+/* each thread keeps its own messages, so that threads do not overwrite each other's */
+static LOG_THREAD_LOCAL char lastMessage[5][LOGMAX+1];
 
 
 int firelog_init(const char *path, int level) {
@@ -111,10 +118,11 @@ void firelog(const char *msg, int level) {
   timeval tp;
   gettimeofday(&tp, 0);
   time_t curtime = tp.tv_sec;
-  struct tm *pLocalNow = localtime(&curtime);
-  int now_hour = pLocalNow->tm_hour;
-  int now_min = pLocalNow->tm_min;
-  int now_sec = pLocalNow->tm_sec;
+  struct tm localNow;
+  localtime_r(&curtime, &localNow);
+  int now_hour = localNow.tm_hour;
+  int now_min = localNow.tm_min;
+  int now_sec = localNow.tm_sec;
   int now_ms = tp.tv_usec/1000;
 #endif
   int tid = 0;
@@ -139,15 +147,12 @@ void firelog(const char *msg, int level) {
         now_hour, now_min, now_sec, now_ms, levelStr, msg);
   }
 
+  // a single fprintf() per line keeps lines from different threads intact
   if (logFile) {
-    fprintf(logFile, "%s", lastMessage[level]);
-    fprintf(logFile, "\n");
+    fprintf(logFile, "%s\n", lastMessage[level]);
     fflush(logFile);
+  } else {
+    fprintf(stderr, "%s\n", lastMessage[level]);
+    fflush(stderr);
   }
-#ifdef __cplusplus
-  else {
-    cerr << lastMessage[level] << endl;
-    cerr.flush();
-  }
-#endif
 }
@@ -93,7 +93,7 @@ CLASS_DECLSPEC int firelog_destroy();
 CLASS_DECLSPEC int firelog_level(int newLevel);
 
 /**
- * Return last message
+ * Return last message logged by the calling thread
  * @param level logging level
  * @return Last message logged for given level
  */
@@ -107,7 +107,7 @@ void firelog_show_thread_id(int show);
 
 /**
  * (INTERNAL)
- * Clear cache of logging messages
+ * Clear cache of logging messages of the calling thread
  */
 void firelog_lastMessageClear();
 
@@ -3,6 +3,25 @@
 #include <fstream>
 #include <sstream>
 #include <math.h>
+#include <ctype.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include "FireLog.h"
 #include "FireSight.hpp"
 #include "version.h"
@@ -16,7 +35,16 @@ using namespace cv;
 using namespace std;
 using namespace firesight;
 
-typedef enum{UI_STILL, UI_VIDEO} UIMode;
+typedef enum{UI_STILL, UI_VIDEO, UI_STREAM, UI_SERVE} UIMode;
+
+#if CV_MAJOR_VERSION > 2 || CV_MINOR_VERSION > 4 || (CV_MINOR_VERSION == 4 && CV_SUBMINOR_VERSION >= 4)
+#define HAVE_CV_GLOB /* cv::glob() is available since OpenCV 2.4.4 */
+#endif
+
+#define STREAM_RING_SIZE 8 /* default number of decoded frames waiting to be processed */
+#define SERVE_MAX_REQUEST (64*1024*1024) /* longest request line accepted by -serve */
+
+static volatile sig_atomic_t isInterrupted = 0;
 
 static void help() {
   cout << "FireSight image processing pipeline v" << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH << endl;
@@ -33,9 +61,26 @@ static void help() {
   cout << endl;
   cout << "Input parameters:" << endl;
   cout << " -i input-image-file" << endl;
-  cout << "    File path of pipeline input image" << endl;
+  cout << "    File path of pipeline input image. A directory, a glob pattern (e.g., \"img/*.png\")" << endl;
+  cout << "    or a list file (.txt or .lst) with one image path per line processes each image" << endl;
+  cout << "    independently, writing one JSON line with the image path and model per image" << endl;
+  cout << " -workers count" << endl;
+  cout << "    Number of images decoded, processed and encoded at the same time for multiple -i images." << endl;
+  cout << "    Default is one per core" << endl;
   cout << " -video " << endl;
   cout << "    Use video for pipeline input" << endl;
+  cout << " -stream video-source" << endl;
+  cout << "    Process a video file, image sequence (e.g., img/frame%04d.png) or camera number without a display," << endl;
+  cout << "    writing one JSON model per frame (JSONL) and frame rate and latency statistics at exit" << endl;
+  cout << " -ring frames" << endl;
+  cout << "    Number of decoded frames that -stream buffers for processing. Default is " << STREAM_RING_SIZE << endl;
+  cout << " -drop " << endl;
+  cout << "    Drop the oldest buffered frame when the -stream buffer is full instead of waiting" << endl;
+  cout << " -serve socket-path" << endl;
+  cout << "    Serve requests on a Unix domain socket. Each request is a line of JSON such as" << endl;
+  cout << "    {\"pipeline\":\"json/pipeline0.json\",\"image\":\"img/cam.jpg\",\"args\":{\"var\":\"value\"}}" << endl;
+  cout << "    or with \"imageBytes\":\"<base64 encoded image>\" instead of \"image\"." << endl;
+  cout << "    Each reply is a line with the JSON model or {\"error\":\"...\"}. Pipelines are cached by path." << endl;
   cout << endl;
   cout << "Transformation parameters:" << endl;
   cout << " -Dvar=value" << endl;
@@ -45,7 +90,9 @@ static void help() {
   cout << " -jp JSON-model-real-precision" << endl;
   cout << "    Default is 6-digit precision for real numbers in JSON model output" << endl;
   cout << " -o output-image-file" << endl;
-  cout << "    File for saving pipeline image " << endl;
+  cout << "    File for saving pipeline image. For multiple -i images, the path is a template with" << endl;
+  cout << "    {{name}} (input file name without extension), {{ext}} (input extension) and {{index}}," << endl;
+  cout << "    e.g., \"target/{{name}}-out.png\"" << endl;
   cout << " -p JSON-pipeline-file" << endl;
   cout << "    JSON pipeline specification file. If omitted, input and output images must be specified." << endl;
   cout << endl;
@@ -67,7 +114,8 @@ static void help() {
 }
 
 bool parseArgs(int argc, char *argv[], 
-  string &pipelinePath, char *&imagePath, char * &outputPath, UIMode &uimode, ArgMap &argMap, bool &isTime, int &jsonIndent, int &jsonPrecision) 
+  string &pipelinePath, char *&imagePath, char * &outputPath, UIMode &uimode, ArgMap &argMap, bool &isTime, int &jsonIndent, int &jsonPrecision,
+  char *&streamSource, int &ringSize, bool &isDrop, int &workers, char *&servePath) 
 {
   uimode = UI_STILL;
   isTime = false;
@@ -141,6 +189,46 @@ bool parseArgs(int argc, char *argv[],
     } else if (strcmp("-video", argv[i]) == 0) {
       uimode = UI_VIDEO;
       LOGTRACE("parseArgs(-video) UI_VIDEO user interface selected");
+    } else if (strcmp("-stream", argv[i]) == 0) {
+      if (i+1>=argc) {
+        LOGERROR("expected video file, image sequence or camera number after -stream");
+        exit(-1);
+      }
+      streamSource = argv[++i];
+      uimode = UI_STREAM;
+      LOGTRACE1("parseArgs(-stream) \"%s\" is video source", streamSource);
+    } else if (strcmp("-serve", argv[i]) == 0) {
+      if (i+1>=argc) {
+        LOGERROR("expected socket path after -serve");
+        exit(-1);
+      }
+      servePath = argv[++i];
+      uimode = UI_SERVE;
+      LOGTRACE1("parseArgs(-serve) \"%s\" is socket path", servePath);
+    } else if (strcmp("-ring", argv[i]) == 0) {
+      if (i+1>=argc) {
+        LOGERROR("expected number of frames after -ring");
+        exit(-1);
+      }
+      ringSize = atoi(argv[++i]);
+      if (ringSize < 1) {
+        LOGERROR1("invalid -ring size: %d", ringSize);
+        exit(-1);
+      }
+      LOGTRACE1("parseArgs(-ring) %d frames", ringSize);
+    } else if (strcmp("-drop", argv[i]) == 0) {
+      isDrop = true;
+    } else if (strcmp("-workers", argv[i]) == 0) {
+      if (i+1>=argc) {
+        LOGERROR("expected number of workers after -workers");
+        exit(-1);
+      }
+      workers = atoi(argv[++i]);
+      if (workers < 1) {
+        LOGERROR1("invalid number of workers: %d", workers);
+        exit(-1);
+      }
+      LOGTRACE1("parseArgs(-workers) %d", workers);
     } else if (strcmp("-warn", argv[i]) == 0) {
       firelog_level(FIRELOG_WARN);
     } else if (strcmp("-error", argv[i]) == 0) {
@@ -227,6 +315,694 @@ static int uiVideo(const char * pipelinePath, ArgMap &argMap) {
   return 0;
 }
 
+/**
+ * Decoded frame waiting to be processed
+ */
+typedef struct CapturedFrame {
+  Mat image;
+  int index;
+  long long ticks; // when decoded
+} CapturedFrame;
+
+/**
+ * Bounded buffer of frames from the capture thread to the processing thread.
+ * When full, push() either waits or drops the oldest frame.
+ */
+class FrameRing {
+  private:
+    deque<CapturedFrame> frames;
+    size_t capacity;
+    bool isDrop;
+    bool closed;
+    int dropped;
+    std::mutex ringMutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+
+  public:
+    FrameRing(size_t capacity, bool isDrop) : capacity(capacity), isDrop(isDrop), closed(false), dropped(0) {}
+
+    void push(const CapturedFrame &frame) {
+      std::unique_lock<std::mutex> lock(ringMutex);
+      if (isDrop) {
+        if (frames.size() >= capacity) {
+          frames.pop_front();
+          dropped++;
+        }
+      } else {
+        while (frames.size() >= capacity) {
+          notFull.wait(lock);
+        }
+      }
+      frames.push_back(frame);
+      notEmpty.notify_one();
+    }
+
+    /**
+     * @return false if there are no more frames
+     */
+    bool pop(CapturedFrame &frame) {
+      std::unique_lock<std::mutex> lock(ringMutex);
+      while (frames.empty() && !closed) {
+        notEmpty.wait(lock);
+      }
+      if (frames.empty()) {
+        return false;
+      }
+      frame = frames.front();
+      frames.pop_front();
+      notFull.notify_one();
+      return true;
+    }
+
+    void close() {
+      std::lock_guard<std::mutex> lock(ringMutex);
+      closed = true;
+      notEmpty.notify_one();
+    }
+
+    int getDropped() {
+      std::lock_guard<std::mutex> lock(ringMutex);
+      return dropped;
+    }
+};
+
+static void onInterrupt(int signum) {
+  isInterrupted = 1;
+}
+
+/**
+ * Decode frames into the ring until the source ends or the user interrupts
+ */
+static void captureFrames(VideoCapture *pCap, FrameRing *pRing, int *pCaptured) {
+  for (int index = 0; !isInterrupted; index++) {
+    CapturedFrame frame;
+    if (!pCap->read(frame.image) || frame.image.empty()) {
+      break;
+    }
+    frame.index = index;
+    frame.ticks = cvGetTickCount();
+    pRing->push(frame);
+    *pCaptured = index + 1;
+  }
+  pRing->close();
+}
+
+/**
+ * Headless video example of FireSight lib_firesight library use.
+ * Frames are decoded on their own thread and processed in order on this thread.
+ */
+static int uiStream(const char * pipelinePath, const char *source, ArgMap &argMap,
+  int ringSize, bool isDrop, int jsonPrecision) 
+{
+  VideoCapture cap;
+  char *pEnd = NULL;
+  long device = strtol(source, &pEnd, 10);
+  if (*source && !*pEnd) {
+    cap.open((int) device);
+  } else {
+    cap.open(source);
+  }
+  if (!cap.isOpened()) {
+    LOGERROR1("Could not open video source: %s", source);
+    exit(-1);
+  }
+
+  Pipeline pipeline(pipelinePath, Pipeline::PATH);
+  FrameRing ring(ringSize, isDrop);
+  int captured = 0;
+  signal(SIGINT, onInterrupt);
+  long long tickStart = cvGetTickCount();
+  std::thread captureThread(captureFrames, &cap, &ring, &captured);
+
+  int processed = 0;
+  double msLatencySum = 0;
+  double msLatencyMax = 0;
+  CapturedFrame frame;
+  while (ring.pop(frame)) {
+    json_t *pModel = pipeline.process(frame.image, argMap);
+    json_t *pLine = json_object();
+    json_object_set_new(pLine, "frame", json_integer(frame.index));
+    json_object_set(pLine, "model", pModel);
+    char *pLineStr = json_dumps(pLine, JSON_PRESERVE_ORDER|JSON_COMPACT|JSON_REAL_PRECISION(jsonPrecision));
+    cout << pLineStr << "\n";
+    free(pLineStr);
+    json_decref(pLine);
+    json_decref(pModel);
+
+    double msLatency = (cvGetTickCount() - frame.ticks)/cvGetTickFrequency()*1E-3;
+    msLatencySum += msLatency;
+    msLatencyMax = max(msLatencyMax, msLatency);
+    processed++;
+  }
+  captureThread.join();
+  cout.flush();
+
+  double secElapsed = (cvGetTickCount() - tickStart)/cvGetTickFrequency()*1E-6;
+  LOGINFO4("stream frames captured:%d processed:%d dropped:%d fps:%.1f", 
+    captured, processed, ring.getDropped(), secElapsed > 0 ? processed/secElapsed : 0.0);
+  LOGINFO2("stream latency ms mean:%.1f max:%.1f", 
+    processed ? msLatencySum/processed : 0.0, msLatencyMax);
+
+  return 0;
+}
+
+static bool endsWith(const string &str, const char *suffix) {
+  size_t len = strlen(suffix);
+  return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+static bool isImageFile(const string &path) {
+  static const char *extensions[] = {
+    ".bmp", ".jp2", ".jpeg", ".jpg", ".pbm", ".pgm", ".png", ".ppm", ".tif", ".tiff", ".webp", NULL
+  };
+  string lower(path);
+  for (size_t i = 0; i < lower.size(); i++) {
+    lower[i] = tolower(lower[i]);
+  }
+  for (int i = 0; extensions[i]; i++) {
+    if (endsWith(lower, extensions[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Append the files matching a glob pattern or contained in a directory, in sorted order
+ */
+static void globPaths(const string &pattern, vector<string> &paths, bool imagesOnly) {
+#ifdef HAVE_CV_GLOB
+  vector<String> files;
+  cv::glob(pattern, files, false);
+  for (size_t i = 0; i < files.size(); i++) {
+    if (!imagesOnly || isImageFile(files[i])) {
+      paths.push_back(files[i]);
+    }
+  }
+#else
+  LOGERROR1("%s: directories and glob patterns require OpenCV 2.4.4 or later", pattern.c_str());
+#endif
+}
+
+/**
+ * Expand a directory, glob pattern or list file into image paths
+ * @return false if imagePath is a single image
+ */
+static bool expandImagePaths(const char *imagePath, vector<string> &paths) {
+  string path(imagePath);
+  struct stat pathStat;
+  bool exists = stat(imagePath, &pathStat) == 0;
+  if (exists && (pathStat.st_mode & S_IFMT) == S_IFDIR) {
+    globPaths(path, paths, true);
+  } else if (exists && (endsWith(path, ".txt") || endsWith(path, ".lst"))) {
+    ifstream ifs(imagePath);
+    string line;
+    while (getline(ifs, line)) {
+      size_t begin = line.find_first_not_of(" \t\r");
+      size_t end = line.find_last_not_of(" \t\r");
+      if (begin != string::npos && line[begin] != '#') {
+        paths.push_back(line.substr(begin, end+1-begin));
+      }
+    }
+  } else if (path.find_first_of("*?[") != string::npos) {
+    globPaths(path, paths, false);
+  } else {
+    return false;
+  }
+  LOGDEBUG2("expandImagePaths(%s) %d images", imagePath, (int) paths.size());
+  return true;
+}
+
+/**
+ * Image paths and results shared by batch workers. Lines are written in input order.
+ */
+typedef struct ImageBatch {
+  Pipeline *pPipeline;
+  ArgMap *pArgMap;
+  const char *outputTemplate;
+  int jsonPrecision;
+  vector<string> paths;
+  vector<string> lines;
+  vector<bool> done;
+  size_t nextLine;
+  std::atomic<int> nextPath;
+  std::atomic<int> errors;
+  std::mutex outMutex;
+} ImageBatch;
+
+/**
+ * Load a pipeline definition, which must be a JSON array of stages
+ * @return NULL if the definition cannot be used, with errMsg set
+ */
+static json_t *loadPipelineJson(const char *path, string &errMsg) {
+  json_error_t jerr;
+  json_t *pJson = json_load_file(path, 0, &jerr);
+  if (!pJson) {
+    errMsg = string("cannot parse pipeline ") + path + ": " + jerr.text;
+  } else if (!json_is_array(pJson)) {
+    errMsg = string("expected JSON array of stages in pipeline ") + path;
+    json_decref(pJson);
+    pJson = NULL;
+  }
+  return pJson;
+}
+
+/**
+ * Process a decoded image and write its output image, if any
+ */
+static void batchImage(ImageBatch *pBatch, int index, Mat &image, json_t *pLine, string &errMsg) {
+  const string &path = pBatch->paths[index];
+  vector<Mat> images(1, image);
+  vector<ArgMap> argMaps(1, *pBatch->pArgMap);
+  vector<json_t *> models = pBatch->pPipeline->processBatch(images, argMaps, 1);
+  json_object_set_new(pLine, "model", models[0]);
+  if (pBatch->outputTemplate) {
+    size_t slash = path.find_last_of("/\\");
+    string file = slash == string::npos ? path : path.substr(slash+1);
+    size_t dot = file.find_last_of('.');
+    string name = file.substr(0, dot);
+    string ext = dot == string::npos ? "" : file.substr(dot+1);
+    char indexStr[32];
+    snprintf(indexStr, sizeof(indexStr), "%d", index);
+    ArgMap outputArgs;
+    outputArgs["name"] = name.c_str();
+    outputArgs["ext"] = ext.c_str();
+    outputArgs["index"] = indexStr;
+    string outputPath = jo_parse(pBatch->outputTemplate, "", outputArgs);
+    if (imwrite(outputPath, images[0])) {
+      json_object_set_new(pLine, "output", json_string(outputPath.c_str()));
+    } else {
+      errMsg = "imwrite failed: " + outputPath;
+    }
+  }
+}
+
+static string batchLine(ImageBatch *pBatch, int index) {
+  const string &path = pBatch->paths[index];
+  json_t *pLine = json_object();
+  json_object_set_new(pLine, "path", json_string(path.c_str()));
+  string errMsg;
+  try {
+    Mat image = imread(path);
+    if (!image.data) {
+      errMsg = "imread failed";
+    } else {
+      batchImage(pBatch, index, image, pLine, errMsg);
+    }
+  } catch (exception &ex) {
+    errMsg = ex.what();
+  } catch (const char *msg) {
+    errMsg = msg;
+  }
+  if (!errMsg.empty()) {
+    LOGERROR2("batch %s: %s", path.c_str(), errMsg.c_str());
+    json_object_set_new(pLine, "error", json_string(errMsg.c_str()));
+    pBatch->errors++;
+  }
+  char *pLineStr = json_dumps(pLine, JSON_PRESERVE_ORDER|JSON_COMPACT|JSON_REAL_PRECISION(pBatch->jsonPrecision));
+  string line(pLineStr);
+  free(pLineStr);
+  json_decref(pLine);
+  return line;
+}
+
+/**
+ * Decode, process and encode images until none are left, writing completed lines in input order
+ */
+static void batchWorker(ImageBatch *pBatch) {
+  int nPaths = (int) pBatch->paths.size();
+  for (int i = pBatch->nextPath++; i < nPaths; i = pBatch->nextPath++) {
+    string line = batchLine(pBatch, i);
+    std::lock_guard<std::mutex> lock(pBatch->outMutex);
+    pBatch->lines[i] = line;
+    pBatch->done[i] = true;
+    while (pBatch->nextLine < pBatch->lines.size() && pBatch->done[pBatch->nextLine]) {
+      cout << pBatch->lines[pBatch->nextLine] << "\n";
+      pBatch->lines[pBatch->nextLine].clear();
+      pBatch->nextLine++;
+    }
+  }
+}
+
+/**
+ * Multiple image example of FireSight lib_firesight library use
+ */
+static int uiBatch(const char * pipelinePath, vector<string> &paths, const char *outputTemplate, 
+  ArgMap &argMap, int workers, int jsonPrecision) 
+{
+  if (outputTemplate && !strstr(outputTemplate, "{{")) {
+    LOGERROR1("expected -o template with {{name}} or {{index}} for multiple images: %s", outputTemplate);
+    exit(-1);
+  }
+  if (paths.empty()) {
+    LOGERROR("no images to process");
+    exit(-1);
+  }
+  string errMsg;
+  json_t *pPipelineJson = *pipelinePath ?
+    loadPipelineJson(pipelinePath, errMsg) : json_loads("[{\"op\":\"nop\"}]", 0, NULL);
+  if (!pPipelineJson) {
+    LOGERROR1("%s", errMsg.c_str());
+    exit(-1);
+  }
+  Pipeline pipeline(pPipelineJson);
+  json_decref(pPipelineJson);
+  ImageBatch batch;
+  batch.pPipeline = &pipeline;
+  batch.pArgMap = &argMap;
+  batch.outputTemplate = outputTemplate;
+  batch.jsonPrecision = jsonPrecision;
+  batch.paths.swap(paths);
+  batch.lines.resize(batch.paths.size());
+  batch.done.resize(batch.paths.size(), false);
+  batch.nextLine = 0;
+  batch.nextPath = 0;
+  batch.errors = 0;
+
+  if (workers <= 0) {
+    workers = max(1, (int) std::thread::hardware_concurrency());
+  }
+  workers = max(1, min(workers, (int) batch.paths.size()));
+  long long tickStart = cvGetTickCount();
+  vector<std::thread> threads;
+  for (int w = 0; w < workers; w++) {
+    threads.push_back(std::thread(batchWorker, &batch));
+  }
+  for (int w = 0; w < workers; w++) {
+    threads[w].join();
+  }
+  cout.flush();
+
+  double secElapsed = (cvGetTickCount() - tickStart)/cvGetTickFrequency()*1E-6;
+  LOGINFO4("batch images:%d errors:%d workers:%d images/s:%.1f", (int) batch.paths.size(), 
+    (int) batch.errors, workers, secElapsed > 0 ? batch.paths.size()/secElapsed : 0.0);
+
+  return batch.errors ? -1 : 0;
+}
+
+#ifndef WIN32
+/**
+ * Pipeline parsed from a file, reparsed when the file changes
+ */
+typedef struct CachedPipeline {
+  time_t mtime;
+  std::shared_ptr<Pipeline> pPipeline;
+} CachedPipeline;
+
+static std::mutex pipelineCacheMutex;
+static map<string, CachedPipeline> pipelineCache;
+
+static std::shared_ptr<Pipeline> cachedPipeline(const string &path, string &errMsg) {
+  struct stat pathStat;
+  if (stat(path.c_str(), &pathStat) != 0) {
+    errMsg = "pipeline not found: " + path;
+    return std::shared_ptr<Pipeline>();
+  }
+  std::lock_guard<std::mutex> lock(pipelineCacheMutex);
+  CachedPipeline &cached = pipelineCache[path];
+  if (!cached.pPipeline || cached.mtime != pathStat.st_mtime) {
+    json_t *pJson = loadPipelineJson(path.c_str(), errMsg);
+    if (!pJson) {
+      pipelineCache.erase(path);
+      return std::shared_ptr<Pipeline>();
+    }
+    cached.pPipeline = std::shared_ptr<Pipeline>(new Pipeline(pJson));
+    cached.mtime = pathStat.st_mtime;
+    json_decref(pJson);
+    LOGINFO1("serve() loaded pipeline %s", path.c_str());
+  }
+  return cached.pPipeline; // requests in progress keep a replaced pipeline alive
+}
+
+static bool base64Decode(const char *pSrc, vector<uchar> &bytes) {
+  static const string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  unsigned int bits = 0;
+  int nBits = 0;
+  for (; *pSrc && *pSrc != '='; pSrc++) {
+    size_t value = alphabet.find(*pSrc);
+    if (value == string::npos) {
+      if (isspace(*pSrc)) {
+        continue;
+      }
+      return false;
+    }
+    bits = (bits << 6) | (unsigned int) value;
+    nBits += 6;
+    if (nBits >= 8) {
+      nBits -= 8;
+      bytes.push_back((uchar) (bits >> nBits));
+    }
+  }
+  return true;
+}
+
+static int interruptPipe[2] = {-1, -1};
+
+static void onServeInterrupt(int signum) {
+  int savedErrno = errno;
+  isInterrupted = 1;
+  if (write(interruptPipe[1], "", 1) < 0) {
+    // pipe is full, poll() will return anyway
+  }
+  errno = savedErrno;
+}
+
+/**
+ * Process one request line and return the reply line
+ */
+static string serveRequest(const string &request, ArgMap &defaultArgs, int jsonPrecision) {
+  json_error_t jerr;
+  json_t *pRequest = json_loads(request.c_str(), 0, &jerr);
+  json_t *pReply = NULL;
+  string errMsg;
+  if (!json_is_object(pRequest)) {
+    errMsg = "expected JSON object";
+  } else {
+    string pipelinePath = jo_string(pRequest, "pipeline");
+    string imagePath = jo_string(pRequest, "image");
+    json_t *pImageBytes = json_object_get(pRequest, "imageBytes");
+    json_t *pArgs = json_object_get(pRequest, "args");
+    ArgMap argMap(defaultArgs);
+    if (json_is_object(pArgs)) {
+      const char *key;
+      json_t *pValue;
+      json_object_foreach(pArgs, key, pValue) {
+        if (json_is_string(pValue)) {
+          argMap[key] = json_string_value(pValue);
+        }
+      }
+    }
+    std::shared_ptr<Pipeline> pPipeline = cachedPipeline(pipelinePath, errMsg);
+    Mat image;
+    try {
+      if (!pPipeline) {
+        // errMsg is set
+      } else if (json_is_string(pImageBytes)) {
+        vector<uchar> bytes;
+        if (base64Decode(json_string_value(pImageBytes), bytes) && !bytes.empty()) {
+          image = imdecode(bytes, CV_LOAD_IMAGE_COLOR);
+        }
+        if (!image.data) {
+          errMsg = "could not decode imageBytes";
+        }
+      } else if (!imagePath.empty()) {
+        image = imread(imagePath);
+        if (!image.data) {
+          errMsg = "could not read image: " + imagePath;
+        }
+      } else {
+        errMsg = "expected image or imageBytes";
+      }
+      if (errMsg.empty()) {
+        vector<Mat> images(1, image);
+        vector<ArgMap> argMaps(1, argMap);
+        pReply = pPipeline->processBatch(images, argMaps, 1)[0];
+      }
+    } catch (exception &ex) {
+      errMsg = ex.what();
+    } catch (const char *msg) {
+      errMsg = msg;
+    }
+  }
+  if (!pReply) {
+    LOGERROR1("serve() %s", errMsg.c_str());
+    pReply = json_object();
+    json_object_set_new(pReply, "error", json_string(errMsg.c_str()));
+  }
+  char *pReplyStr = json_dumps(pReply, JSON_PRESERVE_ORDER|JSON_COMPACT|JSON_REAL_PRECISION(jsonPrecision));
+  string reply(pReplyStr);
+  free(pReplyStr);
+  json_decref(pReply);
+  json_decref(pRequest);
+  return reply;
+}
+
+static bool sendAll(int fd, const string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+/**
+ * Connections being served, so that they can be closed when the server stops
+ */
+typedef struct ServeConnections {
+  std::mutex connMutex;
+  std::condition_variable idle;
+  set<int> fds;
+} ServeConnections;
+
+/**
+ * Reply to each request line of a connection in turn
+ */
+static void serveConnection(int fd, ArgMap *pArgMap, int jsonPrecision, ServeConnections *pConns) {
+  string pending;
+  char buf[65536];
+  for (;;) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    pending.append(buf, n);
+    size_t eol;
+    bool ok = true;
+    while (ok && (eol = pending.find('\n')) != string::npos) {
+      string request = pending.substr(0, eol);
+      pending.erase(0, eol+1);
+      if (request.find_first_not_of(" \t\r") != string::npos) {
+        ok = sendAll(fd, serveRequest(request, *pArgMap, jsonPrecision) + "\n");
+      }
+    }
+    if (ok && pending.size() > SERVE_MAX_REQUEST) {
+      LOGERROR1("serve() request exceeds %d bytes", SERVE_MAX_REQUEST);
+      sendAll(fd, "{\"error\":\"request too long\"}\n");
+      ok = false;
+    }
+    if (!ok) {
+      break;
+    }
+  }
+  std::lock_guard<std::mutex> lock(pConns->connMutex);
+  pConns->fds.erase(fd);
+  close(fd); // after erase, since accept() may reuse fd
+  pConns->idle.notify_all();
+}
+
+/**
+ * Server example of FireSight lib_firesight library use.
+ * Connections are served concurrently; pipelines stay parsed and template, reference image
+ * and calibration caches stay warm between requests.
+ */
+static int uiServe(const char *socketPath, ArgMap &argMap, int jsonPrecision) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    LOGERROR1("socket path is too long: %s", socketPath);
+    return -1;
+  }
+  strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path)-1);
+  struct stat pathStat;
+  if (lstat(socketPath, &pathStat) == 0) {
+    if (!S_ISSOCK(pathStat.st_mode)) {
+      LOGERROR1("Could not serve socket %s: file exists and is not a socket", socketPath);
+      return -1;
+    }
+    unlink(socketPath); // left by a previous server
+  }
+  int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (serverFd < 0 || bind(serverFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(serverFd, 16) != 0) {
+    LOGERROR2("Could not serve socket %s: %s", socketPath, strerror(errno));
+    return -1;
+  }
+
+  // SIGINT and SIGTERM wake poll() through a self-pipe, so none can be missed between
+  // the isInterrupted check and waiting for a connection
+  if (pipe(interruptPipe) != 0) {
+    LOGERROR1("serve() pipe failed: %s", strerror(errno));
+    close(serverFd);
+    return -1;
+  }
+  fcntl(interruptPipe[1], F_SETFL, O_NONBLOCK);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onServeInterrupt;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  LOGINFO1("serve() listening on %s", socketPath);
+
+  // connection threads inherit a mask that leaves the signals to this thread
+  sigset_t interruptSignals;
+  sigset_t oldSignals;
+  sigemptyset(&interruptSignals);
+  sigaddset(&interruptSignals, SIGINT);
+  sigaddset(&interruptSignals, SIGTERM);
+
+  ServeConnections conns;
+  while (!isInterrupted) {
+    struct pollfd pollFds[2];
+    pollFds[0].fd = serverFd;
+    pollFds[0].events = POLLIN;
+    pollFds[1].fd = interruptPipe[0];
+    pollFds[1].events = POLLIN;
+    if (poll(pollFds, 2, -1) < 0) {
+      if (errno != EINTR) {
+        LOGERROR1("serve() poll failed: %s", strerror(errno));
+        break;
+      }
+      continue;
+    }
+    if (!(pollFds[0].revents & POLLIN)) {
+      continue;
+    }
+    int fd = accept(serverFd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        LOGERROR1("serve() accept failed: %s", strerror(errno));
+      }
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(conns.connMutex);
+    conns.fds.insert(fd);
+    pthread_sigmask(SIG_BLOCK, &interruptSignals, &oldSignals);
+    std::thread(serveConnection, fd, &argMap, jsonPrecision, &conns).detach();
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+  }
+
+  close(interruptPipe[0]);
+  close(interruptPipe[1]);
+  close(serverFd);
+  unlink(socketPath);
+  std::unique_lock<std::mutex> lock(conns.connMutex);
+  for (set<int>::iterator it = conns.fds.begin(); it != conns.fds.end(); it++) {
+    shutdown(*it, SHUT_RD); // requests in progress are still answered
+  }
+  while (!conns.fds.empty()) {
+    conns.idle.wait(lock);
+  }
+  LOGINFO1("serve() stopped %s", socketPath);
+  return 0;
+}
+#else
+static int uiServe(const char *socketPath, ArgMap &argMap, int jsonPrecision) {
+  LOGERROR("-serve requires Unix domain sockets");
+  return -1;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
   UIMode uimode;
@@ -237,11 +1013,26 @@ int main(int argc, char *argv[])
   bool isTime;
   int jsonIndent = 2;
   int jsonPrecision = 6;
-  bool argsOk = parseArgs(argc, argv, pipelinePath, imagePath, outputPath, uimode, argMap, isTime, jsonIndent, jsonPrecision);
+  char * streamSource = NULL;
+  int ringSize = STREAM_RING_SIZE;
+  bool isDrop = false;
+  int workers = 0;
+  char * servePath = NULL;
+  bool argsOk = parseArgs(argc, argv, pipelinePath, imagePath, outputPath, uimode, argMap, isTime, jsonIndent, jsonPrecision,
+    streamSource, ringSize, isDrop, workers, servePath);
   if (!argsOk) {
     help();
     exit(-1);
   }
+  if (uimode == UI_STREAM && outputPath) {
+    LOGERROR("-o is not supported with -stream; use an imwrite stage to save frames");
+    exit(-1);
+  }
+
+  vector<string> imagePaths;
+  if (uimode == UI_STILL && imagePath && expandImagePaths(imagePath, imagePaths)) {
+    return uiBatch(pipelinePath.c_str(), imagePaths, outputPath, argMap, workers, jsonPrecision);
+  }
 
   Mat image;
   if (imagePath) {
@@ -262,6 +1053,11 @@ int main(int argc, char *argv[])
     case UI_VIDEO: 
       uiVideo(pipelinePath.c_str(), argMap); 
       break;
+    case UI_STREAM: 
+      uiStream(pipelinePath.c_str(), streamSource, argMap, ringSize, isDrop, jsonPrecision); 
+      break;
+    case UI_SERVE: 
+      return uiServe(servePath, argMap, jsonPrecision); 
     default: 
       LOGERROR("Unknown UI mode");
       exit(-1);
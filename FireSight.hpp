@@ -2,8 +2,10 @@
 #define FIRESIGHT_HPP
 
 #include "opencv2/features2d/features2d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
 #include <vector>
 #include <map>
+#include <future>
 #ifdef _MSC_VER
 #include "winjunk.hpp"
 #else
@@ -56,6 +58,12 @@ namespace firesight {
 
       void scan(Mat &matRGB, vector<MatchedRegion> &matches, float maxEllipse = 1.05, float maxCovar = 2.0);
 
+      /**
+       * Scan with a precomputed grayscale version of matRGB (e.g., Model::gray())
+       */
+      void scan(Mat &matRGB, const Mat &matGray, vector<MatchedRegion> &matches,
+                float maxEllipse = 1.05, float maxCovar = 2.0);
+
     private:
       int _showMatches;
       MSER mser;
@@ -88,6 +96,11 @@ namespace firesight {
   typedef class HoughCircle {
 #define CIRCLE_SHOW_NONE 0 /* do not show circles */
 #define CIRCLE_SHOW_ALL 1  /* show all circles */
+#define CIRCLE_FILTER_NONE 0          /* detect on unfiltered gray image */
+#define CIRCLE_FILTER_GAUSSIAN 1      /* GaussianBlur */
+#define CIRCLE_FILTER_MEDIAN 2        /* medianBlur */
+#define CIRCLE_FILTER_BILATERAL 3     /* bilateralFilter */
+#define CIRCLE_FILTER_BILATERAL_FAST 4 /* bilateralFilter at half resolution */
     public:
       HoughCircle(int minDiameter, int maxDiameter);
 
@@ -99,10 +112,32 @@ namespace firesight {
       void setShowCircles(int show);
 
       void scan(Mat &matRGB, vector<Circle> &circles);
+
+      /**
+       * Scan with a precomputed grayscale version of matRGB (e.g., Model::gray())
+       */
+      void scan(Mat &matRGB, const Mat &matGray, vector<Circle> &circles);
       
       void setFilterParams( int d, double sigmaColor, double sigmaSpace);
       void setHoughParams(double dp, double minDist, double param1, double param2);
 
+      /**
+       * @param filter applied to gray image before detection. Default is CIRCLE_FILTER_NONE
+       * @param ksize aperture of CIRCLE_FILTER_GAUSSIAN and CIRCLE_FILTER_MEDIAN
+       */
+      void setFilter(int filter, int ksize);
+
+      /**
+       * Only search the given image region. Circle coordinates remain relative to the image.
+       */
+      void setROI(Rect roi);
+
+      /**
+       * Detect circles on an image reduced by pyrDown() the given number of times,
+       * then refine each circle at full resolution in a window around it.
+       */
+      void setPyramid(int levels);
+
     private:
       int _showCircles;
       int minDiam;
@@ -110,6 +145,15 @@ namespace firesight {
       vector<Circle> circles;
 
       void show(Mat & image, vector<Circle> circles);
+      void filterImage(Mat &matGray, Mat &matFiltered);
+      void detect(Mat &matGray, int minRadius, int maxRadius, double minDist, vector<Vec3f> &found);
+      bool refine(Mat &matGray, Vec3f &circle, double tolerance);
+
+      // prefilter
+      int filter;
+      int filter_ksize;
+      Rect roi;
+      int pyramid;
 
       // bilateral filter parameters
       int bf_d;
@@ -130,22 +174,136 @@ namespace firesight {
       XY(double x_, double y_): x(x_), y(y_) {}
   } XY;
 
+  /**
+   * Compute residuals of n points (x[i],y[i]) for the hypothesis defined by sample points
+   */
+  typedef void (*RANSACResiduals)(const XY *sample, const double *x, const double *y, size_t n, double *err);
+
+  /**
+   * Work done by one RANSAC pass
+   */
+  typedef struct RANSACStats {
+      int64 iterations;   // hypotheses evaluated
+      size_t points;      // points given
+      size_t inliers;     // inliers of best hypothesis
+      bool converged;     // true if confidence was reached within the budget
+      RANSACStats(): iterations(0), points(0), inliers(0), converged(false) {}
+  } RANSACStats;
+
   typedef class Pt2Res {
       public:
 
-          Pt2Res() {}
-          double getResolution(double thr1, double thr2, double confidence, double separation, vector<XY> coords);
+          /**
+           * @param seed of the random sample generator. Results are repeatable for a given seed.
+           * @param maxIterations maximum hypotheses evaluated by each RANSAC pass
+           * @param maxMillis maximum time spent by getResolution(), or 0 for no limit.
+           * Time limits are checked between rounds and make results depend on machine speed.
+           */
+          Pt2Res(uint64 seed=0x5EED, int64 maxIterations=100000, double maxMillis=0) :
+              seed(seed), maxIterations(maxIterations), maxMillis(maxMillis), tickStart(0), millis(0) {}
+          double getResolution(double thr1, double thr2, double confidence, double separation, const vector<XY> &coords);
+
+          /** RANSAC line pass of the most recent getResolution() */
+          const RANSACStats &getLineStats() const { return lineStats; }
+          /** RANSAC pattern pass of the most recent getResolution() */
+          const RANSACStats &getPatternStats() const { return patternStats; }
+          /** milliseconds spent by the most recent getResolution() */
+          double getMillis() const { return millis; }
       private:
+          uint64 seed;
+          int64 maxIterations;
+          double maxMillis;
+          int64 tickStart;
+          double millis;
+          RANSACStats lineStats;
+          RANSACStats patternStats;
+          bool isTimeExceeded();
           static bool compare_XY_by_x(XY a, XY b);
           static bool compare_XY_by_y(XY a, XY b);
           int nsamples_RANSAC(size_t ninl, size_t xlen, unsigned int NSAMPL, double confidence);
-          static double _RANSAC_line(XY * x, size_t nx, XY C);
-          static double _RANSAC_pattern(XY * x, size_t nx, XY C);
-          vector<XY> RANSAC_2D(unsigned int NSAMPL, vector<XY> coords, double thr, double confidence, double(*err_fun)(XY *, size_t, XY));
-          void least_squares(vector<XY> xy, double * a, double * b);
+          static void _RANSAC_line(const XY *sample, const double *x, const double *y, size_t n, double *err);
+          static void _RANSAC_pattern(const XY *sample, const double *x, const double *y, size_t n, double *err);
+          vector<XY> RANSAC_2D(unsigned int NSAMPL, const vector<XY> &coords, double thr, double confidence,
+                             RANSACResiduals residuals, RANSACStats &stats);
+          void least_squares(const vector<XY> &xy, double * a, double * b);
 
   } Pt2Res;
 
+  /**
+   * Camera calibration saved by matchGrid and shared by undistort and warpPerspective.
+   * Remap tables are computed once for the most recently requested image size.
+   */
+  typedef class CLASS_DECLSPEC Calibration {
+    public:
+      Calibration(json_t *pCalibrate);
+
+      /**
+       * Return remap tables equivalent to undistort().
+       * @return false if there is no camera matrix or distortion coefficients
+       */
+      bool undistortMaps(Size size, Mat &map1, Mat &map2);
+
+      /**
+       * Return remap tables equivalent to warpPerspective().
+       * @return false if there is no perspective matrix
+       */
+      bool perspectiveMaps(Size size, Mat &map1, Mat &map2);
+
+    public:
+      Mat cameraMatrix;
+      Mat distCoeffs;
+      Mat perspective;
+
+    private:
+      Mutex mapMutex;
+      Size undistortSize;
+      Mat undistortMap1;
+      Mat undistortMap2;
+      Size perspectiveSize;
+      Mat perspectiveMap1;
+      Mat perspectiveMap2;
+  } Calibration;
+
+  /**
+   * Process-wide cache of calibration files keyed by path.
+   * Files are reloaded when their modification time changes.
+   */
+  typedef class CLASS_DECLSPEC CalibrationStore {
+    public:
+      static const int VERSION = 1;
+
+      /**
+       * Write the given matchGrid "calibrate" JSON object to a versioned file.
+       * @return error message or empty string
+       */
+      static string save(const char *path, json_t *pCalibrate);
+
+      /**
+       * Return cached calibration for the given file, loading it as required.
+       * @return empty pointer on error
+       */
+      static Ptr<Calibration> load(const char *path, string &errMsg);
+
+      static void clear();
+  } CalibrationStore;
+
+  /**
+   * Process-wide cache of images read from disk (e.g., templates and reference images)
+   * keyed by path and color mode. Files are reloaded when their modification time changes.
+   */
+  typedef class CLASS_DECLSPEC ImageStore {
+    public:
+      /**
+       * Return cached image for the given file, reading it as required.
+       * Callers must not modify the result.
+       * @param grayscale read a single channel image instead of a color image
+       * @return empty image on error
+       */
+      static Mat load(const char *path, string &errMsg, bool grayscale=false);
+
+      static void clear();
+  } ImageStore;
+
 #ifdef LGPL2_1
   typedef struct QRPayload {
       double x, y;
@@ -169,15 +327,63 @@ namespace firesight {
       public:
           ZbarQrDecode() {}
           vector<QRPayload> scan(Mat &img, int show);
+          vector<QRPayload> scan(Mat &img, const Mat &img_gray, int show);
   } ZbarQrDecode;
 #endif // LGPL2_1
 
   typedef class StageData {
     public:
       StageData(string stageName);
-      ~StageData();
+      virtual ~StageData();
   } StageData, *StageDataPtr;
 
+  /**
+   * Binary image packed one bit per pixel. Bit c%64 of word c/64 of a row holds column c.
+   * Bits past the last column are always zero.
+   */
+  typedef class CLASS_DECLSPEC BitImage {
+    public:
+      BitImage() : rows(0), cols(0), stride(0), maxval(255) {}
+      void create(int rows, int cols);
+      inline bool empty() const { return rows == 0; }
+      inline uint64 *ptr(int r) { return &words[(size_t)r*stride]; }
+      inline const uint64 *ptr(int r) const { return &words[(size_t)r*stride]; }
+
+      /**
+       * Pack 8-bit single channel image pixels greater than thresh,
+       * or not greater than thresh if invert is true.
+       * @param maxval value of set pixels when unpacked
+       */
+      void pack(const Mat &image, int thresh, bool invert, int maxval=255);
+
+      /** Unpack into an 8-bit single channel image of 0 and maxval */
+      void unpack(Mat &image) const;
+
+      /**
+       * Erode or dilate with the given structuring element centered on its anchor.
+       * Pixels outside the image do not affect the result, as with OpenCV's default border.
+       */
+      void erode(int shape, Size ksize, int iterations=1);
+      void dilate(int shape, Size ksize, int iterations=1);
+
+      /** Return true if erode() and dilate() support the given MORPH_* shape */
+      static bool isSupportedShape(int shape);
+
+    public:
+      int rows;
+      int cols;
+      int stride; // words per row
+      int maxval;
+
+    private:
+      vector<uint64> words;
+      void morphologyOnce(bool isErode, int shape, Size ksize, Point anchor);
+      void morphology(bool isErode, int shape, Size ksize, int iterations);
+      void rowPass(bool isErode, int kwidth, int anchor, BitImage &dst) const;
+      void colPass(bool isErode, int kheight, int anchor, BitImage &dst) const;
+      void clearPadding();
+  } BitImage;
+
   typedef class Model {
     private:
       json_t *pJson;
@@ -198,16 +404,105 @@ namespace firesight {
         }
       };
 
+      /**
+       * Unpack bits into image. Stages that do not handle packed binary images call this
+       * before using image.
+       */
+      void syncImage();
+
+      /**
+       * Invalidate images derived from image. The pipeline calls this after each stage
+       * that may change image. Derived images are also invalidated if image is reassigned.
+       */
+      void imageChanged();
+
+      /** Return the number of times imageChanged() has been called */
+      inline unsigned long getImageVersion() { return imageVersion; }
+
+      /**
+       * Return image converted to gray with CV_BGR2GRAY or CV_RGB2GRAY.
+       * The conversion is done at most once per image version. Callers must not modify the result.
+       */
+      const Mat &gray(int code=CV_BGR2GRAY);
+
+      /** Return integral and squared integral of gray(), computed at most once per image version */
+      void integral(Mat &sum, Mat &sqsum);
+
+      /** Return Gaussian pyramid level of gray(). Level 0 is gray() itself. */
+      const Mat &pyramid(int level);
+
     public: // fields
       Mat image;
+      BitImage bits; // if not empty, supersedes image
       map<string, Mat> imageMap;
       map<string, StageDataPtr> stageDataMap;
       ArgMap argMap;
+
+    private:
+      unsigned long imageVersion;
+      unsigned long derivedVersion;
+      uchar *derivedData;
+      map<int, Mat> grayMap;
+      Mat sumImage;
+      Mat sqsumImage;
+      vector<Mat> pyramidImages;
+      void validateDerived();
   } Model;
 
+  /**
+   * State of a gate stage kept across frames: the downscaled gray image of the last
+   * frame that passed the gate, and the stage models and images of the gate-sensitive
+   * stages that processed it.
+   */
+  typedef class GateStageData : public StageData {
+    public:
+      Mat reference;
+      bool open;
+
+      GateStageData(string stageName);
+      ~GateStageData();
+
+      /**
+       * Save the stage model and output image (if any) of a gate-sensitive stage
+       */
+      void save(const string &name, json_t *pStageModel, const Mat &image);
+
+      /**
+       * Copy the saved stage model marked "reused":true and restore the saved image, if any
+       * @return false if nothing was saved for the stage
+       */
+      bool reuse(const string &name, json_t *pStageModel, Model &model);
+
+    private:
+      map<string, json_t *> stageModels;
+      map<string, Mat> stageImages;
+  } GateStageData;
+
+  /**
+   * Working image and model of an image processed by Pipeline::submit()
+   */
+  typedef struct FrameResult {
+      Mat image;
+      json_t *pModel; // caller must json_decref()
+
+      FrameResult() : pModel(NULL) {}
+  } FrameResult;
+
+  class PipelineStream;
+
   typedef class CLASS_DECLSPEC Pipeline {
     protected:
       bool processModel(Model &model);
+      bool processStages(Model &model, size_t begin, size_t end);
+      json_t *processBatchImage(Mat &workingImage, ArgMap &argMap, Mat &input);
+      friend class BatchBody;
+      friend class PipelineStream;
+      void stopStream();
+      size_t processFused(size_t index, size_t nStages, Model &model);
+      size_t processTiles(size_t index, size_t nStages, Model &model);
+      size_t processTiled(size_t index, size_t nStages, Model &model);
+      bool processTile(size_t begin, size_t end, Mat &image, ArgMap &argMap);
+      friend class TiledRunBody;
       bool stageOK(const char *fmt, const char *errMsg, json_t *pStage, json_t *pStageModel);
       KeyPoint _regionKeypoint(const vector<Point> &region);
       void _eigenXY(const vector<Point> &pts, Mat &eigenvectorsOut, Mat &meanOut, Mat &covOut);
@@ -222,6 +517,7 @@ namespace firesight {
       bool apply_calcOffset(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_Canny(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_circle(json_t *pStage, json_t *pStageModel, Model &model);
+      bool apply_components(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_convertTo(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_cout(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_crop(json_t *pStage, json_t *pStageModel, Model &model);
@@ -229,11 +525,14 @@ namespace firesight {
       bool apply_dft(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_dftSpectrum(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_dilate(json_t *pStage, json_t *pStageModel, Model &model);
+      bool apply_dirtyTiles(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_drawKeypoints(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_drawRects(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_equalizeHist(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_erode(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_FireSight(json_t *pStage, json_t *pStageModel, Model &model);
+      bool apply_fitCircles(json_t *pStage, json_t *pStageModel, Model &model);
+      bool apply_gate(const char *pName, json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_HoleRecognizer(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_HoughCircles(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_points2resolution_RANSAC(json_t *pStage, json_t *pStageModel, Model &model);
@@ -256,6 +555,7 @@ namespace firesight {
       bool apply_putText(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_rectangle(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_resize(json_t *pStage, json_t *pStageModel, Model &model);
+      bool apply_roiStats(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_threshold(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_warpRing(json_t *pStage, json_t *pStageModel, Model &model);
       bool apply_SimpleBlobDetector(json_t *pStage, json_t *pStageModel, Model &model);
@@ -273,6 +573,11 @@ namespace firesight {
       int parseCvType(const char *typeName, const char *&errMsg);
       void validateImage(Mat &image);
       json_t *pPipeline;
+      map<string, StageDataPtr> stageDataMap; // stage state kept across process() calls
+      Mutex stageDataMutex; // serializes process() calls that share stageDataMap
+      PipelineStream *pStream; // stage groups of submit(), started by the first submit()
+      int submitGroups;
+      Mutex submitMutex;
 
     public: 
       enum DefinitionType { PATH, JSON };
@@ -297,11 +602,47 @@ namespace firesight {
       /**
        * Process the given working image and return a JSON object that represents
        * the recognized model comprised of the individual stage models. 
+       * Different pipelines may process images concurrently. Concurrent calls on the same
+       * pipeline are executed one at a time, since stages such as backgroundSubtractor
+       * keep state from frame to frame; use processBatch() for independent images.
        * @param mat initial and transformed working image
        * @return pointer to jansson root node of JSON object that has a field for each recognized stage model. E.g., {s1:{...}, s2:{...}, ... , sN:{...}}
        */
       json_t *process(Mat &mat, ArgMap &argMap);
 
+      /**
+       * Process the given working images concurrently on a pool of worker threads. Each worker
+       * processes one image at a time, reusing its copy of the "input" image for its next
+       * image. Other buffers are not reused: each image gets a new Model, since its JSON is
+       * returned to the caller and its derived images (e.g., Model::gray()) may be shared
+       * with stage results. Images are processed independently of each other, so stages
+       * that keep state from frame to frame (e.g., backgroundSubtractor, gate) start afresh
+       * for each image.
+       * @param images initial and transformed working images
+       * @param argMaps one ArgMap for each image, or a single ArgMap for all images
+       * @param workers number of worker threads, including the calling thread,
+       * or 0 for cv::getNumThreads()
+       * @return models in the order of images. Caller must json_decref() each model.
+       */
+      vector<json_t *> processBatch(vector<Mat> &images, vector<ArgMap> &argMaps, int workers=0);
+
+      /**
+       * Process a copy of the given image asynchronously. Consecutive groups of stages run on
+       * their own threads connected by bounded queues, so that successive images are in
+       * different stages at the same time. Results are delivered in submission order.
+       * Stages keep state from image to image as with process(), but separately from process().
+       * Blocks while the queue of the first stage group is full.
+       * @param mat working image
+       * @return result of processing the image
+       */
+      std::future<FrameResult> submit(const Mat &mat, ArgMap &argMap);
+
+      /**
+       * Set the number of stage groups (threads) used by submit(). Has no effect after the first submit().
+       * @param groups number of stage groups, or 0 for one per core
+       */
+      void setSubmitGroups(int groups);
+
   } Pipeline;
 
 } // namespace firesight
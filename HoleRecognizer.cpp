@@ -102,11 +102,14 @@ void HoleRecognizer::showMatches(int show) {
 void HoleRecognizer::scan(Mat &image, vector<MatchedRegion> &matches, float maxEllipse, float maxCovar) {
 	Mat matGray;
 	if (image.channels() == 1) {
-		image = matGray;
+		matGray = image;
 	} else {
 		cvtColor(image, matGray, CV_RGB2GRAY);
 	}
-	
+	scan(image, matGray, matches, maxEllipse, maxCovar);
+}
+
+void HoleRecognizer::scan(Mat &image, const Mat &matGray, vector<MatchedRegion> &matches, float maxEllipse, float maxCovar) {
 	Mat mask;
 	vector<vector<Point> > regions;
 	LOGTRACE1("HoleRecognizer::scan() mser()", NULL);
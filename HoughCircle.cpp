@@ -41,6 +41,9 @@ HoughCircle::HoughCircle(int minDiameter, int maxDiameter) {
 	minDiam = minDiameter;
 	maxDiam = maxDiameter;
 	_showCircles = CIRCLE_SHOW_NONE;
+	filter = CIRCLE_FILTER_NONE;
+	filter_ksize = 5;
+	pyramid = 0;
 	LOGTRACE2("HoughCircle() (maxDiam:%d minDiam:%d)", maxDiam, minDiam);
 }
 
@@ -61,21 +64,125 @@ void HoughCircle::setShowCircles(int show) {
   _showCircles = show;
 }
 
+void HoughCircle::setFilter(int filter, int ksize) {
+    this->filter = filter;
+    filter_ksize = ksize;
+}
+
+void HoughCircle::setROI(Rect roi) {
+    this->roi = roi;
+}
+
+void HoughCircle::setPyramid(int levels) {
+    pyramid = levels;
+}
+
+void HoughCircle::filterImage(Mat &matGray, Mat &matFiltered) {
+    switch (filter) {
+    case CIRCLE_FILTER_GAUSSIAN:
+        GaussianBlur(matGray, matFiltered, Size(filter_ksize, filter_ksize), 0);
+        break;
+    case CIRCLE_FILTER_MEDIAN:
+        medianBlur(matGray, matFiltered, filter_ksize);
+        break;
+    case CIRCLE_FILTER_BILATERAL:
+        bilateralFilter(matGray, matFiltered, bf_d, bf_sigmaColor, bf_sigmaSpace);
+        break;
+    case CIRCLE_FILTER_BILATERAL_FAST: {
+        // a quarter of the pixels with half the neighbourhood is roughly 1/16 of the work
+        Mat matSmall, matSmallFiltered;
+        pyrDown(matGray, matSmall);
+        bilateralFilter(matSmall, matSmallFiltered, max(1, bf_d/2), bf_sigmaColor, bf_sigmaSpace/2);
+        pyrUp(matSmallFiltered, matFiltered, matGray.size());
+        break;
+    }
+    default:
+        matFiltered = matGray;
+        break;
+    }
+}
+
+void HoughCircle::detect(Mat &matGray, int minRadius, int maxRadius, double minDist, vector<Vec3f> &found) {
+    HoughCircles(matGray, found, CV_HOUGH_GRADIENT, hc_dp, minDist, hc_param1, hc_param2, minRadius, maxRadius);
+}
+
+bool HoughCircle::refine(Mat &matGray, Vec3f &circle, double tolerance) {
+    int half = cvCeil(circle[2] + 2*tolerance) + 2;
+    Rect window(cvRound(circle[0]) - half, cvRound(circle[1]) - half, 2*half+1, 2*half+1);
+    window &= Rect(0, 0, matGray.cols, matGray.rows);
+    if (window.width < 2*half/3 || window.height < 2*half/3) {
+        return false;
+    }
+
+    int minRadius = max((int) (minDiam/2.0), cvFloor(circle[2] - tolerance));
+    int maxRadius = min(cvCeil(maxDiam/2.0), cvCeil(circle[2] + tolerance));
+    vector<Vec3f> found;
+    Mat matWindow = matGray(window);
+    // minDist spans the window so that at most one circle is returned
+    detect(matWindow, minRadius, maxRadius, 2*half+1, found);
+    if (found.empty()) {
+        return false;
+    }
+    float x = found[0][0] + window.x;
+    float y = found[0][1] + window.y;
+    float dx = x - circle[0];
+    float dy = y - circle[1];
+    if (dx*dx + dy*dy > 4*tolerance*tolerance) {
+        return false;
+    }
+    circle = Vec3f(x, y, found[0][2]);
+    return true;
+}
+
 void HoughCircle::scan(Mat &image, vector<Circle> &circles) {
-	Mat matGray, matFiltered;
+	Mat matGray;
 
 	if (image.channels() == 1) {
 		matGray = image;
 	} else {
 		cvtColor(image, matGray, CV_RGB2GRAY);
 	}
+	scan(image, matGray, circles);
+}
+
+void HoughCircle::scan(Mat &image, const Mat &matGray, vector<Circle> &circles) {
+	Mat matFiltered;
 
-    cv::bilateralFilter(matGray, matFiltered, bf_d, bf_sigmaColor, bf_sigmaSpace);
+    Rect rect(0, 0, matGray.cols, matGray.rows);
+    if (roi.width > 0 && roi.height > 0) {
+        rect &= roi;
+    }
+    if (rect.width <= 0 || rect.height <= 0) {
+        LOGTRACE("HoughCircle::scan() roi is outside image");
+        return;
+    }
+    Mat matROI = matGray(rect);
+    filterImage(matROI, matFiltered);
 	
 	vector<Vec3f> vec3f_circles;
-    HoughCircles(matGray, vec3f_circles, CV_HOUGH_GRADIENT, hc_dp, hc_minDist, hc_param1, hc_param2, minDiam/2.0, maxDiam/2.0);
+    if (pyramid > 0) {
+        double scale = 1 << pyramid;
+        Mat matPyr = matFiltered;
+        for (int i = 0; i < pyramid; i++) {
+            Mat matDown;
+            pyrDown(matPyr, matDown);
+            matPyr = matDown;
+        }
+        detect(matPyr, cvFloor(minDiam/2.0/scale), cvCeil(maxDiam/2.0/scale), hc_minDist/scale, vec3f_circles);
+        int refined = 0;
+        for (size_t i = 0; i < vec3f_circles.size(); i++) {
+            vec3f_circles[i] *= scale;
+            if (refine(matFiltered, vec3f_circles[i], scale)) {
+                refined++;
+            }
+        }
+        LOGTRACE3("HoughCircle::scan() pyramid:%d refined %d of %d circles",
+                  pyramid, refined, (int) vec3f_circles.size());
+    } else {
+        detect(matFiltered, (int) (minDiam/2.0), (int) (maxDiam/2.0), hc_minDist, vec3f_circles);
+    }
     for (size_t i = 0; i < vec3f_circles.size(); i++) {
-        circles.push_back(Circle(vec3f_circles[i][0], vec3f_circles[i][1], vec3f_circles[i][2]));
+        circles.push_back(Circle(vec3f_circles[i][0] + rect.x, vec3f_circles[i][1] + rect.y, vec3f_circles[i][2]));
     }
 
 	LOGTRACE1("HoughCircle::scan() -> found %d circles", (int) circles.size());
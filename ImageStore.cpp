@@ -0,0 +1,57 @@
+#include <string.h>
+#include <sys/stat.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+typedef struct ImageEntry {
+    time_t mtime;
+    Mat image;
+} ImageEntry;
+
+static Mutex imageMutex;
+static map<pair<string, bool>, ImageEntry> imageCache;
+
+static time_t fileModified(const char *path) {
+    struct stat st;
+    if (stat(path, &st)) {
+        return 0;
+    }
+    return st.st_mtime;
+}
+
+Mat ImageStore::load(const char *path, string &errMsg, bool grayscale) {
+    AutoLock lock(imageMutex);
+    time_t mtime = fileModified(path);
+    pair<string, bool> key(path, grayscale);
+    map<pair<string, bool>, ImageEntry>::iterator it = imageCache.find(key);
+    if (it != imageCache.end() && it->second.mtime == mtime) {
+        return it->second.image;
+    }
+
+    Mat image = imread(path, grayscale ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR);
+    if (image.data) {
+        ImageEntry entry;
+        entry.mtime = mtime;
+        entry.image = image;
+        imageCache[key] = entry;
+        LOGTRACE2("ImageStore::load(%s) %s", path, matInfo(image).c_str());
+    } else {
+        imageCache.erase(key);
+        errMsg = "ImageStore::load() could not read ";
+        errMsg += path;
+        LOGERROR1("%s", errMsg.c_str());
+    }
+
+    return image;
+}
+
+void ImageStore::clear() {
+    AutoLock lock(imageMutex);
+    imageCache.clear();
+}
@@ -14,6 +14,9 @@ using namespace firesight;
 Model::Model(ArgMap &argMap) {
   pJson = json_object();
   this->argMap = argMap;
+  imageVersion = 0;
+  derivedVersion = 0;
+  derivedData = NULL;
 }
 
 Model::~Model() {
@@ -22,3 +25,79 @@ Model::~Model() {
     delete it->second;
   }
 }
+
+void Model::syncImage() {
+  if (!bits.empty()) {
+    LOGTRACE2("Model::syncImage() unpacking %dx%d", bits.cols, bits.rows);
+    bits.unpack(image);
+    bits = BitImage();
+    imageChanged();
+  }
+}
+
+void Model::imageChanged() {
+  imageVersion++;
+}
+
+/**
+ * Release derived images of a previous image version. They are released rather than
+ * reused because stages may still share their buffers.
+ */
+void Model::validateDerived() {
+  if (derivedVersion != imageVersion || derivedData != image.data) {
+    grayMap.clear();
+    sumImage.release();
+    sqsumImage.release();
+    pyramidImages.clear();
+    derivedVersion = imageVersion;
+    derivedData = image.data;
+  }
+}
+
+const Mat &Model::gray(int code) {
+  syncImage();
+  if (image.channels() == 1) {
+    return image;
+  }
+  validateDerived();
+  // 4 channel conversions use the same weights
+  if (code == CV_BGRA2GRAY) {
+    code = CV_BGR2GRAY;
+  } else if (code == CV_RGBA2GRAY) {
+    code = CV_RGB2GRAY;
+  }
+  Mat &result = grayMap[code];
+  if (result.empty()) {
+    LOGTRACE2("Model::gray(%d) version:%d", code, (int) imageVersion);
+    cvtColor(image, result, code);
+  }
+  return result;
+}
+
+void Model::integral(Mat &sum, Mat &sqsum) {
+  const Mat &matGray = gray();
+  validateDerived();
+  if (sumImage.empty()) {
+    LOGTRACE1("Model::integral() version:%d", (int) imageVersion);
+    cv::integral(matGray, sumImage, sqsumImage, CV_64F);
+  }
+  sum = sumImage;
+  sqsum = sqsumImage;
+}
+
+const Mat &Model::pyramid(int level) {
+  const Mat &matGray = gray();
+  if (level <= 0) {
+    return matGray;
+  }
+  validateDerived();
+  if (pyramidImages.empty()) {
+    pyramidImages.push_back(matGray);
+  }
+  while ((int) pyramidImages.size() <= level) {
+    Mat down;
+    pyrDown(pyramidImages.back(), down);
+    pyramidImages.push_back(down);
+  }
+  return pyramidImages[level];
+}
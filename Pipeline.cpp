@@ -3,6 +3,7 @@
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include <thread>
 #include "FireLog.h"
 #include "FireSight.hpp"
 #include "opencv2/features2d/features2d.hpp"
@@ -217,32 +218,49 @@ bool Pipeline::apply_warpPerspective(const char *pName, json_t *pStage, json_t *
     string  borderModeStr = jo_string(pStage, "borderMode", "BORDER_REPLICATE", model.argMap);
     int borderMode;
 
-    string modelName = jo_string(pStage, "model", pName, model.argMap);
+    string calibrationPath = jo_string(pStage, "calibration", "", model.argMap);
+    Ptr<Calibration> pCalibration;
     vector<double> pm;
-    json_t *pCalibrate;
-    json_t *pCalibrateModel = json_object_get(model.getJson(false), modelName.c_str());
-    if (json_is_object(pCalibrateModel)) {
-        pCalibrate = json_object_get(pCalibrateModel, "calibrate");
-        if (!json_is_object(pCalibrate)) {
-            errMsg = "Expected \"calibrate\" JSON object in stage \"";
-            errMsg += modelName;
-            errMsg += "\"";
-        }
-    } else {
-        pCalibrate = pStage;
-    }
-	pm = jo_vectord(pCalibrate, "perspective", vector<double>(), model.argMap);
-	if (pm.size() == 0) {
-		double default_vec_d[] = {1,0,0,0,1,0,0,0,1};
-		vector<double> default_vecd(default_vec_d, default_vec_d + sizeof(default_vec_d) / sizeof(double) );
-		pm = jo_vectord(pCalibrate, "matrix", default_vecd, model.argMap);
+	if (!calibrationPath.empty()) {
+		pCalibration = CalibrationStore::load(calibrationPath.c_str(), errMsg);
+		if (errMsg.empty() && pCalibration->perspective.empty()) {
+			errMsg = "apply_warpPerspective() calibration has no perspective matrix";
+		}
+		if (errMsg.empty()) {
+			json_object_set(pStageModel, "calibration", json_string(calibrationPath.c_str()));
+			for (int i=0; i<9; i++) {
+				pm.push_back(pCalibration->perspective.at<double>(i/3, i%3));
+			}
+		}
+	} else {
+		string modelName = jo_string(pStage, "model", pName, model.argMap);
+		json_t *pCalibrate;
+		json_t *pCalibrateModel = json_object_get(model.getJson(false), modelName.c_str());
+		if (json_is_object(pCalibrateModel)) {
+			pCalibrate = json_object_get(pCalibrateModel, "calibrate");
+			if (!json_is_object(pCalibrate)) {
+				errMsg = "Expected \"calibrate\" JSON object in stage \"";
+				errMsg += modelName;
+				errMsg += "\"";
+			}
+		} else {
+			pCalibrate = pStage;
+		}
+		if (errMsg.empty()) {
+			pm = jo_vectord(pCalibrate, "perspective", vector<double>(), model.argMap);
+		}
+		if (errMsg.empty() && pm.size() == 0) {
+			double default_vec_d[] = {1,0,0,0,1,0,0,0,1};
+			vector<double> default_vecd(default_vec_d, default_vec_d + sizeof(default_vec_d) / sizeof(double) );
+			pm = jo_vectord(pCalibrate, "matrix", default_vecd, model.argMap);
+		}
 	}
 	Mat matrix = Mat::zeros(3, 3, CV_64F);
 	if (pm.size() == 9) {
 		for (int i=0; i<pm.size(); i++) {
 			matrix.at<double>(i/3, i%3) = pm[i];
 		}
-	} else {
+	} else if (errMsg.empty()) {
 		char buf[255];
 		snprintf(buf, sizeof(buf), "apply_warpPerspective() invalid perspective matrix. Elements expected:9 actual:%d",
 			(int) pm.size());
@@ -270,7 +288,14 @@ bool Pipeline::apply_warpPerspective(const char *pName, json_t *pStage, json_t *
 
     Scalar borderValue = jo_Scalar(pStage, "borderValue", Scalar::all(0), model.argMap);
 
-    if (errMsg.empty()) {
+    Mat map1;
+    Mat map2;
+    if (errMsg.empty() && !pCalibration.empty() && 
+        pCalibration->perspectiveMaps(model.image.size(), map1, map2)) {
+        Mat result;
+        remap(model.image, result, map1, map2, cv::INTER_LINEAR, borderMode, borderValue);
+        model.image = result;
+    } else if (errMsg.empty()) {
         Mat result = Mat::zeros(model.image.rows, model.image.cols, model.image.type());
         warpPerspective(model.image, result, matrix, result.size(), cv::INTER_LINEAR, borderMode, borderValue );
         model.image = result;
@@ -642,6 +667,9 @@ bool Pipeline::apply_points2resolution_RANSAC(json_t *pStage, json_t *pStageMode
     double thr2 = jo_double(pStage, "threshold2", 1.2, model.argMap);
     double confidence = jo_double(pStage, "confidence", (1.0-1e-12), model.argMap);
     double separation = jo_double(pStage, "separation", 4.0, model.argMap); // separation [mm]
+    int maxIterations = jo_int(pStage, "maxIterations", 100000, model.argMap); // per RANSAC pass
+    double maxMillis = jo_double(pStage, "maxMillis", 0, model.argMap); // 0: no time limit
+    bool stats = jo_bool(pStage, "stats", false, model.argMap);
 
     string pointsModelName = jo_string(pStage, "model", "", model.argMap);
     json_t *pPointsModel = json_object_get(model.getJson(false), pointsModelName.c_str());
@@ -687,13 +715,26 @@ bool Pipeline::apply_points2resolution_RANSAC(json_t *pStage, json_t *pStageMode
             coords.push_back(xy);
         }
 
-        Pt2Res pt2res;
+        if (maxIterations < 1) {
+            throw runtime_error("maxIterations: expected positive number");
+        }
+        Pt2Res pt2res(0x5EED, maxIterations, maxMillis);
 
         double resolution;
 
         try {
             resolution = pt2res.getResolution(thr1, thr2, confidence, separation, coords);
             json_object_set(pStageModel, "resolution", json_real(resolution));
+            if (stats) {
+                const RANSACStats &line = pt2res.getLineStats();
+                const RANSACStats &pattern = pt2res.getPatternStats();
+                json_object_set(pStageModel, "iterations",
+                                json_integer((json_int_t)(line.iterations + pattern.iterations)));
+                json_object_set(pStageModel, "inlierRatio",
+                                json_real(line.points ? (double) pattern.inliers / line.points : 0));
+                json_object_set(pStageModel, "converged", json_boolean(line.converged && pattern.converged));
+                json_object_set(pStageModel, "millis", json_real(pt2res.getMillis()));
+            }
         } catch (runtime_error &e) {
             errMsg = (char *) malloc(sizeof(char) * (strlen(e.what()) + 1));
             strcpy(errMsg, e.what());
@@ -762,7 +803,7 @@ bool Pipeline::apply_qrdecode(json_t *pStage, json_t *pStageModel, Model &model)
 
     try {
         ZbarQrDecode qr;
-        vector<QRPayload> payload = qr.scan(model.image, show);
+        vector<QRPayload> payload = qr.scan(model.image, model.gray(), show);
 
         json_t *payload_json = json_array();
         json_object_set(pStageModel, "qrdata", payload_json);
@@ -1027,12 +1068,13 @@ bool Pipeline::apply_sharpness(json_t *pStage, json_t *pStageModel, Model &model
     
     /* Apply selected method */
     double sharpness = 0;
+    Mat matGray = model.gray(CV_RGB2GRAY);
     if (strcmp("GRAS", methodStr.c_str()) == 0) {
-        sharpness = Sharpness::GRAS(model.image);
+        sharpness = Sharpness::GRAS(matGray);
     } else if (strcmp("LAPE", methodStr.c_str()) == 0) {
-        sharpness = Sharpness::LAPE(model.image);
+        sharpness = Sharpness::LAPE(matGray);
     } else if (strcmp("LAPM", methodStr.c_str()) == 0) {
-        sharpness = Sharpness::LAPM(model.image);
+        sharpness = Sharpness::LAPM(matGray);
     }
 
     json_object_set(pStageModel, "sharpness", json_real(sharpness));
@@ -1308,40 +1350,78 @@ bool Pipeline::apply_cout(json_t *pStage, json_t *pStageModel, Model &model) {
     return stageOK("apply_cout(%s) %s", errMsg, pStage, pStageModel);
 }
 
+/**
+ * Sum of squared differences of two images of the same size and type. If sseMax is
+ * positive, rows are summed one at a time, stopping as soon as the sum exceeds sseMax.
+ */
+static double imageSSE(const Mat &a, const Mat &b, double sseMax, bool &exceeded) {
+    exceeded = false;
+    if (sseMax <= 0) {
+        return norm(a, b, NORM_L2SQR);
+    }
+    double sse = 0;
+    for (int r = 0; r < a.rows; r++) {
+        sse += norm(a.row(r), b.row(r), NORM_L2SQR);
+        if (sse > sseMax) {
+            LOGTRACE2("imageSSE() exceeded %f after %d rows", sseMax, r+1);
+            exceeded = true;
+            break;
+        }
+    }
+    return sse;
+}
+
 bool Pipeline::apply_PSNR(json_t *pStage, json_t *pStageModel, Model &model) {
     validateImage(model.image);
     string path = jo_string(pStage, "path", "", model.argMap);
+    string stageStr = jo_string(pStage, "stage", "", model.argMap);
     string psnrSame = jo_string(pStage, "psnrSame", "SAME", model.argMap);
     double threshold = jo_double(pStage, "threshold", -1, model.argMap);
+    bool earlyExit = jo_bool(pStage, "earlyExit", false, model.argMap);
     const char *errMsg = NULL;
+    string errStr;
     Mat thatImage;
 
-    if (path.empty()) {
-        errMsg = "apply_PSNR() expected path for imread";
+    if (!stageStr.empty()) {
+        map<string, Mat>::iterator it = model.imageMap.find(stageStr);
+        if (it == model.imageMap.end()) {
+            errMsg = "apply_PSNR() no stage image with given name";
+        } else {
+            thatImage = it->second;
+        }
+    } else if (path.empty()) {
+        errMsg = "apply_PSNR() expected path for imread or name of stage image";
     } else {
-        thatImage = imread(path.c_str(), CV_LOAD_IMAGE_COLOR);
+        thatImage = ImageStore::load(path.c_str(), errStr);
         LOGTRACE2("apply_PSNR(%s) %s", path.c_str(), matInfo(thatImage).c_str());
-        if (thatImage.data) {
-            assert(model.image.cols == thatImage.cols);
-            assert(model.image.rows == thatImage.rows);
-            assert(model.image.channels() == thatImage.channels());
-        } else {
+        if (!thatImage.data) {
             errMsg = "apply_PSNR() imread failed";
         }
     }
+    if (!errMsg && (model.image.size() != thatImage.size() || model.image.type() != thatImage.type())) {
+        errMsg = "apply_PSNR() expected images of same size and type";
+    } else if (!errMsg && earlyExit && threshold < 0) {
+        errMsg = "apply_PSNR() earlyExit requires threshold";
+    }
 
     if (!errMsg) {
-        Mat s1;
-        absdiff(model.image, thatImage, s1);  // |I1 - I2|
-        s1.convertTo(s1, CV_32F);              // cannot make a square on 8 bits
-        s1 = s1.mul(s1);                       // |I1 - I2|^2
-        Scalar s = sum(s1);                   // sum elements per channel
-        double sse = s.val[0] + s.val[1] + s.val[2]; // sum channels
+        double peak = 255; // for all depths, as in earlier versions
+        double count = (double)(model.image.channels() * model.image.total());
+        // PSNR < threshold if and only if SSE > sseMax
+        double sseMax = earlyExit ? count * peak * peak / pow(10.0, threshold/10) : 0;
+        bool exceeded;
+        double sse = imageSSE(model.image, thatImage, sseMax, exceeded);
 
 #define SSE_THRESHOLD 1e-10
-        if( sse > 1e-10) {
-            double  mse =sse /(double)(model.image.channels() * model.image.total());
-            double psnr = 10.0*log10((255*255)/mse);
+        if (exceeded) {
+            // SSE of the rows compared so far bounds the PSNR from above
+            double psnr = 10.0*log10((peak*peak)/(sse/count));
+            LOGTRACE2("apply_PSNR() threshold failed early: %f < %f", psnr, threshold);
+            json_object_set(pStageModel, "PSNR", json_real(psnr));
+            json_object_set(pStageModel, "earlyExit", json_true());
+        } else if( sse > 1e-10) {
+            double  mse =sse /count;
+            double psnr = 10.0*log10((peak*peak)/mse);
             json_object_set(pStageModel, "PSNR", json_real(psnr));
             if (threshold >= 0) {
                 if (psnr >= threshold) {
@@ -1389,11 +1469,8 @@ bool Pipeline::apply_absdiff(json_t *pStage, json_t *pStageModel, Model &model)
     }
 
     if (!errMsg) {
-        if (model.image.channels() == 1) {
-            img2 = imread(img2_path.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-        } else {
-            img2 = imread(img2_path.c_str(), CV_LOAD_IMAGE_COLOR);
-        }
+        string errStr;
+        img2 = ImageStore::load(img2_path.c_str(), errStr, model.image.channels() == 1);
         if (img2.data) {
             LOGTRACE2("apply_absdiff() path:%s %s", img2_path.c_str(), matInfo(img2).c_str());
         } else {
@@ -1416,6 +1493,7 @@ bool Pipeline::apply_threshold(json_t *pStage, json_t *pStageModel, Model &model
     bool isOtsu = otsu.compare("OTSU") == 0;
     float thresh = jo_float(pStage, "thresh", 128, model.argMap);
     bool gray = jo_bool(pStage, "gray", true, model.argMap);
+    bool packed = jo_bool(pStage, "packed", false, model.argMap);
     int type;
     const char *errMsg = NULL;
 
@@ -1434,16 +1512,32 @@ bool Pipeline::apply_threshold(json_t *pStage, json_t *pStageModel, Model &model
     }
     if (!gray && isOtsu) {
         errMsg = "Otsu's method cannot be used with color images. Specify a thresh value for color images.";
+    } else if (packed && (!gray || (type != THRESH_BINARY && type != THRESH_BINARY_INV))) {
+        errMsg = "packed requires gray THRESH_BINARY or THRESH_BINARY_INV";
+    } else if (packed && model.image.depth() != CV_8U) {
+        errMsg = "packed requires 8-bit image";
     }
     if (!errMsg) {
         if (isOtsu) {
             type |= THRESH_OTSU;
         }
+        Mat src = model.image;
         if ((isOtsu || gray) && model.image.channels() > 1) {
-            LOGTRACE("apply_threshold() converting image to grayscale");
-            cvtColor(model.image, model.image, CV_BGR2GRAY, 0);
+            LOGTRACE("apply_threshold() using grayscale image");
+            src = model.gray();
+        }
+        if (packed && !isOtsu) {
+            // model.image is left as is; Model::syncImage() unpacks the bits when needed
+            model.bits.pack(src, cvFloor(thresh), type == THRESH_BINARY_INV, cvRound(maxval));
+        } else {
+            // the cached gray image is a source only, so the result is a new image
+            Mat result;
+            threshold(src, result, thresh, maxval, type);
+            model.image = result;
+            if (packed) {
+                model.bits.pack(model.image, 0, false, cvRound(maxval));
+            }
         }
-        threshold(model.image, model.image, thresh, maxval, type);
     }
 
     return stageOK("apply_threshold(%s) %s", errMsg, pStage, pStageModel);
@@ -1534,7 +1628,7 @@ bool Pipeline::apply_HoleRecognizer(json_t *pStage, json_t *pStageModel, Model &
         vector<MatchedRegion> matches;
         HoleRecognizer recognizer(diamMin, diamMax);
         recognizer.showMatches(showMatches);
-        recognizer.scan(model.image, matches);
+        recognizer.scan(model.image, model.gray(CV_RGB2GRAY), matches);
         json_t *holes = json_array();
         json_object_set(pStageModel, "holes", holes);
         for (size_t i = 0; i < matches.size(); i++) {
@@ -1558,13 +1652,36 @@ bool Pipeline::apply_HoughCircles(json_t *pStage, json_t *pStageModel, Model &mo
     double hc_minDist = jo_double(pStage, "houghcircles_minDist", 10, model.argMap);
     double hc_param1 = jo_double(pStage, "houghcircles_param1", 80, model.argMap);
     double hc_param2 = jo_double(pStage, "houghcircles_param2", 10, model.argMap);
+    string filterStr = jo_string(pStage, "filter", "none", model.argMap);
+    int filter_ksize = jo_int(pStage, "filter_ksize", 5, model.argMap);
+    Rect roi = jo_Rect(pStage, "roi", Rect(), model.argMap);
+    int pyramid = jo_int(pStage, "pyramid", 0, model.argMap);
 
     const char *errMsg = NULL;
 
-    if (diamMin <= 0 || diamMax <= 0 || diamMin > diamMax) {
+    int filter = -1;
+    if (filterStr.compare("none") == 0) {
+        filter = CIRCLE_FILTER_NONE;
+    } else if (filterStr.compare("gaussian") == 0) {
+        filter = CIRCLE_FILTER_GAUSSIAN;
+    } else if (filterStr.compare("median") == 0) {
+        filter = CIRCLE_FILTER_MEDIAN;
+    } else if (filterStr.compare("bilateral") == 0) {
+        filter = CIRCLE_FILTER_BILATERAL;
+    } else if (filterStr.compare("bilateralFast") == 0) {
+        filter = CIRCLE_FILTER_BILATERAL_FAST;
+    }
+
+    if (filter < 0) {
+        errMsg = "expected filter: none, gaussian, median, bilateral, bilateralFast ";
+    } else if (diamMin <= 0 || diamMax <= 0 || diamMin > diamMax) {
         errMsg = "expected: 0 < diamMin < diamMax ";
     } else if (showCircles < 0) {
         errMsg = "expected: 0 < showCircles ";
+    } else if (filter_ksize < 3 || filter_ksize % 2 == 0) {
+        errMsg = "expected: filter_ksize odd and at least 3 ";
+    } else if (pyramid < 0 || pyramid > 8 || (pyramid > 0 && (diamMin >> pyramid) < 2)) {
+        errMsg = "expected: 0 <= pyramid <= 8 with diamMin/2^pyramid at least 2 ";
     } else if (logLevel >= FIRELOG_TRACE) {
         char *pStageJson = json_dumps(pStage, 0);
         LOGTRACE1("apply_HoughCircles(%s)", pStageJson);
@@ -1576,7 +1693,10 @@ bool Pipeline::apply_HoughCircles(json_t *pStage, json_t *pStageModel, Model &mo
         hough_c.setShowCircles(showCircles);
         hough_c.setFilterParams(bf_d, bf_sigmaColor, bf_sigmaSpace);
         hough_c.setHoughParams(hc_dp, hc_minDist, hc_param1, hc_param2);
-        hough_c.scan(model.image, circles);
+        hough_c.setFilter(filter, filter_ksize);
+        hough_c.setROI(roi);
+        hough_c.setPyramid(pyramid);
+        hough_c.scan(model.image, model.gray(CV_RGB2GRAY), circles);
         json_t *circles_json = json_array();
         json_object_set(pStageModel, "circles", circles_json);
         for (size_t i = 0; i < circles.size(); i++) {
@@ -1587,7 +1707,7 @@ bool Pipeline::apply_HoughCircles(json_t *pStage, json_t *pStageModel, Model &mo
     return stageOK("apply_HoughCircles(%s) %s", errMsg, pStage, pStageModel);
 }
 
-Pipeline::Pipeline(const char *pDefinition, DefinitionType defType) {
+Pipeline::Pipeline(const char *pDefinition, DefinitionType defType) : pStream(NULL), submitGroups(0) {
     json_error_t jerr;
     string pipelineString = pDefinition;
     if (defType == PATH) {
@@ -1617,17 +1737,21 @@ Pipeline::Pipeline(const char *pDefinition, DefinitionType defType) {
     }
 }
 
-Pipeline::Pipeline(json_t *pJson) {
+Pipeline::Pipeline(json_t *pJson) : pStream(NULL), submitGroups(0) {
     pPipeline = json_incref(pJson);
 }
 
 Pipeline::~Pipeline() {
+    stopStream();
     if (pPipeline->refcount == 1) {
         LOGTRACE1("~Pipeline() pPipeline->refcount:%d", (int)pPipeline->refcount);
     } else {
         LOGERROR1("~Pipeline() pPipeline->refcount:%d EXPECTED 0", (int)pPipeline->refcount);
     }
     json_decref(pPipeline);
+    for (map<string, StageDataPtr>::iterator it = stageDataMap.begin(); it != stageDataMap.end(); ++it) {
+        delete it->second;
+    }
 }
 
 static bool logErrorMessage(const char *errMsg, const char *pName, json_t *pStage, json_t *pStageModel) {
@@ -1656,12 +1780,150 @@ json_t *Pipeline::process(Mat &workingImage, ArgMap &argMap) {
 
     model.image = workingImage;
     model.imageMap["input"] = model.image.clone();
+    // stages such as backgroundSubtractor keep their state from frame to frame
+    AutoLock lock(stageDataMutex);
+    model.stageDataMap.swap(stageDataMap);
     bool ok = processModel(model);
+    model.stageDataMap.swap(stageDataMap);
     workingImage = model.image;
 
     return pModelJson;
 }
 
+/**
+ * Process one image of a batch without stage state from other images.
+ * @param input buffer for the "input" image, reused by the worker for its next image
+ */
+json_t *Pipeline::processBatchImage(Mat &workingImage, ArgMap &argMap, Mat &input) {
+    json_t *pModelJson;
+    {
+        Model model(argMap);
+        pModelJson = model.getJson(true);
+        model.image = workingImage;
+        workingImage.copyTo(input);
+        model.imageMap["input"] = input;
+        try {
+            processModel(model);
+        } catch (exception &ex) {
+            LOGERROR1("Pipeline::processBatch() %s", ex.what());
+            json_object_set(pModelJson, "ERROR", json_string(ex.what()));
+        }
+        workingImage = model.image;
+    }
+    if (input.refcount && *input.refcount > 1) {
+        input = Mat(); // a stage returned the input image, so it cannot be reused
+    }
+    return pModelJson;
+}
+
+namespace firesight {
+
+/**
+ * Batch worker that processes images in turn until none are left
+ */
+class BatchBody {
+    private:
+        Pipeline &pipeline;
+        vector<Mat> &images;
+        vector<ArgMap> &argMaps;
+        vector<json_t *> &models;
+        int *pNext;
+
+    public:
+        BatchBody(Pipeline &pipeline, vector<Mat> &images, vector<ArgMap> &argMaps,
+                  vector<json_t *> &models, int *pNext)
+            : pipeline(pipeline), images(images), argMaps(argMaps), models(models), pNext(pNext) {}
+
+        void run() {
+            int nImages = (int) images.size();
+            Mat input;
+            for (int i = CV_XADD(pNext, 1); i < nImages; i = CV_XADD(pNext, 1)) {
+                ArgMap &argMap = argMaps.size() == 1 ? argMaps[0] : argMaps[i];
+                models[i] = pipeline.processBatchImage(images[i], argMap, input);
+            }
+        }
+};
+
+} // namespace firesight
+
+vector<json_t *> Pipeline::processBatch(vector<Mat> &images, vector<ArgMap> &argMaps, int workers) {
+    if (!json_is_array(pPipeline)) {
+        throw invalid_argument("Pipeline::processBatch() expected json array for pipeline definition");
+    }
+    if (argMaps.size() != 1 && argMaps.size() != images.size()) {
+        throw invalid_argument("Pipeline::processBatch() expected one ArgMap or one ArgMap per image");
+    }
+    if (workers <= 0) {
+        workers = getNumThreads();
+    }
+    workers = max(1, min(workers, (int) images.size()));
+    vector<json_t *> models(images.size(), (json_t *) NULL);
+    int next = 0;
+    LOGTRACE2("Pipeline::processBatch() %d images %d workers", (int) images.size(), workers);
+    BatchBody body(*this, images, argMaps, models, &next);
+    // workers have their own threads, since parallel_for_() is bounded by cv::getNumThreads()
+    // and runs nested loops of the stages serially
+    vector<std::thread> threads;
+    for (int w = 1; w < workers; w++) {
+        threads.push_back(std::thread(&BatchBody::run, &body));
+    }
+    body.run();
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    return models;
+}
+
+/**
+ * Return true if the given op handles a packed binary working image (Model::bits)
+ */
+static bool isPackedOp(const char *pOp) {
+    return strcmp(pOp, "components")==0 ||
+           strcmp(pOp, "dilate")==0 ||
+           strcmp(pOp, "erode")==0 ||
+           strcmp(pOp, "morph")==0;
+}
+
+/**
+ * Return true if the given op never writes the working image, so that derived images
+ * cached by the model (see Model::gray()) remain valid after the op
+ */
+static bool isReadOnlyOp(const char *pOp) {
+    return strcmp(pOp, "calcHist")==0 ||
+           strcmp(pOp, "components")==0 ||
+           strcmp(pOp, "cout")==0 ||
+           strcmp(pOp, "dirtyTiles")==0 ||
+           strcmp(pOp, "gate")==0 ||
+           strcmp(pOp, "imwrite")==0 ||
+           strcmp(pOp, "meanStdDev")==0 ||
+           strcmp(pOp, "minAreaRect")==0 ||
+           strcmp(pOp, "model")==0 ||
+           strcmp(pOp, "points2resolution_RANSAC")==0 ||
+           strcmp(pOp, "PSNR")==0 ||
+           strcmp(pOp, "roiStats")==0 ||
+           strcmp(pOp, "sharpness")==0;
+}
+
+/**
+ * Return true if the given stage may reuse its results when a preceding gate stage is closed.
+ * Stages declare this with "gate":true or "gate":false. By default, expensive detectors are
+ * gate-sensitive.
+ */
+static bool isGateSensitive(const char *pOp, json_t *pStage, ArgMap &argMap) {
+    bool sensitive = strcmp(pOp, "calcOffset")==0 ||
+                     strcmp(pOp, "components")==0 ||
+                     strcmp(pOp, "fitCircles")==0 ||
+                     strcmp(pOp, "HoleRecognizer")==0 ||
+                     strcmp(pOp, "HoughCircles")==0 ||
+                     strcmp(pOp, "matchGrid")==0 ||
+                     strcmp(pOp, "matchTemplate")==0 ||
+                     strcmp(pOp, "MSER")==0 ||
+                     strcmp(pOp, "points2resolution_RANSAC")==0 ||
+                     strcmp(pOp, "qrDecode")==0 ||
+                     strcmp(pOp, "SimpleBlobDetector")==0;
+    return jo_bool(pStage, "gate", sensitive, argMap);
+}
+
 bool Pipeline::processModel(Model &model) {
     if (!json_is_array(pPipeline)) {
         const char * errMsg = "Pipeline::process expected json array for pipeline definition";
@@ -1669,12 +1931,38 @@ bool Pipeline::processModel(Model &model) {
         throw errMsg;
     }
 
+    long long tickStart = cvGetTickCount();
+    bool ok = processStages(model, 0, json_array_size(pPipeline));
+    model.syncImage();
+
+    float msElapsed = (cvGetTickCount() - tickStart)/cvGetTickFrequency()/1000;
+    LOGDEBUG3("Pipeline::processModel(stages:%d) -> %s %.1fms",
+              (int)json_array_size(pPipeline), matInfo(model.image).c_str(), msElapsed);
+
+    return ok;
+}
+
+/**
+ * Execute stages [begin,end) of the pipeline on the given model
+ * @return false if a stage failed and the remaining stages should not be executed
+ */
+bool Pipeline::processStages(Model &model, size_t begin, size_t end) {
     bool ok = 1;
-    size_t index;
-    json_t *pStage;
     char debugBuf[255];
-    long long tickStart = cvGetTickCount();
-    json_array_foreach(pPipeline, index, pStage) {
+    GateStageData *pGate = NULL;
+    for (size_t index = begin; index < end; index++) {
+        json_t *pStage = json_array_get(pPipeline, index);
+        size_t nFused = processTiles(index, end, model);
+        if (!nFused) {
+            nFused = processTiled(index, end, model);
+        }
+        if (!nFused) {
+            nFused = processFused(index, end, model);
+        }
+        if (nFused) {
+            index += nFused - 1;
+            continue;
+        }
         string pOp = jo_string(pStage, "op", "", model.argMap);
         string pName = jo_string(pStage, "name");
         bool isSaveImage = true;
@@ -1698,12 +1986,33 @@ bool Pipeline::processModel(Model &model) {
         } else if (pName.compare("input")==0) {
             ok = logErrorMessage("\"input\" is the reserved stage name for the input image",
                                  pName.c_str(), pStage, pStageModel);
+        } else if (pGate && !pGate->open && isGateSensitive(pOp.c_str(), pStage, model.argMap) &&
+                   pGate->reuse(pName, pStageModel, model)) {
+            LOGDEBUG1("%s (REUSED)", debugBuf);
+            if (isSaveImage) {
+                model.syncImage();
+                model.imageMap[pName.c_str()] = model.image.clone();
+            }
         } else {
             LOGDEBUG1("%s", debugBuf);
             try {
+                if (!isPackedOp(pOp.c_str())) {
+                    model.syncImage();
+                }
                 const char *errMsg = dispatch(pName.c_str(), pOp.c_str(), pStage, pStageModel, model);
+                bool isReadOnly = isReadOnlyOp(pOp.c_str());
+                if (!isReadOnly) {
+                    model.imageChanged();
+                }
                 ok = logErrorMessage(errMsg, pName.c_str(), pStage, pStageModel);
+                if (ok && pOp.compare("gate") == 0) {
+                    pGate = (GateStageData *) model.stageDataMap[pName];
+                } else if (ok && pGate && isGateSensitive(pOp.c_str(), pStage, model.argMap)) {
+                    model.syncImage();
+                    pGate->save(pName, pStageModel, isReadOnly ? Mat() : model.image);
+                }
                 if (isSaveImage) {
+                    model.syncImage();
                     model.imageMap[pName.c_str()] = model.image.clone();
                 }
             } catch (runtime_error &ex) {
@@ -1722,11 +2031,7 @@ bool Pipeline::processModel(Model &model) {
             ok = false;
             break;
         }
-    } // json_array_foreach
-
-    float msElapsed = (cvGetTickCount() - tickStart)/cvGetTickFrequency()/1000;
-    LOGDEBUG3("Pipeline::processModel(stages:%d) -> %s %.1fms",
-              (int)json_array_size(pPipeline), matInfo(model.image).c_str(), msElapsed);
+    } // for index
 
     return ok;
 }
@@ -1749,6 +2054,8 @@ const char * Pipeline::dispatch(const char *pName, const char *pOp, json_t *pSta
         ok = apply_calcOffset(pStage, pStageModel, model);
     } else if (strcmp(pOp, "circle")==0) {
         ok = apply_circle(pStage, pStageModel, model);
+    } else if (strcmp(pOp, "components")==0) {
+        ok = apply_components(pStage, pStageModel, model);
     } else if (strcmp(pOp, "convertTo")==0) {
         ok = apply_convertTo(pStage, pStageModel, model);
     } else if (strcmp(pOp, "cout")==0) {
@@ -1765,6 +2072,8 @@ const char * Pipeline::dispatch(const char *pName, const char *pOp, json_t *pSta
         ok = apply_dftSpectrum(pStage, pStageModel, model);
     } else if (strcmp(pOp, "dilate")==0) {
         ok = apply_dilate(pStage, pStageModel, model);
+    } else if (strcmp(pOp, "dirtyTiles")==0) {
+        ok = apply_dirtyTiles(pStage, pStageModel, model);
     } else if (strcmp(pOp, "drawKeypoints")==0) {
         ok = apply_drawKeypoints(pStage, pStageModel, model);
     } else if (strcmp(pOp, "drawRects")==0) {
@@ -1775,6 +2084,10 @@ const char * Pipeline::dispatch(const char *pName, const char *pOp, json_t *pSta
         ok = apply_erode(pStage, pStageModel, model);
     } else if (strcmp(pOp, "FireSight")==0) {
         ok = apply_FireSight(pStage, pStageModel, model);
+    } else if (strcmp(pOp, "fitCircles")==0) {
+        ok = apply_fitCircles(pStage, pStageModel, model);
+    } else if (strcmp(pOp, "gate")==0) {
+        ok = apply_gate(pName, pStage, pStageModel, model);
     } else if (strcmp(pOp, "HoleRecognizer")==0) {
         ok = apply_HoleRecognizer(pStage, pStageModel, model);
     } else if (strcmp(pOp, "HoughCircles")==0) {
@@ -1817,6 +2130,8 @@ const char * Pipeline::dispatch(const char *pName, const char *pOp, json_t *pSta
         ok = apply_rectangle(pStage, pStageModel, model);
     } else if (strcmp(pOp, "resize")==0) {
         ok = apply_resize(pStage, pStageModel, model);
+    } else if (strcmp(pOp, "roiStats")==0) {
+        ok = apply_roiStats(pStage, pStageModel, model);
     } else if (strcmp(pOp, "sharpness")==0) {
         ok = apply_sharpness(pStage, pStageModel, model);
     } else if (strcmp(pOp, "SimpleBlobDetector")==0) {
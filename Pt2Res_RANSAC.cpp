@@ -5,6 +5,7 @@
 
 #include <vector>
 #include <math.h>
+#include <limits.h>
 #include <stdexcept>
 #include "FireLog.h"
 #include "FireSight.hpp"
@@ -13,6 +14,88 @@
 using namespace std;
 using namespace firesight;
 
+#define RANSAC_BATCH 32 /* hypotheses evaluated sequentially by one task */
+#define RANSAC_ROUND 8  /* batches evaluated in parallel before adapting the iteration count */
+#define RANSAC_MAX_SAMPLES 8
+
+typedef struct RANSACBatch {
+    double supp;        // best support of batch
+    int ninl;           // number of inliers of best hypothesis
+    int sample[RANSAC_MAX_SAMPLES]; // coordinate indexes of best hypothesis
+} RANSACBatch;
+
+/**
+ * Evaluates batches of hypotheses. Each batch draws its samples from its own RNG seeded
+ * by the batch number, so results do not depend on thread count or scheduling.
+ */
+class RANSACBody : public ParallelLoopBody {
+    private:
+        const double *px;
+        const double *py;
+        size_t n;
+        unsigned int NSAMPL;
+        double thr;
+        RANSACResiduals residuals;
+        uint64 seed;
+        int firstBatch;
+        double *scratch;
+        RANSACBatch *batches;
+
+    public:
+        RANSACBody(const double *px, const double *py, size_t n, unsigned int NSAMPL, double thr,
+                   RANSACResiduals residuals, uint64 seed, int firstBatch, double *scratch, RANSACBatch *batches)
+            : px(px), py(py), n(n), NSAMPL(NSAMPL), thr(thr), residuals(residuals), seed(seed),
+              firstBatch(firstBatch), scratch(scratch), batches(batches) {}
+
+        void operator()(const Range &range) const {
+            for (int b = range.start; b < range.end; b++) {
+                RANSACBatch &batch = batches[b];
+                double *err = scratch + b*n;
+                RNG rng(seed + (uint64)(firstBatch + b) * 0x9E3779B97F4A7C15ULL);
+                int ids[RANSAC_MAX_SAMPLES];
+                XY sampl[RANSAC_MAX_SAMPLES];
+
+                batch.supp = -1;
+                batch.ninl = 0;
+                for (int h = 0; h < RANSAC_BATCH; h++) {
+                    for (unsigned int ni = 0; ni < NSAMPL; ni++) {
+                        bool rerun;
+                        do {
+                            rerun = false;
+                            ids[ni] = rng.uniform(0, (int) n);
+                            for (unsigned int oi = 0; oi < ni; oi++) {
+                                if (ids[ni] == ids[oi]) {
+                                    rerun = true;
+                                    break;
+                                }
+                            }
+                        } while (rerun);
+                        sampl[ni] = XY(px[ids[ni]], py[ids[ni]]);
+                    }
+
+                    residuals(sampl, px, py, n, err);
+
+                    double supp = 0;
+                    int ninl = 0;
+                    for (size_t i = 0; i < n; i++) {
+                        if (err[i] < thr) {
+                            supp += (1-err[i]*err[i]);
+                            ninl++;
+                        }
+                    }
+
+                    if (supp > batch.supp) {
+                        batch.supp = supp;
+                        batch.ninl = ninl;
+                        for (unsigned int ni = 0; ni < NSAMPL; ni++) {
+                            batch.sample[ni] = ids[ni];
+                        }
+                    }
+                }
+            }
+        }
+};
+
 bool Pt2Res::compare_XY_by_x(XY a, XY b) {
     return a.x < b.x;
 }
@@ -24,110 +107,134 @@ bool Pt2Res::compare_XY_by_y(XY a, XY b) {
 int Pt2Res::nsamples_RANSAC(size_t ninl, size_t xlen, unsigned int NSAMPL, double confidence) {
     // q = \prod_{i=0}^{NSAMPL-1} (ninl-i)/(xlen-i)
     double q = 1;
-    int nsamples;
-    for (unsigned int i = 0; i < NSAMPL - 1; i++)
-        q *= (double) (ninl-i)/(xlen-i);
+    for (unsigned int i = 0; i < NSAMPL; i++)
+        q *= ((double) ninl - i)/((double) xlen - i);
 
     if (q < 1e-10)
         return INT_MAX;
+    if (q >= 1)
+        return 1;
 
-     nsamples = (int) log(1-confidence) / log(1-q);
-     if (nsamples < 1)
-         nsamples = 1;
+    double nsamples = log(1-confidence) / log(1-q);
+    if (nsamples >= INT_MAX)
+        return INT_MAX;
+    if (nsamples < 1)
+        return 1;
 
-     return nsamples;
+    return (int) nsamples;
 }
 
-double Pt2Res::_RANSAC_line(XY * x, size_t nx, XY C) {
-    assert(nx == 2);
-
-    XY u(x[1].x - x[0].x, x[1].y - x[0].y);
-    double norm_u = sqrt(u.x*u.x + u.y*u.y);
-    XY p(x[1].x - C.x, x[1].y - C.y);
-    double e = abs(u.x*p.y - u.y*p.x) / norm_u;
+void Pt2Res::_RANSAC_line(const XY * sampl, const double *px, const double *py, size_t n, double *err) {
+    // distance of each point from the line through sampl[0] and sampl[1]
+    double ux = sampl[1].x - sampl[0].x;
+    double uy = sampl[1].y - sampl[0].y;
+    double inv_norm_u = 1/sqrt(ux*ux + uy*uy);
+    double x1 = sampl[1].x;
+    double y1 = sampl[1].y;
 
-    return e;
+    for (size_t i = 0; i < n; i++) {
+        err[i] = fabs(ux*(y1-py[i]) - uy*(x1-px[i])) * inv_norm_u;
+    }
 }
 
-double Pt2Res::_RANSAC_pattern(XY * x, size_t nx, XY C) {
-    assert(nx == 2);
-
-    XY u(x[1].x - x[0].x, x[1].y - x[0].y);
-    // squared distance from x[0] to x[1]
-    double usq = u.x*u.x + u.y*u.y;
-    // vector from x[0] to C determines the unit vector
-    XY Ap(C.x - x[0].x, C.y - x[0].y);
-    // projection of C onto the line parametrized as x[0] + t (x[1] - x[0])
-    double t = (Ap.x * u.x + Ap.y * u.y) / usq;
-
-    return abs(t-round(t));
+void Pt2Res::_RANSAC_pattern(const XY * sampl, const double *px, const double *py, size_t n, double *err) {
+    // projection of each point onto the line parametrized as sampl[0] + t (sampl[1] - sampl[0]),
+    // with error being the distance of t from the nearest integer
+    double ux = sampl[1].x - sampl[0].x;
+    double uy = sampl[1].y - sampl[0].y;
+    double inv_usq = 1/(ux*ux + uy*uy);
+    double x0 = sampl[0].x;
+    double y0 = sampl[0].y;
+
+    for (size_t i = 0; i < n; i++) {
+        double t = ((px[i]-x0)*ux + (py[i]-y0)*uy) * inv_usq;
+        err[i] = fabs(t - floor(t+0.5));
+    }
 }
 
-vector<XY> Pt2Res::RANSAC_2D(unsigned int NSAMPL, vector<XY> coords, double thr, double confidence, double(*err_fun)(XY *, size_t, XY)) {
+bool Pt2Res::isTimeExceeded() {
+    if (maxMillis <= 0) {
+        return false;
+    }
+    return (getTickCount() - tickStart) * 1000.0 / getTickFrequency() > maxMillis;
+}
 
-    double bsupp = -1;
-    vector<double> berr;
+vector<XY> Pt2Res::RANSAC_2D(unsigned int NSAMPL, const vector<XY> &coords, double thr, double confidence,
+                             RANSACResiduals residuals, RANSACStats &stats) {
     vector<XY> binl;
-    unsigned int max_iterations = 1000;
-    if (coords.size() < NSAMPL)
+    size_t n = coords.size();
+    stats = RANSACStats();
+    stats.points = n;
+    if (n < NSAMPL || NSAMPL > RANSAC_MAX_SAMPLES)
         return binl; //errMsg = "Not enough detected circles, at least 2 needed";
 
-    for (unsigned int it = 0; it < max_iterations; it++) {
-        int idx0, idx1;
-        vector<double> err;
-        vector<XY> inl;
-        double supp = 0;
-
-        XY * sampl = (XY *) malloc(sizeof(XY) * NSAMPL);
-        int * sampl_id = (int *) malloc(sizeof(int) * NSAMPL);
-        for (unsigned int ni = 0; ni < NSAMPL; ni++) {
-            bool rerun;
-            do {
-                rerun = false;
-                sampl_id[ni] = rand() % coords.size();
-                for (unsigned int oi = 0; oi < ni; oi++) {
-                    if (sampl_id[ni] == sampl_id[oi]) {
-                        rerun = true;
-                        break;
-                    }
-                }
-            } while (rerun);
-            sampl[ni] = coords[sampl_id[ni]];
+    // structure of arrays for residual evaluation
+    vector<double> xs(n);
+    vector<double> ys(n);
+    for (size_t i = 0; i < n; i++) {
+        xs[i] = coords[i].x;
+        ys[i] = coords[i].y;
+    }
+    vector<double> scratch(RANSAC_ROUND * n);
+    vector<RANSACBatch> batches(RANSAC_ROUND);
+
+    RANSACBatch best;
+    best.supp = -1;
+    best.ninl = 0;
+    int64 max_iterations = 1000;
+    int64 iterations = 0;
+    int firstBatch = 0;
+    // always evaluate at least one round so that there is a best hypothesis,
+    // even if the time limit was already spent by an earlier pass
+    int64 budget = max(maxIterations, (int64) RANSAC_BATCH);
+    while (iterations < max_iterations) {
+        if (iterations > 0 && (iterations >= budget || isTimeExceeded())) {
+            LOGTRACE3("Pt2Res::RANSAC_2D() stopped after %ld of %ld iterations (%d inliers)",
+                      (long) iterations, (long) max_iterations, best.ninl);
+            break;
         }
-
-
-        for (size_t cid = 0; cid < coords.size(); cid++) {
-            double e;
-
-            XY C = coords[cid];
-
-            e = err_fun(sampl, NSAMPL, C);
-
-            err.push_back(e);
-
-            if (e < thr) {
-                inl.push_back(C);
-                supp += (1-e*e);
+        int64 remaining = (budget - iterations + RANSAC_BATCH - 1) / RANSAC_BATCH;
+        int nBatches = (int) min((int64) RANSAC_ROUND, remaining);
+        RANSACBody body(&xs[0], &ys[0], n, NSAMPL, thr, residuals, seed, firstBatch,
+                        &scratch[0], &batches[0]);
+        parallel_for_(Range(0, nBatches), body, nBatches);
+        iterations += nBatches * RANSAC_BATCH;
+        firstBatch += RANSAC_ROUND;
+
+        bool improved = false;
+        for (int b = 0; b < nBatches; b++) {
+            if (batches[b].supp > best.supp) {
+                best = batches[b];
+                improved = true;
             }
         }
-        free(sampl);
-        free(sampl_id);
-
-        // support - approximation of ML estimator
-        supp /= thr * thr * coords.size();
-
-        if (supp > bsupp) {
-            bsupp = supp;
-            binl = inl;
-            berr = err;
+        if (improved) {
+            max_iterations = nsamples_RANSAC(best.ninl, n, NSAMPL, confidence);
+        }
+    }
+    stats.iterations = iterations;
+    stats.converged = iterations >= max_iterations;
+    if (best.supp < 0) {
+        return binl;
+    }
 
-            // update max_iterations
-            max_iterations = nsamples_RANSAC(inl.size(), coords.size(), NSAMPL, confidence);
+    XY sampl[RANSAC_MAX_SAMPLES];
+    for (unsigned int ni = 0; ni < NSAMPL; ni++) {
+        sampl[ni] = coords[best.sample[ni]];
+    }
+    residuals(sampl, &xs[0], &ys[0], n, &scratch[0]);
+    binl.reserve(best.ninl);
+    for (size_t i = 0; i < n; i++) {
+        if (scratch[i] < thr) {
+            binl.push_back(coords[i]);
         }
     }
+    stats.inliers = binl.size();
+
+    return binl;
 }
 
-void Pt2Res::least_squares(vector<XY> xy, double * a, double * b) {
+void Pt2Res::least_squares(const vector<XY> &xy, double * a, double * b) {
     double SUMx = 0, SUMy = 0, SUMxy = 0, SUMxx = 0;
 
     for (size_t i = 0; i < xy.size(); i++) {
@@ -140,8 +247,11 @@ void Pt2Res::least_squares(vector<XY> xy, double * a, double * b) {
     *b = ( SUMy - (*a)*SUMx ) / xy.size();
 }
 
-double Pt2Res::getResolution(double thr1, double thr2, double confidence, double separation, vector<XY> coords) {
+double Pt2Res::getResolution(double thr1, double thr2, double confidence, double separation, const vector<XY> &coords) {
     double resolution = NAN;
+    tickStart = getTickCount();
+    lineStats = RANSACStats();
+    patternStats = RANSACStats();
 
     try {
         if (coords.size() < 2) {
@@ -149,7 +259,7 @@ double Pt2Res::getResolution(double thr1, double thr2, double confidence, double
         }
 
         // fit line through circle centers
-        vector<XY> binl = RANSAC_2D(2, coords, thr1, confidence, _RANSAC_line);
+        vector<XY> binl = RANSAC_2D(2, coords, thr1, confidence, _RANSAC_line, lineStats);
 
         if (binl.size() < 2) {
             throw runtime_error("Not enough points after RANSAC line");
@@ -160,14 +270,14 @@ double Pt2Res::getResolution(double thr1, double thr2, double confidence, double
         least_squares(binl, &a, &b);
 
         // run another RANSAC to get the pattern in the circle centers forming the line
-        binl = RANSAC_2D(2, binl, thr2, confidence, _RANSAC_pattern);
+        binl = RANSAC_2D(2, binl, thr2, confidence, _RANSAC_pattern, patternStats);
 
         if (binl.size() < 2) {
             throw runtime_error("Not enough points after RANSAC pattern");
         }
 
         // sort the inliers
-        if (abs(a) > 1)
+        if (fabs(a) > 1)
             sort(binl.begin(), binl.end(), compare_XY_by_y);
         else
             sort(binl.begin(), binl.end(), compare_XY_by_x);
@@ -176,7 +286,7 @@ double Pt2Res::getResolution(double thr1, double thr2, double confidence, double
         vector<double> inter_d;
         for (size_t i = 1; i < binl.size(); i++)
             inter_d.push_back(sqrt(
-                        (binl[i].x - binl[i-1].x)*(binl[i].x - binl[i-1].x) + 
+                        (binl[i].x - binl[i-1].x)*(binl[i].x - binl[i-1].x) +
                         (binl[i].y - binl[i-1].y)*(binl[i].y - binl[i-1].y)));
 
         // get the median (d0) of the distances
@@ -192,7 +302,7 @@ double Pt2Res::getResolution(double thr1, double thr2, double confidence, double
     } catch (exception &e) {
         LOGERROR(e.what());
     }
+    millis = (getTickCount() - tickStart) * 1000.0 / getTickFrequency();
 
     return resolution;
 }
-
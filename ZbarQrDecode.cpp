@@ -17,6 +17,16 @@ using namespace firesight;
 using namespace zbar;
 
 vector<QRPayload> ZbarQrDecode::scan(Mat &img, int show) {
+    Mat img_gray;
+    if (img.channels() == 1) {
+        img_gray = img;
+    } else {
+        cvtColor(img, img_gray, CV_BGR2GRAY);
+    }
+    return scan(img, img_gray, show);
+}
+
+vector<QRPayload> ZbarQrDecode::scan(Mat &img, const Mat &img_gray, int show) {
     vector<QRPayload> result;
 
     // create a reader
@@ -26,12 +36,6 @@ vector<QRPayload> ZbarQrDecode::scan(Mat &img, int show) {
     scanner.set_config(ZBAR_NONE, ZBAR_CFG_ENABLE, 1);
 
     // wrap image data  
-    Mat img_gray;
-    if (img.channels() == 1) {
-        img_gray = img;
-    } else {
-        cvtColor(img, img_gray, CV_BGR2GRAY);
-    }
     int width = img_gray.cols;  
     int height = img_gray.rows;  
     uchar *raw = (uchar *)img_gray.data;  
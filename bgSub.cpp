@@ -20,6 +20,13 @@ using namespace firesight;
 
 #define TRUE 1
 
+#define BG_BAND_ROWS 32 /* rows of the background model updated by one task */
+
+typedef enum {
+    BG_RUNNING_AVERAGE, // exponentially weighted average of frames
+    BG_MEDIAN           // approximate median: background steps toward each frame
+} BackgroundModelMethod;
+
 class SubtractorStageData : public StageData {
   public:
     BackgroundSubtractor *pSubtractor;
@@ -35,6 +42,120 @@ class SubtractorStageData : public StageData {
     }
 };
 
+/**
+ * Background of runningAverage and median methods in 8.8 fixed point
+ */
+class BackgroundModelStageData : public StageData {
+  public:
+    Mat background; // CV_16U with the channels of the (downscaled) image
+
+    BackgroundModelStageData(string stageName) : StageData(stageName) {}
+};
+
+/**
+ * Compare each band of rows of an 8-bit frame with the fixed point background,
+ * then update the background
+ */
+class BackgroundModelBody : public ParallelLoopBody {
+  private:
+    const Mat &frame;
+    Mat &background;
+    Mat &fgMask;
+    int method;
+    int rate;       // runningAverage: weight of frame in 1/256; median: step in 1/256 gray levels
+    int threshold;
+    uchar maxval;
+
+  public:
+    BackgroundModelBody(const Mat &frame, Mat &background, Mat &fgMask, int method, int rate,
+                        int threshold, int maxval)
+      : frame(frame), background(background), fgMask(fgMask), method(method), rate(rate),
+        threshold(threshold), maxval(saturate_cast<uchar>(maxval)) {}
+
+    void operator()(const Range &range) const {
+      int cn = frame.channels();
+      int n = frame.cols * cn;
+      for (int band = range.start; band < range.end; band++) {
+        int r1 = min(frame.rows, (band+1) * BG_BAND_ROWS);
+        for (int r = band * BG_BAND_ROWS; r < r1; r++) {
+          const uchar *pFrame = frame.ptr<uchar>(r);
+          ushort *pBackground = background.ptr<ushort>(r);
+          uchar *pMask = fgMask.ptr<uchar>(r);
+          for (int c = 0; c < frame.cols; c++) {
+            int maxDiff = 0;
+            for (int k = 0; k < cn; k++) {
+              int i = c*cn + k;
+              maxDiff = max(maxDiff, abs((int) pFrame[i] - ((pBackground[i] + 128) >> 8)));
+            }
+            pMask[c] = maxDiff > threshold ? maxval : 0;
+          }
+          if (method == BG_RUNNING_AVERAGE) {
+            for (int i = 0; i < n; i++) {
+              int b = pBackground[i];
+              int d = ((int) pFrame[i] << 8) - b;
+              pBackground[i] = (ushort) (b + ((d*rate + 128) >> 8));
+            }
+          } else {
+            for (int i = 0; i < n; i++) {
+              int b = pBackground[i];
+              int f = (int) pFrame[i] << 8;
+              pBackground[i] = (ushort) (b < f ? min(f, b + rate) : max(f, b - rate));
+            }
+          }
+        }
+      }
+    }
+};
+
+/**
+ * Foreground mask of an 8-bit image for the runningAverage and median methods
+ */
+static void backgroundModel(Mat &image, Mat &bgImage, BackgroundModelStageData *pData, int method,
+                            double learningRate, int downscale, float varThreshold, int maxval, Mat &fgMask) {
+  Mat frame = image;
+  if (downscale > 1) {
+    resize(image, frame, Size(max(1, image.cols/downscale), max(1, image.rows/downscale)), 0, 0, INTER_AREA);
+  }
+  Mat &background = pData->background;
+  if (background.size() != frame.size() || background.channels() != frame.channels()) {
+    Mat initial = frame;
+    if (bgImage.data) {
+      resize(bgImage, initial, frame.size(), 0, 0, INTER_AREA);
+    }
+    LOGTRACE1("apply_backgroundSubtractor() initializing background %s", matInfo(frame).c_str());
+    initial.convertTo(background, CV_16U, 256);
+  }
+
+  int rate;
+  if (method == BG_RUNNING_AVERAGE) {
+    // learning rates below the 1/256 resolution still learn, at the slowest rate
+    rate = learningRate == 0 ? 0 : max(1, cvRound((learningRate < 0 ? 0.05 : learningRate) * 256));
+  } else {
+    rate = max(1, cvRound((learningRate < 0 ? 1 : learningRate) * 256));
+  }
+  Mat mask(frame.size(), CV_8UC1);
+  int bands = (frame.rows + BG_BAND_ROWS - 1) / BG_BAND_ROWS;
+  BackgroundModelBody body(frame, background, mask, method, rate, cvRound(varThreshold), maxval);
+  parallel_for_(Range(0, bands), body);
+
+  if (downscale > 1) {
+    resize(mask, fgMask, image.size(), 0, 0, INTER_NEAREST);
+  } else {
+    fgMask = mask;
+  }
+}
+
+/**
+ * Replace the state kept for a stage, e.g., when its method changed between frames
+ */
+static void setStageData(Model &model, const string &stageName, StageData *pStageData) {
+  StageDataPtr pOld = model.stageDataMap[stageName];
+  if (pOld) {
+    LOGTRACE1("apply_backgroundSubtractor(%s) replacing state of another method", stageName.c_str());
+    delete pOld;
+  }
+  model.stageDataMap[stageName] = pStageData;
+}
 
 bool Pipeline::apply_backgroundSubtractor(json_t *pStage, json_t *pStageModel, Model &model) {
   validateImage(model.image);
@@ -46,23 +167,42 @@ bool Pipeline::apply_backgroundSubtractor(json_t *pStage, json_t *pStageModel, M
   string stageName = jo_string(pStage, "name", method.c_str(), model.argMap);
   int maxval = 255;
   double learningRate = jo_double(pStage, "learningRate", -1, model.argMap);
+  int downscale = jo_int(pStage, "downscale", 1, model.argMap);
   const char *errMsg = NULL;
   StageDataPtr pStageData = model.stageDataMap[stageName];
 
   BackgroundSubtractor *pSubtractor;
+  BackgroundModelStageData *pBackgroundData = NULL;
   bool is_absdiff = false;
+  int bgMethod = -1;
   if (!errMsg) {
     if (method.compare("MOG2") == 0) {
-      if (pStageData) {
-	pSubtractor = ((SubtractorStageData *) pStageData)->pSubtractor;
-      } else {
-	pSubtractor = new BackgroundSubtractorMOG2(history, varThreshold, bShadowDetection);
-	model.stageDataMap[stageName] = new SubtractorStageData(stageName, pSubtractor);
+      SubtractorStageData *pSubtractorData = dynamic_cast<SubtractorStageData *>(pStageData);
+      if (!pSubtractorData) {
+	pSubtractorData = new SubtractorStageData(stageName,
+	  new BackgroundSubtractorMOG2(history, varThreshold, bShadowDetection));
+	setStageData(model, stageName, pSubtractorData);
       }
+      pSubtractor = pSubtractorData->pSubtractor;
     } else if (method.compare("absdiff") == 0) {
       is_absdiff = true;
+    } else if (method.compare("runningAverage") == 0 || method.compare("median") == 0) {
+      bgMethod = method.compare("median") == 0 ? BG_MEDIAN : BG_RUNNING_AVERAGE;
+      if (model.image.depth() != CV_8U) {
+        errMsg = "Expected 8-bit image for runningAverage or median";
+      } else if (downscale < 1) {
+        errMsg = "Expected downscale >= 1";
+      } else if (bgMethod == BG_RUNNING_AVERAGE && learningRate > 1) {
+        errMsg = "Expected learningRate <= 1 for runningAverage";
+      } else {
+        pBackgroundData = dynamic_cast<BackgroundModelStageData *>(pStageData);
+        if (!pBackgroundData) {
+          pBackgroundData = new BackgroundModelStageData(stageName);
+          setStageData(model, stageName, pBackgroundData);
+        }
+      }
     } else {
-        errMsg = "Expected method: MOG2";
+        errMsg = "Expected method: MOG2, absdiff, runningAverage, median";
     }
   }
 
@@ -71,11 +211,8 @@ bool Pipeline::apply_backgroundSubtractor(json_t *pStage, json_t *pStageModel, M
     if (history != 0) {
       errMsg = "Expected history=0 if background image is specified";
     } else {
-      if (model.image.channels() == 1) {
-        bgImage = imread(background.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-      } else {
-        bgImage = imread(background.c_str(), CV_LOAD_IMAGE_COLOR);
-      }
+      string errStr;
+      bgImage = ImageStore::load(background.c_str(), errStr, model.image.channels() == 1);
       if (bgImage.data) {
         LOGTRACE2("apply_backgroundSubtractor(%s) %s", background.c_str(), matInfo(bgImage).c_str());
         if (model.image.rows!=bgImage.rows || model.image.cols!=bgImage.cols) {
@@ -94,7 +231,10 @@ bool Pipeline::apply_backgroundSubtractor(json_t *pStage, json_t *pStageModel, M
 
   if (!errMsg) { 
     Mat fgMask;
-    if (is_absdiff) {
+    if (bgMethod >= 0) {
+      backgroundModel(model.image, bgImage, pBackgroundData, bgMethod, learningRate, downscale, varThreshold, maxval, fgMask);
+      model.image = fgMask;
+    } else if (is_absdiff) {
       absdiff(model.image, bgImage, fgMask);
       if (fgMask.channels() > 1) {
         cvtColor(fgMask, fgMask, CV_BGR2GRAY);
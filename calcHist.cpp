@@ -16,6 +16,100 @@ using namespace cv;
 using namespace std;
 using namespace firesight;
 
+#define HIST_BAND_ROWS 64 /* rows counted by one task into its own sub-histogram */
+
+/**
+ * Bin of each 8-bit value as computed by cv::calcHist for uniform bins, or -1 if out of range
+ */
+static void binLookupTable(float rangeMin, float rangeMax, int bins, int lut[256]) {
+  double a = bins / ((double) rangeMax - rangeMin);
+  double b = -a * rangeMin;
+  for (int v = 0; v < 256; v++) {
+    int bin = cvFloor(v*a + b);
+    lut[v] = 0 <= bin && bin < bins ? bin : -1;
+  }
+}
+
+/**
+ * Counts all histogram channels of an 8-bit image in one pass over each band of rows.
+ * Each band has its own sub-histogram, so no locking is needed. Sub-histograms are merged
+ * by the caller. Bands also record pixel locations of selected bins in raster order.
+ */
+class HistBandBody : public ParallelLoopBody {
+  private:
+    const Mat &image;
+    const int *lut;
+    const vector<int> &channels;
+    bool split;
+    int bins;
+    vector<vector<int> > &bandHists;
+    const vector<bool> *pSelected;
+    size_t maxLocations;
+    vector<vector<Vec4i> > *pBandLocations;
+
+  public:
+    HistBandBody(const Mat &image, const int *lut, const vector<int> &channels, bool split, int bins,
+		 vector<vector<int> > &bandHists)
+      : image(image), lut(lut), channels(channels), split(split), bins(bins), bandHists(bandHists),
+	pSelected(NULL), maxLocations(0), pBandLocations(NULL) {}
+
+    /**
+     * Record locations of pixels in selected bins instead of counting
+     */
+    void setLocations(const vector<bool> *pSelected, size_t maxLocations,
+		      vector<vector<Vec4i> > *pBandLocations) {
+      this->pSelected = pSelected;
+      this->maxLocations = maxLocations;
+      this->pBandLocations = pBandLocations;
+    }
+
+    void operator()(const Range &range) const {
+      int cn = image.channels();
+      int nHist = (int) channels.size();
+      for (int band = range.start; band < range.end; band++) {
+	int r0 = band * HIST_BAND_ROWS;
+	int r1 = min(image.rows, r0 + HIST_BAND_ROWS);
+	if (pBandLocations) {
+	  locate(band, r0, r1, cn, nHist);
+	  continue;
+	}
+	int *pHist = &bandHists[band][0];
+	for (int r = r0; r < r1; r++) {
+	  const uchar *pRow = image.ptr<uchar>(r);
+	  for (int c = 0; c < image.cols; c++) {
+	    const uchar *pPixel = pRow + c*cn;
+	    for (int h = 0; h < nHist; h++) {
+	      int bin = lut[pPixel[channels[h]]];
+	      if (bin >= 0) {
+		pHist[(split ? h*bins : 0) + bin]++;
+	      }
+	    }
+	  }
+	}
+      }
+    }
+
+    void locate(int band, int r0, int r1, int cn, int nHist) const {
+      vector<Vec4i> &locations = (*pBandLocations)[band];
+      const vector<bool> &selected = *pSelected;
+      for (int r = r0; r < r1 && locations.size() < maxLocations; r++) {
+	const uchar *pRow = image.ptr<uchar>(r);
+	for (int c = 0; c < image.cols && locations.size() < maxLocations; c++) {
+	  const uchar *pPixel = pRow + c*cn;
+	  for (int h = 0; h < nHist; h++) {
+	    int bin = lut[pPixel[channels[h]]];
+	    if (bin >= 0 && selected[bin]) {
+	      locations.push_back(Vec4i(c, r, bin, h));
+	      if (!split) {
+		break;
+	      }
+	    }
+	  }
+	}
+      }
+    }
+};
+
 bool Pipeline::apply_calcHist(json_t *pStage, json_t *pStageModel, Model &model) {
   validateImage(model.image);
   int nChannels = model.image.channels();
@@ -31,6 +125,7 @@ bool Pipeline::apply_calcHist(json_t *pStage, json_t *pStageModel, Model &model)
   }
   vector<int> histChannels = jo_vectori(pStage, "channels", defaultChannels, model.argMap);
   int locations = jo_int(pStage, "locations", 0, model.argMap);
+  string formatStr = jo_string(pStage, "format", "object", model.argMap);
   int bins = jo_int(pStage, "bins", (int)(rangeMax-rangeMin), model.argMap);
   int histSize[] = {bins,bins,bins,bins};
   bool split = !accumulate && nChannels > 1 && histChannels.size() > 1;
@@ -52,67 +147,117 @@ bool Pipeline::apply_calcHist(json_t *pStage, json_t *pStageModel, Model &model)
   if (histChannels.size() > 4) {
     errMsg = "Expected at most 4 histogram channels";
   }
+  for (size_t i = 0; !errMsg && i < histChannels.size(); i++) {
+    if (histChannels[i] < 0 || nChannels <= histChannels[i]) {
+      errMsg = "Expected 0 <= channel < image channels";
+    }
+  }
+  if (formatStr.compare("object") != 0 && formatStr.compare("array") != 0) {
+    errMsg = "Expected format: object, array";
+  }
+  if (locations < 0) {
+    errMsg = "Expected locations: maximum number of pixel locations, or 0";
+  } else if (locations && model.image.depth() != CV_8U) {
+    errMsg = "Expected 8-bit image for locations";
+  }
 
   if (!errMsg) {
-    float rangeC0[] = { rangeMin, rangeMax }; 
-    float rangeC1[] = { rangeMin, rangeMax }; 
-    float rangeC2[] = { rangeMin, rangeMax }; 
-    float rangeC3[] = { rangeMin, rangeMax }; 
-    const float* ranges[] = { rangeC0, rangeC1, rangeC2, rangeC3 };
-    Mat hist[] = {Mat(),Mat(),Mat(),Mat()};
-    int channels[4];
-    for (int i = 0; i < 4; i++) {
-      channels[i] =  i < histChannels.size() ? histChannels[i] : i;
-    }
-    if (split) {
-      for (int channel=0; channel<histChannels.size(); channel++) {
-	calcHist(&model.image, 1, &channels[channel], mask, hist[channel], 1, histSize, ranges, uniform, false);
+    int nHist = split ? (int) histChannels.size() : 1;
+    vector<double> hist(nHist * bins);
+    bool is8U = model.image.depth() == CV_8U;
+    int lut[256];
+    if (is8U) {
+      binLookupTable(rangeMin, rangeMax, bins, lut);
+      int nBands = (model.image.rows + HIST_BAND_ROWS - 1) / HIST_BAND_ROWS;
+      vector<vector<int> > bandHists(nBands, vector<int>(nHist * bins));
+      HistBandBody body(model.image, lut, histChannels, split, bins, bandHists);
+      parallel_for_(Range(0, nBands), body);
+      for (int band = 0; band < nBands; band++) {
+	for (size_t i = 0; i < hist.size(); i++) {
+	  hist[i] += bandHists[band][i];
+	}
       }
     } else {
+      float rangeC0[] = { rangeMin, rangeMax }; 
+      float rangeC1[] = { rangeMin, rangeMax }; 
+      float rangeC2[] = { rangeMin, rangeMax }; 
+      float rangeC3[] = { rangeMin, rangeMax }; 
+      const float* ranges[] = { rangeC0, rangeC1, rangeC2, rangeC3 };
+      Mat channelHist;
       for (int channel=0; channel<histChannels.size(); channel++) {
-	calcHist(&model.image, 1, &channels[channel], mask, hist[0], 1, histSize, ranges, uniform, true);
+	calcHist(&model.image, 1, &histChannels[channel], mask, channelHist, 1, histSize, ranges, uniform, false);
+	double *pHist = &hist[split ? channel*bins : 0];
+	for (int i = 0; i < bins; i++) {
+	  pHist[i] += channelHist.at<float>(i);
+	}
       }
     }
-    json_t *pHist = json_object();
-    if (split) {
-      for (int i = 0; i < bins; i++) {
-	json_t *pDimHist = json_array();
-	bool keep = false;
+    LOGTRACE3("apply_calcHist() %s %d histogram(s) of %d bins", is8U ? "parallel" : "serial", nHist, bins);
+
+    bool isArray = formatStr.compare("array") == 0;
+    json_t *pHist = isArray ? json_array() : json_object();
+    vector<bool> selected(bins);
+    for (int i = 0; i < bins; i++) {
+      json_t *pBin = json_array();
+      if (isArray) {
+	json_array_append(pBin, json_integer(i));
+      }
+      if (split) {
 	for (int channel = 0; channel < histChannels.size(); channel++) {
-	  float binValue = hist[channel].at<float>(i);
-	  keep = keep || binMin <= binValue && (binMax==0 || binValue < binMax);
-	  json_t *pNum = (int)binValue == binValue ? json_integer(binValue) : json_real(binValue);
-	  json_array_append(pDimHist, pNum);
-	}
-	if (keep) {
-	  char numBuf[20];
-	  snprintf(numBuf, sizeof(numBuf), "%d", i);
-	  json_object_set(pHist, numBuf, pDimHist);
-	} else {
-	  json_decref(pDimHist);
+	  double binValue = hist[channel*bins + i];
+	  selected[i] = selected[i] || binMin <= binValue && (binMax==0 || binValue < binMax);
+	  json_t *pNum = (int)binValue == binValue ? json_integer((int)binValue) : json_real(binValue);
+	  json_array_append(pBin, pNum);
 	}
+      } else {
+	double binValue = hist[i];
+	selected[i] = !(binValue == 0 || binMax && binValue > binMax);
+	json_t *pNum = (int)binValue == binValue ? json_integer((int)binValue) : json_real(binValue);
+	json_array_append(pBin, pNum);
       }
-    } else {
-      for (int i = 0; i < bins; i++) {
-	json_t *pDimHist = json_array();
-	float binValue = hist[0].at<float>(i);
-	if ((binValue == 0 || binMax && binValue > binMax)) {
-	  // ignore value
+      if (!selected[i]) {
+	json_decref(pBin);
+      } else if (isArray) {
+	json_array_append(pHist, pBin);
+      } else {
+	char numBuf[20];
+	snprintf(numBuf, sizeof(numBuf), "%d", i);
+	if (split) {
+	  json_object_set(pHist, numBuf, pBin);
 	} else {
-	  char numBuf[20];
-	  snprintf(numBuf, sizeof(numBuf), "%d", i);
-	  json_t *pNum = (int)binValue == binValue ? json_integer(binValue) : json_real(binValue);
-	  json_object_set(pHist, numBuf, pNum);
+	  json_object_set(pHist, numBuf, json_array_get(pBin, 0));
+	  json_decref(pBin);
 	}
       }
     }
     json_object_set(pStageModel, "hist", pHist);
+
     if (locations) {
       json_t *pLocations = json_array();
       json_object_set(pStageModel, "locations", pLocations);
+      int nBands = (model.image.rows + HIST_BAND_ROWS - 1) / HIST_BAND_ROWS;
+      vector<vector<int> > noHists;
+      vector<vector<Vec4i> > bandLocations(nBands);
+      HistBandBody body(model.image, lut, histChannels, split, bins, noHists);
+      body.setLocations(&selected, locations, &bandLocations);
+      parallel_for_(Range(0, nBands), body);
+      size_t count = 0;
+      for (int band = 0; band < nBands && count < (size_t) locations; band++) {
+	for (size_t i = 0; i < bandLocations[band].size() && count < (size_t) locations; i++, count++) {
+	  const Vec4i &loc = bandLocations[band][i];
+	  json_t *pLoc = json_array();
+	  json_array_append(pLoc, json_integer(loc[0]));
+	  json_array_append(pLoc, json_integer(loc[1]));
+	  json_array_append(pLoc, json_integer(loc[2]));
+	  if (split) {
+	    json_array_append(pLoc, json_integer(loc[3]));
+	  }
+	  json_array_append(pLocations, pLoc);
+	}
+      }
+      LOGTRACE1("apply_calcHist() %d locations", (int) count);
     }
   }
 
   return stageOK("apply_calcHist(%s) %s", errMsg, pStage, pStageModel);
 }
-
@@ -46,11 +46,8 @@ bool Pipeline::apply_calcOffset(json_t *pStage, json_t *pStageModel, Model &mode
     if (tmpltPath.empty()) {
         errMsg = "Expected template path for imread";
     } else {
-        if (model.image.channels() == 1) {
-            tmplt = imread(tmpltPath.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-        } else {
-            tmplt = imread(tmpltPath.c_str(), CV_LOAD_IMAGE_COLOR);
-        }
+        string errStr;
+        tmplt = ImageStore::load(tmpltPath.c_str(), errStr, model.image.channels() == 1);
         if (tmplt.data) {
             LOGTRACE2("apply_calcOffset(%s) %s", tmpltPath.c_str(), matInfo(tmplt).c_str());
             if (model.image.rows<tmplt.rows || model.image.cols<tmplt.cols) {
@@ -84,7 +81,7 @@ bool Pipeline::apply_calcOffset(json_t *pStage, json_t *pStageModel, Model &mode
                 imagePlanes[0] = model.image;
                 tmpltPlanes[0] = tmplt;
             } else {
-                cvtColor(model.image, imagePlanes[0], CV_BGR2GRAY);
+                imagePlanes[0] = model.gray();
                 cvtColor(tmplt, tmpltPlanes[0], CV_BGR2GRAY);
             }
         } else if (model.image.channels() == 1) {
@@ -1,6 +1,5 @@
 #include <string.h>
 #include <math.h>
-#include <set>
 #include <iostream>
 #include <stdexcept>
 #include "FireLog.h"
@@ -53,43 +52,91 @@ enum CalibrateOp {
 	CAL_CROSS
 };
 
-enum CompareOp {
-    COMPARE_XY,
-    COMPARE_YX
-};
-
-typedef class ComparePoint2f {
+/**
+ * Uniform grid hash of image points. Cells are sized to the estimated grid pitch,
+ * so neighbour and duplicate queries only visit the few cells around a point.
+ */
+typedef class PointHash {
     private:
-        CompareOp op;
-		float tolerance;
+        Point2f origin;
+        int cols;
+        int rows;
+        vector<vector<int> > cells;
 
-    public:
-        ComparePoint2f(CompareOp op=COMPARE_XY, float tolerance=10) {
-            this->op = op;
-			this->tolerance = tolerance;
+        int cellIndex(int c, int r) {
+            return max(0,min(rows-1,r))*cols + max(0,min(cols-1,c));
+        }
+        int cellCol(const Point2f &pt) {
+            return (int) floor((pt.x - origin.x)/cellSize);
         }
+        int cellRow(const Point2f &pt) {
+            return (int) floor((pt.y - origin.y)/cellSize);
+        }
+
     public:
-        bool operator()(const Point2f &lhs, const Point2f &rhs) const {
-            assert(!isnan(lhs.x));
-            assert(!isnan(rhs.x));
-            int cmp;
-            switch (op) {
-            case COMPARE_XY:
-                cmp = lhs.x - rhs.x;
-                if (-tolerance <= cmp && cmp <= tolerance) {
-                    cmp = lhs.y - rhs.y;
-                }
-                break;
-            case COMPARE_YX:
-                cmp = lhs.y - rhs.y;
-                if (-tolerance <= cmp && cmp <= tolerance) {
-                    cmp = lhs.x - rhs.x;
+        float cellSize;
+        vector<Point2f> points;
+
+        PointHash(Rect_<float> bounds, float cellSize) {
+            this->cellSize = max(1.0f, cellSize);
+            origin = Point2f(bounds.x, bounds.y);
+            cols = (int)(bounds.width/this->cellSize) + 1;
+            rows = (int)(bounds.height/this->cellSize) + 1;
+            cells.resize(cols*rows);
+        }
+
+        /**
+         * Return index of the point nearest to pt within radius, or -1.
+         * If direction is given, only points within 45 degrees of that direction are considered.
+         */
+        int nearest(const Point2f &pt, float radius, Point2f direction=Point2f(0,0)) {
+            int ring = (int) ceil(radius/cellSize);
+            int c0 = cellCol(pt);
+            int r0 = cellRow(pt);
+            float bestDist2 = radius*radius;
+            int best = -1;
+            bool directed = direction.x || direction.y;
+            for (int r=max(0,r0-ring); r <= min(rows-1,r0+ring); r++) {
+                for (int c=max(0,c0-ring); c <= min(cols-1,c0+ring); c++) {
+                    vector<int> &cell = cells[r*cols + c];
+                    for (size_t i=0; i < cell.size(); i++) {
+                        Point2f d = points[cell[i]] - pt;
+                        float dist2 = d.dot(d);
+                        if (dist2 >= bestDist2) {
+                            continue;
+                        }
+                        if (directed) {
+                            float along = d.dot(direction);
+                            float across = d.x*direction.y - d.y*direction.x;
+                            if (along <= 0 || along < fabs(across)) {
+                                continue;
+                            }
+                        }
+                        bestDist2 = dist2;
+                        best = cell[i];
+                    }
                 }
-                break;
             }
-            return cmp < 0;
+            return best;
+        }
+
+        /**
+         * Add point unless there is already a point within minDist.
+         * @return true if point was added
+         */
+        bool insert(const Point2f &pt, float minDist) {
+            if (minDist > 0 && nearest(pt, minDist) >= 0) {
+                return false;
+            }
+            cells[cellIndex(cellCol(pt), cellRow(pt))].push_back(points.size());
+            points.push_back(pt);
+            return true;
         }
-} ComparePoint2f;
+
+        int size() {
+            return points.size();
+        }
+} PointHash;
 
 static void initCameraVectors(vector<double> &cmDefault, vector<double> &dcDefault,
                               Mat &image)
@@ -111,14 +158,16 @@ static void initCameraVectors(vector<double> &cmDefault, vector<double> &dcDefau
     dcDefault.push_back(0);
 }
 
+struct GridMatcher;
+static double calibrateBest(GridMatcher &gm, Point2f scale, Mat &cameraMatrix, Mat &distCoeffs,
+                            vector<Mat> &rvecs, vector<Mat> &tvecs, string &bestOp, int &tried);
+
 typedef struct GridMatcher {
     vector<Point2f> imagePts;		// input image 
 	vector<Point2f> calibrationPts;	// image calibration points (post-perspective)	
     vector<Point3f> objectPts;		// 
     Rect imgRect;
-    const ComparePoint2f cmpYX;
-    set<Point2f,ComparePoint2f> imgSet;
-    set<Point2f,ComparePoint2f> subImgSet;
+    vector<bool> subImgUsed;		// imagePts used in calibration
     vector<vector<Point2f> > vImagePts;
     vector<vector<Point3f> > vObjectPts;
 	Point2f grid;
@@ -128,13 +177,12 @@ typedef struct GridMatcher {
     Point2f objSep;
     Mat gridIndexes;	// object grid matrix of imagePts/calibrationPts/objectPts vector indexes or -1
 	double tolerance;
+	double rmsTarget;	// calibrate:"best" stops searching at this rmserror
     GridMatcher(Size imgSize, Point2f objSep, double tolerance)
-        : cmpYX(ComparePoint2f(COMPARE_YX)),
-          imgSet(set<Point2f,ComparePoint2f>(cmpYX)),
-          subImgSet(set<Point2f,ComparePoint2f>(cmpYX)),
-		  grid(FLT_MAX,FLT_MAX),
+        : grid(FLT_MAX,FLT_MAX),
 		  objSep(objSep),
-		  tolerance(tolerance)
+		  tolerance(tolerance),
+		  rmsTarget(0)
     {
         this->imgSize = imgSize;
         this->imgRect = Rect(imgSize.width/2, imgSize.height/2, 0, 0);
@@ -262,19 +310,19 @@ typedef struct GridMatcher {
 		return Point2f(sqrt(totalSquaredError.x/n),sqrt(totalSquaredError.y/n));
 	}
 
-	string identifyRows(json_t *pStageModel, vector<Point2f> &pointsXY, float &dyMedian, Point2f &dyTot1,
-                           Point2f &dyTot2, int &dyCount1, int &dyCount2)
+	string identifyRows(json_t *pStageModel, PointHash &points, vector<int> &nextY, float &dyMedian,
+						   Point2f &dyTot1, Point2f &dyTot2, int &dyCount1, int &dyCount2)
 	{
 		vector<float> dyList;
-		Point2f prevPt;
-		for (vector<Point2f>::iterator it=pointsXY.begin(); it!=pointsXY.end(); it++) {
-			if (it != pointsXY.begin()) {
-				float dy = prevPt.y - it->y;
-				dyList.push_back(dy);
+		for (int i=0; i < points.size(); i++) {
+			if (nextY[i] >= 0) {
+				dyList.push_back(points.points[i].y - points.points[nextY[i]].y);
 			}
-			prevPt = *it;
 		}
-		sort(dyList.begin(), dyList.end());
+		if (dyList.size() == 0) {
+			return "No grid points have a neighbouring row";
+		}
+		nth_element(dyList.begin(), dyList.begin()+dyList.size()/2, dyList.end());
 		dyMedian = dyList[dyList.size()/2];
 		float maxTol = dyMedian < 0 ? 1-tolerance : 1+tolerance;
 		float minTol = dyMedian < 0 ? 1+tolerance : 1-tolerance;
@@ -283,34 +331,32 @@ typedef struct GridMatcher {
 		float maxDy2 = 2*dyMedian * maxTol;
 		float minDy2 = 2*dyMedian * minTol;
 
-		Point2f prevPt1;
-		Point2f prevPt2;
-		int n = 0;
-		for (vector<Point2f>::iterator it=pointsXY.begin();
-				it!=pointsXY.end(); it++) {
-			const Point2f &curPt = *it;
-			if (n > 0) {
-				LOGDEBUG3("indentifyRows() pointsXY[%d] (%g,%g)", n, curPt.x, curPt.y);
-				float dy1 = prevPt1.y - curPt.y;
-				if (dy1 < minDy1) {
-					LOGTRACE2("identifyRows() reject dy1:%g < minDy1:%g", dy1, minDy1);
-				} else if (maxDy1 < dy1) {
-					LOGTRACE2("identifyRows() reject maxDy1:%g < dy1:%g", maxDy1, dy1);
-				} else {
-					dyTot1 = dyTot1 + (prevPt1 - curPt);
-					dyCount1++;
-				}
-				if (n > 1) {
-					int dy2 = prevPt2.y - curPt.y;
-					if (minDy2 <= dy2 && dy2 <= maxDy2) {
-						dyTot2 = dyTot2 + (prevPt2 - curPt);
-						dyCount2++;
-					}
+		for (int i=0; i < points.size(); i++) {
+			int j = nextY[i];
+			if (j < 0) {
+				continue;
+			}
+			const Point2f &prevPt1 = points.points[i];
+			const Point2f &curPt = points.points[j];
+			LOGDEBUG3("identifyRows() points[%d] (%g,%g)", j, curPt.x, curPt.y);
+			float dy1 = prevPt1.y - curPt.y;
+			if (dy1 < minDy1) {
+				LOGTRACE2("identifyRows() reject dy1:%g < minDy1:%g", dy1, minDy1);
+			} else if (maxDy1 < dy1) {
+				LOGTRACE2("identifyRows() reject maxDy1:%g < dy1:%g", maxDy1, dy1);
+			} else {
+				dyTot1 = dyTot1 + (prevPt1 - curPt);
+				dyCount1++;
+			}
+			int k = nextY[j];
+			if (k >= 0) {
+				const Point2f &curPt2 = points.points[k];
+				int dy2 = prevPt1.y - curPt2.y;
+				if (minDy2 <= dy2 && dy2 <= maxDy2) {
+					dyTot2 = dyTot2 + (prevPt1 - curPt2);
+					dyCount2++;
 				}
 			}
-			prevPt2 = prevPt1;
-			prevPt1 = curPt;
-			n++;
 		}
 
 		string errMsg;
@@ -341,19 +387,19 @@ typedef struct GridMatcher {
 		return errMsg;
 	} // identifyRows
 
-	string identifyColumns(json_t *pStageModel, vector<Point2f> &pointsYX, float &dxMedian, Point2f &dxTot1,
-								  Point2f &dxTot2, int &dxCount1, int &dxCount2)
+	string identifyColumns(json_t *pStageModel, PointHash &points, vector<int> &nextX, float &dxMedian,
+						   Point2f &dxTot1, Point2f &dxTot2, int &dxCount1, int &dxCount2)
 	{
 		vector<float> dxList;
-		Point2f prevPt;
-		for (vector<Point2f>::iterator it=pointsYX.begin(); it!=pointsYX.end(); it++) {
-			if (it != pointsYX.begin()) {
-				float dx = prevPt.x - it->x;
-				dxList.push_back(dx);
+		for (int i=0; i < points.size(); i++) {
+			if (nextX[i] >= 0) {
+				dxList.push_back(points.points[i].x - points.points[nextX[i]].x);
 			}
-			prevPt = *it;
 		}
-		sort(dxList.begin(), dxList.end());
+		if (dxList.size() == 0) {
+			return "No grid points have a neighbouring column";
+		}
+		nth_element(dxList.begin(), dxList.begin()+dxList.size()/2, dxList.end());
 		dxMedian = dxList[dxList.size()/2];
 		float maxTol = dxMedian < 0 ? 1-tolerance : 1+tolerance;
 		float minTol = dxMedian < 0 ? 1+tolerance : 1-tolerance;
@@ -362,34 +408,32 @@ typedef struct GridMatcher {
 		float maxDx2 = 2*dxMedian * maxTol;
 		float minDx2 = 2*dxMedian * minTol;
 
-		Point2f prevPt1;
-		Point2f prevPt2;
-		int n = 0;
-		for (vector<Point2f>::iterator it=pointsYX.begin();
-				it!=pointsYX.end(); it++) {
-			const Point2f &curPt = *it;
-			if (n > 0) {
-				LOGDEBUG3("identify_Columns() pointsYX[%d] (%g,%g)", n, curPt.x, curPt.y);
-				float dx1 = prevPt1.x - curPt.x;
-				if (dx1 < minDx1) {
-					LOGTRACE2("identifyColumns() reject dx1:%g < minDx1:%g", dx1, minDx1);
-				} else if (maxDx1 < dx1) {
-					LOGTRACE2("identifyColumns() reject maxDx1:%g < dx1:%g", maxDx1, dx1);
-				} else {
-					dxTot1 = dxTot1 + (prevPt1 - curPt);
-					dxCount1++;
-				}
-				if (n > 1) {
-					int dx2 = prevPt2.x - curPt.x;
-					if (minDx2 <= dx2 && dx2 <= maxDx2) {
-						dxTot2 = dxTot2 + (prevPt2 - curPt);
-						dxCount2++;
-					}
+		for (int i=0; i < points.size(); i++) {
+			int j = nextX[i];
+			if (j < 0) {
+				continue;
+			}
+			const Point2f &prevPt1 = points.points[i];
+			const Point2f &curPt = points.points[j];
+			LOGDEBUG3("identifyColumns() points[%d] (%g,%g)", j, curPt.x, curPt.y);
+			float dx1 = prevPt1.x - curPt.x;
+			if (dx1 < minDx1) {
+				LOGTRACE2("identifyColumns() reject dx1:%g < minDx1:%g", dx1, minDx1);
+			} else if (maxDx1 < dx1) {
+				LOGTRACE2("identifyColumns() reject maxDx1:%g < dx1:%g", maxDx1, dx1);
+			} else {
+				dxTot1 = dxTot1 + (prevPt1 - curPt);
+				dxCount1++;
+			}
+			int k = nextX[j];
+			if (k >= 0) {
+				const Point2f &curPt2 = points.points[k];
+				int dx2 = prevPt1.x - curPt2.x;
+				if (minDx2 <= dx2 && dx2 <= maxDx2) {
+					dxTot2 = dxTot2 + (prevPt1 - curPt2);
+					dxCount2++;
 				}
 			}
-			prevPt2 = prevPt1;
-			prevPt1 = curPt;
-			n++;
 		}
 
 		string errMsg;
@@ -420,21 +464,19 @@ typedef struct GridMatcher {
 		return errMsg;
 	} // identifyColumns
 
-    bool add(Point2f &ptImg, Point3f &ptObj) {
-        set<Point2f,ComparePoint2f>::iterator it = imgSet.find(ptImg);
-
-        if (it != imgSet.end()) {
-            return false;
-        }
+    void add(const Point2f &ptImg, const Point3f &ptObj) {
         objectPts.push_back(ptObj);
         imagePts.push_back(ptImg);
-        imgSet.insert(ptImg);
-        return true;
     }
 
     void calcGridIndexes() {
         int ny = imgSize.height/imgSep.y+1.5;
         int nx = imgSize.width/imgSep.x+1.5;
+        for (int i=0; i < objectPts.size(); i++) {
+            ny = max(ny, (int) objectPts[i].y+1);
+            nx = max(nx, (int) objectPts[i].x+1);
+        }
+        subImgUsed.assign(objectPts.size(), false);
         gridIndexes = Mat(Size(nx,ny),CV_16S);
         gridIndexes = -1;
         LOGTRACE2("calcGridIndexes() [%d,%d]", ny, nx);
@@ -462,8 +504,7 @@ typedef struct GridMatcher {
     }
 
 	bool initPerspective(int r, int c, int dr, int dc, vector<Point2f> srcPts,
-		Point2f &perspectiveDst, Point2f &perspectiveSrc, 
-		set<Point2f,ComparePoint2f> *pSubImgSet) 
+		Point2f &perspectiveDst, Point2f &perspectiveSrc, bool markUsed) 
 	{
 		int found = 0;
 		int index;
@@ -480,7 +521,7 @@ typedef struct GridMatcher {
 				if (0 <= r+i && r+i < gridIndexes.rows && 0 <= c+j && c+j < gridIndexes.cols) {
 					index = gridIndexes.at<short>(r+i,c+j);
 					if (0 <= index) {
-						if (pSubImgSet) { pSubImgSet->insert(imagePts[index]); }
+						if (markUsed) { subImgUsed[index] = true; }
 						pDst += imagePts[index];
 						pSrc += Point2f(srcPts[index].x, srcPts[index].y);
 						if (logLevel == FIRELOG_TRACE) {
@@ -505,7 +546,7 @@ typedef struct GridMatcher {
 		return true;
 	}
 
-    Mat calcPerspective(vector<Point2f> &srcPts, set<Point2f,ComparePoint2f> *pSubImgSet=NULL) {
+    Mat calcPerspective(vector<Point2f> &srcPts, bool markUsed=false) {
 		Point2f perspectiveSrc[4];
 		Point2f perspectiveDst[4];
         int rows = gridIndexes.rows;
@@ -513,22 +554,22 @@ typedef struct GridMatcher {
         int r2 = rows/2;
         int c2 = cols/2;
         for (int r=0; r <= r2; r++ ) {
-			if (initPerspective(r,(r*c2)/r2, 1, 1, srcPts, perspectiveDst[0], perspectiveSrc[0], pSubImgSet)) {
+			if (initPerspective(r,(r*c2)/r2, 1, 1, srcPts, perspectiveDst[0], perspectiveSrc[0], markUsed)) {
 				break;
 			}
         }
         for (int r=0; r <= r2; r++ ) {
-			if (initPerspective(rows-r-1,(r*c2)/r2, -1, 1, srcPts, perspectiveDst[1], perspectiveSrc[1], pSubImgSet)) {
+			if (initPerspective(rows-r-1,(r*c2)/r2, -1, 1, srcPts, perspectiveDst[1], perspectiveSrc[1], markUsed)) {
 				break;
 			}
         }
         for (int r=0; r <= r2; r++ ) {
-			if (initPerspective(r,cols-1-(r*c2)/r2, 1, -1, srcPts, perspectiveDst[2], perspectiveSrc[2], pSubImgSet)) {
+			if (initPerspective(r,cols-1-(r*c2)/r2, 1, -1, srcPts, perspectiveDst[2], perspectiveSrc[2], markUsed)) {
 				break;
 			}
         }
         for (int r=0; r <= r2; r++ ) {
-			if (initPerspective(rows-r-1,cols-1-(r*c2)/r2, -1, -1, srcPts, perspectiveDst[3], perspectiveSrc[3], pSubImgSet)) {
+			if (initPerspective(rows-r-1,cols-1-(r*c2)/r2, -1, -1, srcPts, perspectiveDst[3], perspectiveSrc[3], markUsed)) {
                 break;
             }
         }
@@ -536,75 +577,87 @@ typedef struct GridMatcher {
         return getPerspectiveTransform(perspectiveDst, perspectiveSrc);
     }
 
-    void matchPoints(Point2f dmedian, vector<Point2f> &pointsYX, vector<Point2f> &pointsXY) {
-        Point3f ptObj;
-        Point2f ptImg;
-
+    /**
+     * Assign object grid coordinates by walking neighbour links that are within tolerance
+     * of the median grid separation.
+     */
+    void matchPoints(Point2f dmedian, PointHash &points, vector<int> &nextX, vector<int> &nextY) {
+        int n = points.size();
         float maxDx1 = dmedian.x * (dmedian.x < 0 ? 1-tolerance : 1+tolerance);
         float minDx1 = dmedian.x * (dmedian.x < 0 ? 1+tolerance : 1-tolerance);
+        float maxDy1 = dmedian.y * (dmedian.y < 0 ? 1-tolerance : 1+tolerance);
+        float minDy1 = dmedian.y * (dmedian.y < 0 ? 1+tolerance : 1-tolerance);
 
-        vector<Point2f>::iterator itYX = pointsYX.begin();
-        for (Point2f ptImg0=(*itYX); ++itYX!=pointsYX.end(); ) {
-            const Point2f &ptImg1(*itYX);
-            float dx1 = ptImg0.x - ptImg1.x;
-            if (dx1 < minDx1) {
-                LOGTRACE2("matchPoints() reject dx1:%g < minDx1:%g", dx1, minDx1);
-            } else if (maxDx1 < dx1) {
-                LOGTRACE2("matchPoints() reject minDx1:%g < dx1:%g", maxDx1, dx1);
-            } else {
-                if (imagePts.size() == 0) {
-                    ptImg = ptImg0;
-                    ptObj.x = (int)(ptImg.x/imgSep.x + 0.5);
-                    ptObj.y = (int)(ptImg.y/imgSep.y + 0.5);
-                    add(ptImg, ptObj);
-                    ptObj += calcObjPointDiff(ptImg1, ptImg, imgSep);
-                    ptImg = ptImg1;
-                    add(ptImg, ptObj);
+        vector<vector<int> > links(n);
+        for (int i=0; i < n; i++) {
+            const Point2f &ptImg0 = points.points[i];
+            int j = nextX[i];
+            if (j >= 0) {
+                float dx1 = ptImg0.x - points.points[j].x;
+                if (dx1 < minDx1) {
+                    LOGTRACE2("matchPoints() reject dx1:%g < minDx1:%g", dx1, minDx1);
+                } else if (maxDx1 < dx1) {
+                    LOGTRACE2("matchPoints() reject maxDx1:%g < dx1:%g", maxDx1, dx1);
                 } else {
-                    if (ptImg != ptImg0) {
-                        ptObj += calcObjPointDiff(ptImg0, ptImg, imgSep);
-                        ptImg = ptImg0;
-                        add(ptImg, ptObj);
-                    }
-                    ptObj += calcObjPointDiff(ptImg1, ptImg, imgSep);
-                    ptImg = ptImg1;
-                    add(ptImg, ptObj);
+                    links[i].push_back(j);
+                    links[j].push_back(i);
+                }
+            }
+            j = nextY[i];
+            if (j >= 0) {
+                float dy1 = ptImg0.y - points.points[j].y;
+                if (dy1 < minDy1) {
+                    LOGTRACE2("matchPoints() reject dy1:%g < minDy1:%g", dy1, minDy1);
+                } else if (maxDy1 < dy1) {
+                    LOGTRACE2("matchPoints() reject maxDy1:%g < dy1:%g", maxDy1, dy1);
+                } else {
+                    links[i].push_back(j);
+                    links[j].push_back(i);
                 }
             }
-            ptImg0 = ptImg1;
         }
 
-        float maxDy1 = dmedian.y * (dmedian.y < 0 ? 1-tolerance : 1+tolerance);
-        float minDy1 = dmedian.y * (dmedian.y < 0 ? 1+tolerance : 1-tolerance);
-        vector<Point2f>::iterator itXY = pointsXY.begin();
-        for (Point2f ptImg0=(*itXY); ++itXY!=pointsXY.end(); ) {
-            const Point2f &ptImg1(*itXY);
-            float dy1 = ptImg0.y - ptImg1.y;
-            if (dy1 < minDy1) {
-                LOGTRACE2("matchPoints() reject dy1:%g < minDy1:%g", dy1, minDy1);
-            } else if (maxDy1 < dy1) {
-                LOGTRACE2("matchPoints() reject minDy1:%g < dy1:%g", maxDy1, dy1);
+        vector<Point3f> objPts(n);
+        vector<bool> matched(n, false);
+        int seed = -1;
+        Point3f minObj(0,0,0);
+        vector<int> queue;
+        for (int i=0; i < n; i++) {
+            if (matched[i] || links[i].size() == 0) {
+                continue;
+            }
+            const Point2f &ptImg = points.points[i];
+            if (seed < 0) {
+                seed = i;
+                objPts[i] = Point3f((int)(ptImg.x/imgSep.x + 0.5), (int)(ptImg.y/imgSep.y + 0.5), 0);
             } else {
-                if (imagePts.size() == 0) {
-                    ptImg = ptImg0;
-                    ptObj.x = (int)(ptImg.x/imgSep.x + 0.5);
-                    ptObj.y = (int)(ptImg.y/imgSep.y + 0.5);
-                    add(ptImg, ptObj);
-                    ptObj += calcObjPointDiff(ptImg1, ptImg, imgSep);
-                    ptImg = ptImg1;
-                    add(ptImg, ptObj);
-                } else {
-                    if (ptImg != ptImg0) {
-                        ptObj += calcObjPointDiff(ptImg0, ptImg, imgSep);
-                        ptImg = ptImg0;
-                        add(ptImg, ptObj);
+                objPts[i] = objPts[seed] + calcObjPointDiff(ptImg, points.points[seed], imgSep);
+                minObj.x = min(minObj.x, objPts[i].x);
+                minObj.y = min(minObj.y, objPts[i].y);
+            }
+            matched[i] = true;
+            queue.clear();
+            queue.push_back(i);
+            for (size_t q=0; q < queue.size(); q++) {
+                int cur = queue[q];
+                for (size_t k=0; k < links[cur].size(); k++) {
+                    int next = links[cur][k];
+                    if (!matched[next]) {
+                        matched[next] = true;
+                        objPts[next] = objPts[cur] + 
+                            calcObjPointDiff(points.points[next], points.points[cur], imgSep);
+                        minObj.x = min(minObj.x, objPts[next].x);
+                        minObj.y = min(minObj.y, objPts[next].y);
+                        queue.push_back(next);
                     }
-                    ptObj += calcObjPointDiff(ptImg1, ptImg, imgSep);
-                    ptImg = ptImg1;
-                    add(ptImg, ptObj);
                 }
             }
-            ptImg0 = ptImg1;
+        }
+
+        for (int i=0; i < n; i++) {
+            if (matched[i]) {
+                add(points.points[i], objPts[i] - minObj);
+            }
         }
 
         if (logLevel == FIRELOG_TRACE) {
@@ -616,8 +669,10 @@ typedef struct GridMatcher {
     }
 
     bool addSubImagePoint(int r, int c, Point2f objCenter, vector<Point2f> &subImgPts, 
-							vector<Point3f> &subObjPts, 
-						  set<Point2f,ComparePoint2f> *pSubImgSet=NULL) {
+							vector<Point3f> &subObjPts, bool markUsed=false) {
+        if (r < 0 || c < 0 || r >= gridIndexes.rows || c >= gridIndexes.cols) {
+            return false;
+        }
         short index = gridIndexes.at<short>(r, c);
 		bool added = false;
         if (0 <= index) {
@@ -627,9 +682,8 @@ typedef struct GridMatcher {
             Point3f subObjPt(ptObj);
             added = true;
 			LOGTRACE4("addSubImagePoint(r:%d,c:%d,objCenter.x:%g,objCenter.y:%g)", r, c, objCenter.x, objCenter.y);
-			if (pSubImgSet) {
-				bool added = pSubImgSet->insert(ptImg).second;
-				(void) added;
+			if (markUsed) {
+				subImgUsed[index] = true;
 			}
             subObjPts.push_back(subObjPt);
             subImgPts.push_back(ptImg);
@@ -640,10 +694,10 @@ typedef struct GridMatcher {
 
     bool addSubImage(int row, int col, int rows, int cols, int minPts, bool combine=false) {
         LOGDEBUG4("addSubImage(%d,%d,%d,%d)", row, col, rows, cols);
-        assert(row >= 0);
-        assert(col >= 0);
-        assert(row+rows <= gridIndexes.rows);
-        assert(col+cols <= gridIndexes.cols);
+        if (row < 0 || col < 0 || row+rows > gridIndexes.rows || col+cols > gridIndexes.cols) {
+            LOGTRACE4("addSubImage(%d,%d,%d,%d) REJECT:outside grid", row, col, rows, cols);
+            return false;
+        }
         vector<Point2f> subImgPts;
         vector<Point3f> subObjPts;
 		Point2f objCenter((rows-1)/2.0, (cols-1)/2.0);
@@ -662,12 +716,16 @@ typedef struct GridMatcher {
             }
             return false;
         }
-		for (int i=0; i<subImgPts.size(); i++) {
-			Point2f ptImg = subImgPts[i];
-			if (subImgSet.insert(ptImg).second) {
-				LOGTRACE2("addSubImage() point:[%d,%d]", (int)ptImg.x, (int)ptImg.y);
-			}
-		}
+        for (int r=0; r < rows; r++) {
+            for (int c=0; c < cols; c++) {
+                short index = gridIndexes.at<short>(r+row, c+col);
+                if (0 <= index && !subImgUsed[index]) {
+                    subImgUsed[index] = true;
+                    LOGTRACE2("addSubImage() point:[%d,%d]", 
+                        (int)calibrationPts[index].x, (int)calibrationPts[index].y);
+                }
+            }
+        }
         if (logLevel >= FIRELOG_TRACE) {
             char buf[255];
             snprintf(buf, sizeof(buf), "addSubImage(%d,%d,%d,%d) ADD:%ld",
@@ -754,44 +812,44 @@ typedef struct GridMatcher {
         LOGTRACE3("subImageQuadrilateralFactory(%d,%g,%g)", extension, scale.x, scale.y);
 
 		if (centerPoint) {
-			addSubImagePoint(oc.y, oc.x, oc, subImgPts, subObjPts, &subImgSet)
-			|| addSubImagePoint(oc.y+1, oc.x, oc, subImgPts, subObjPts, &subImgSet)
-			|| addSubImagePoint(oc.y, oc.x+1, oc, subImgPts, subObjPts, &subImgSet)
-			|| addSubImagePoint(oc.y+1, oc.x+1, oc, subImgPts, subObjPts, &subImgSet);
+			addSubImagePoint(oc.y, oc.x, oc, subImgPts, subObjPts, true)
+			|| addSubImagePoint(oc.y+1, oc.x, oc, subImgPts, subObjPts, true)
+			|| addSubImagePoint(oc.y, oc.x+1, oc, subImgPts, subObjPts, true)
+			|| addSubImagePoint(oc.y+1, oc.x+1, oc, subImgPts, subObjPts, true);
 		}
 
 		for (int r=rStart; r <= oc.y; r++) {
-			if (addSubImagePoint(r, r, oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(r, r, oc, subImgPts, subObjPts, true)) {
 				for (int i=1; i <= extension; i++) {
-					addSubImagePoint(r, r+i, oc, subImgPts, subObjPts, &subImgSet);
-					addSubImagePoint(r+i, r, oc, subImgPts, subObjPts, &subImgSet);
+					addSubImagePoint(r, r+i, oc, subImgPts, subObjPts, true);
+					addSubImagePoint(r+i, r, oc, subImgPts, subObjPts, true);
 				}
 				break;
             }
         }
 		for (int r=rStart; r <= oc.y; r++) {
-			if (addSubImagePoint(r, cLast-(r-rStart), oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(r, cLast-(r-rStart), oc, subImgPts, subObjPts, true)) {
 				for (int i=1; i <= extension; i++) {
-					addSubImagePoint(r, cLast-(r-rStart)-i, oc, subImgPts, subObjPts, &subImgSet);
-					addSubImagePoint(r+i, cLast-(r-rStart), oc, subImgPts, subObjPts, &subImgSet);
+					addSubImagePoint(r, cLast-(r-rStart)-i, oc, subImgPts, subObjPts, true);
+					addSubImagePoint(r+i, cLast-(r-rStart), oc, subImgPts, subObjPts, true);
 				}
 				break;
             }
         }
 		for (int r=rLast; oc.y < r; r--) {
-			if (addSubImagePoint(r, cStart+(rLast-r), oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(r, cStart+(rLast-r), oc, subImgPts, subObjPts, true)) {
 				for (int i=1; i <= extension; i++) {
-					addSubImagePoint(r-i, cStart+(rLast-r), oc, subImgPts, subObjPts, &subImgSet);
-					addSubImagePoint(r, cStart+(rLast-r)+i, oc, subImgPts, subObjPts, &subImgSet);
+					addSubImagePoint(r-i, cStart+(rLast-r), oc, subImgPts, subObjPts, true);
+					addSubImagePoint(r, cStart+(rLast-r)+i, oc, subImgPts, subObjPts, true);
 				}
 				break;
             }
         }
 		for (int r=rLast; oc.y < r; r--) {
-			if (addSubImagePoint(r, cLast-(rLast-r), oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(r, cLast-(rLast-r), oc, subImgPts, subObjPts, true)) {
 				for (int i=1; i <= extension; i++) {
-					addSubImagePoint(r-i, cLast-(rLast-r), oc, subImgPts, subObjPts, &subImgSet);
-					addSubImagePoint(r, cLast-(rLast-r)-i, oc, subImgPts, subObjPts, &subImgSet);
+					addSubImagePoint(r-i, cLast-(rLast-r), oc, subImgPts, subObjPts, true);
+					addSubImagePoint(r, cLast-(rLast-r)-i, oc, subImgPts, subObjPts, true);
 				}
 				break;
             }
@@ -818,22 +876,22 @@ typedef struct GridMatcher {
 
         LOGTRACE2("subImageDiamondFactory(%g,%g)", scale.x, scale.y);
 		for (int r=rStart; r <= oc.y; r++) {
-			if (addSubImagePoint(r, oc.x, oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(r, oc.x, oc, subImgPts, subObjPts, true)) {
 				break;
             }
         }
 		for (int r=rLast; oc.y < r; r--) {
-			if (addSubImagePoint(r, oc.x, oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(r, oc.x, oc, subImgPts, subObjPts, true)) {
 				break;
             }
         }
 		for (int c=cStart; c <= oc.x; c++) {
-			if (addSubImagePoint(oc.y, c, oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(oc.y, c, oc, subImgPts, subObjPts, true)) {
 				break;
             }
         }
 		for (int c=cLast; oc.x < c; c--) {
-			if (addSubImagePoint(oc.y, c, oc, subImgPts, subObjPts, &subImgSet)) {
+			if (addSubImagePoint(oc.y, c, oc, subImgPts, subObjPts, true)) {
 				break;
             }
         }
@@ -859,11 +917,11 @@ typedef struct GridMatcher {
         LOGTRACE2("subImageEllipseFactory(%g,%g)", scale.x, scale.y);
         for (int r=0; r < rows; r++) {
             float dr = r-oc.y;
-            for (int c=0; c <= cols; c++) {
+            for (int c=0; c < cols; c++) {
                 float dc = c-oc.x;
                 float n = scale.x*scale.x*dr*dr*ocx2 + scale.y*scale.y*dc*dc*ocy2;
                 if (n <= nMax) {
-                    addSubImagePoint(r, c, oc, subImgPts, subObjPts, &subImgSet);
+                    addSubImagePoint(r, c, oc, subImgPts, subObjPts, true);
                 }
             }
         }
@@ -1078,9 +1136,6 @@ typedef struct GridMatcher {
 	}
 
 	void createSubimages(CalibrateOp op, Point2f scale) {
-        if (op == CAL_BEST) { 
-            op = CAL_TILE3; // may change to best available
-        }
         switch (op) {
         default:
         case CAL_NONE:
@@ -1141,6 +1196,18 @@ typedef struct GridMatcher {
         }
 	}
 
+    /**
+     * Calibrate camera with the sub-images created for the given option
+     * @return rms reprojection error
+     */
+    double calibrateSubimages(CalibrateOp op, Point2f scale, Mat &cameraMatrix, Mat &distCoeffs,
+                              vector<Mat> &rvecs, vector<Mat> &tvecs)
+    {
+        calibrationPts = imagePts;
+        createSubimages(op, scale);
+        return calibrateCamera(vObjectPts, vImagePts, imgSize, cameraMatrix, distCoeffs, rvecs, tvecs);
+    }
+
     string calibrateImage(json_t *pStageModel, Mat &cameraMatrix, Mat &distCoeffs,
                           Mat &image, string opStr, Scalar color, Point2f scale)
     {
@@ -1162,25 +1229,29 @@ typedef struct GridMatcher {
         double rmserror = nan("");
         vector<Mat> rvecs;
         vector<Mat> tvecs;
+        string bestOp;
+        int tried = 0;
 
 		try {
 			if (op == CAL_NONE) {
 				initCameraMatrix(cameraMatrix, distCoeffs, rvecs, tvecs, image);
-				subImgSet = imgSet;
+				subImgUsed.assign(size(), true);
 			} else if (op == CAL_PERSPECTIVE) {
 				initCameraMatrix(cameraMatrix, distCoeffs, rvecs, tvecs, image);
 				vector<Point2f> gridImgPts = create_gridImgPts(imagePts, errMsg);
-				perspective = calcPerspective(gridImgPts, &subImgSet);
+				perspective = calcPerspective(gridImgPts, true);
 				perspectiveTransform(imagePts, calibrationPts, perspective);
 				subImageTileFactory(1);
 				rmserror = calibrateCamera(vObjectPts, vImagePts, imgSize, 
 					cameraMatrix, distCoeffs, rvecs, tvecs);
+			} else if (op == CAL_BEST) {
+				rmserror = calibrateBest(*this, scale, cameraMatrix, distCoeffs, rvecs, tvecs, 
+					bestOp, tried);
+				if (bestOp.empty()) {
+					errMsg = "calibrateImage(FAILED) no calibrate option succeeded";
+				}
 			} else {
-				calibrationPts = imagePts;
-				createSubimages(op, scale);
-				rmserror = calibrateCamera(vObjectPts, vImagePts, imgSize,
-										   cameraMatrix, distCoeffs, rvecs, tvecs);
-					
+				rmserror = calibrateSubimages(op, scale, cameraMatrix, distCoeffs, rvecs, tvecs);
 			}
 		} catch (cv::Exception ex) {
 			errMsg = "calibrateImage(FAILED) ";
@@ -1217,8 +1288,7 @@ typedef struct GridMatcher {
                 json_object_set(pRect, "objX", json_real(objSep.x*(objectPts[i].x)));
                 json_object_set(pRect, "objY", json_real(objSep.y*(objectPts[i].y)));
                 json_array_append(pRects, pRect);
-                set<Point2f,ComparePoint2f>::iterator it = subImgSet.find(calibrationPts[i]);
-                if (it == subImgSet.end()) { // color marks points not used in calibration
+                if (!subImgUsed[i]) { // color marks points not used in calibration
                     json_t *pBGR = json_array();
                     json_object_set(pRect,"color", pBGR);
                     json_array_append(pBGR, json_integer(color[0]));
@@ -1226,18 +1296,23 @@ typedef struct GridMatcher {
                     json_array_append(pBGR, json_integer(color[2]));
                 }
             }
-            for (set<Point2f,ComparePoint2f>::iterator it=subImgSet.begin();
-                    it != subImgSet.end(); it++) {
-                LOGTRACE2("subImgSet:[%g,%g]", it->x, it->y);
+            for (int i=0; i < size(); i++) {
+                if (subImgUsed[i]) {
+                    LOGTRACE2("subImgUsed:[%g,%g]", calibrationPts[i].x, calibrationPts[i].y);
+                }
             }
         }
 
         json_object_set(pCalibrate, "perspective", json_matrix(perspective));
         json_object_set(pCalibrate, "op", json_string(opStr.c_str()));
+        if (op == CAL_BEST) {
+            json_object_set(pCalibrate, "best", json_string(bestOp.c_str()));
+            json_object_set(pCalibrate, "tried", json_integer(tried));
+        }
         json_object_set(pCalibrate, "cameraMatrix", json_matrix(cameraMatrix));
         json_object_set(pCalibrate, "distCoeffs", json_matrix(distCoeffs));
         json_object_set(pCalibrate, "candidates", json_integer(size()));
-        json_object_set(pCalibrate, "matched", json_integer(subImgSet.size()));
+        json_object_set(pCalibrate, "matched", json_integer(count(subImgUsed.begin(), subImgUsed.end(), true)));
         json_object_set(pCalibrate, "images", json_real(vImagePts.size()));
         json_object_set(pCalibrate, "rmserror", 
 			isnan(rmserror) ? json_string("NaN") : json_real(rmserror));
@@ -1270,26 +1345,171 @@ typedef struct GridMatcher {
     }
 } GridMatcher;
 
-typedef map<Point2f,Point2f,ComparePoint2f> PointMap;
+typedef struct CalibrateCandidate {
+    string opStr;
+    CalibrateOp op;
+    GridMatcher gm;
+    Mat cameraMatrix;
+    Mat distCoeffs;
+    vector<Mat> rvecs;
+    vector<Mat> tvecs;
+    double rmserror;
+    bool evaluated;
+
+    CalibrateCandidate(const GridMatcher &gm, const char *opStr, const Mat &cameraMatrix, const Mat &distCoeffs)
+        : opStr(opStr), op(CAL_NONE), gm(gm), rmserror(nan("")), evaluated(false)
+    {
+        string errMsg;
+        op = this->gm.parseCalibrateOp(opStr, errMsg);
+        cameraMatrix.copyTo(this->cameraMatrix);
+        distCoeffs.copyTo(this->distCoeffs);
+    }
+} CalibrateCandidate;
+
+/**
+ * Evaluate candidates, skipping those less preferred than a candidate that met rmsTarget.
+ * Every candidate more preferred than the first to meet rmsTarget is evaluated, so the
+ * outcome does not depend on scheduling.
+ */
+class CalibrateCandidateBody : public ParallelLoopBody {
+    private:
+        vector<CalibrateCandidate> &candidates;
+        Point2f scale;
+        Mutex &metMutex;
+        int &metIndex; // most preferred candidate known to meet rmsTarget
 
-void initializePointMaps(json_t *pRects, vector<Point2f> &pointsXY, vector<Point2f> &pointsYX) {
+    public:
+        CalibrateCandidateBody(vector<CalibrateCandidate> &candidates, Point2f scale, Mutex &metMutex, int &metIndex)
+            : candidates(candidates), scale(scale), metMutex(metMutex), metIndex(metIndex) {}
+
+        void operator()(const Range &range) const {
+            for (int i=range.start; i < range.end; i++) {
+                {
+                    AutoLock lock(metMutex);
+                    if (metIndex < i) {
+                        continue; // a more preferred candidate met rmsTarget
+                    }
+                }
+                CalibrateCandidate &c = candidates[i];
+                try {
+                    c.rmserror = c.gm.calibrateSubimages(c.op, scale, c.cameraMatrix, c.distCoeffs,
+                                                         c.rvecs, c.tvecs);
+                    c.evaluated = true;
+                    LOGDEBUG2("calibrateBest() %s rmserror:%g", c.opStr.c_str(), c.rmserror);
+                    if (c.rmserror <= c.gm.rmsTarget) {
+                        AutoLock lock(metMutex);
+                        metIndex = min(metIndex, i);
+                    }
+                } catch (cv::Exception &ex) {
+                    LOGDEBUG2("calibrateBest() %s FAILED %s", c.opStr.c_str(), ex.msg.c_str());
+                }
+            }
+        }
+};
+
+/**
+ * Calibration options searched by calibrate:"best", in order of preference
+ */
+static const char *bestCalibrateOps[] = {
+    "tile3", "tile2", "tile4", "tile5", "tile1", "celtic", "cross", "xyorigin", "xyaxes",
+    "I", "corners", "diamond", "quad0", "quad1", "quad2", "quad3", "ellipse"
+};
+
+/**
+ * Calibrate each option in parallel and keep the one with the least rms reprojection error.
+ * If any option meets gm.rmsTarget, the most preferred such option wins and less preferred
+ * options are not evaluated.
+ */
+static double calibrateBest(GridMatcher &gm, Point2f scale, Mat &cameraMatrix, Mat &distCoeffs,
+                            vector<Mat> &rvecs, vector<Mat> &tvecs, string &bestOp, int &tried)
+{
+    int nOps = sizeof(bestCalibrateOps)/sizeof(bestCalibrateOps[0]);
+    vector<CalibrateCandidate> candidates;
+    for (int i=0; i < nOps; i++) {
+        candidates.push_back(CalibrateCandidate(gm, bestCalibrateOps[i], cameraMatrix, distCoeffs));
+    }
+
+    Mutex metMutex;
+    int metIndex = nOps;
+    parallel_for_(Range(0, nOps), CalibrateCandidateBody(candidates, scale, metMutex, metIndex), nOps);
+
+    // candidates after metIndex may or may not have been evaluated, so they are ignored
+    int best = -1;
+    tried = 0;
+    for (int i=0; i < nOps && i <= metIndex; i++) {
+        CalibrateCandidate &c = candidates[i];
+        if (!c.evaluated) {
+            continue;
+        }
+        tried++;
+        if (best < 0 || c.rmserror < candidates[best].rmserror) {
+            best = i;
+        }
+    }
+    if (metIndex < nOps) {
+        best = metIndex;
+    }
+    if (best < 0) {
+        bestOp = "";
+        return nan("");
+    }
+
+    CalibrateCandidate &c = candidates[best];
+    bestOp = c.opStr;
+    double rmsTarget = gm.rmsTarget;
+    gm = c.gm;
+    gm.rmsTarget = rmsTarget;
+    cameraMatrix = c.cameraMatrix;
+    distCoeffs = c.distCoeffs;
+    rvecs = c.rvecs;
+    tvecs = c.tvecs;
+    LOGTRACE3("calibrateBest() best:%s rmserror:%g tried:%d", bestOp.c_str(), c.rmserror, tried);
+    return c.rmserror;
+}
+
+/**
+ * Hash the rect centers with cells sized to the grid pitch estimated from their density,
+ * rejecting duplicates, and link each point to its nearest neighbour in +x and +y.
+ */
+static PointHash initializePointHash(json_t *pRects, double tolerance, vector<int> &nextX, vector<int> &nextY) {
+    vector<Point2f> pts;
     json_t *pValue;
     int index;
     json_array_foreach(pRects, index, pValue) {
         json_t *pX = json_object_get(pValue, "x");
         json_t *pY = json_object_get(pValue, "y");
         if (json_is_number(pX) && json_is_number(pY)) {
-            double x = json_real_value(pX);
-            double y = json_real_value(pY);
-            const Point2f key(x,y);
-            pointsXY.push_back(key);
-            pointsYX.push_back(key);
+            pts.push_back(Point2f(json_real_value(pX), json_real_value(pY)));
         }
     }
-    const ComparePoint2f cmpXY(COMPARE_XY);
-    sort(pointsXY, cmpXY);
-    const ComparePoint2f cmpYX(COMPARE_YX);
-    sort(pointsYX, cmpYX);
+    Rect_<float> bounds(0,0,0,0);
+    if (pts.size()) {
+        Point2f ptMin = pts[0];
+        Point2f ptMax = pts[0];
+        for (size_t i=1; i < pts.size(); i++) {
+            ptMin.x = min(ptMin.x, pts[i].x);
+            ptMin.y = min(ptMin.y, pts[i].y);
+            ptMax.x = max(ptMax.x, pts[i].x);
+            ptMax.y = max(ptMax.y, pts[i].y);
+        }
+        bounds = Rect_<float>(ptMin, ptMax);
+    }
+    float pitch = sqrt(max(bounds.width,1.0f)*max(bounds.height,1.0f)/max((size_t)1,pts.size()));
+    LOGTRACE2("initializePointHash() points:%d pitch:%g", (int) pts.size(), pitch);
+
+    PointHash points(bounds, pitch);
+    for (size_t i=0; i < pts.size(); i++) {
+        if (!points.insert(pts[i], tolerance*pitch)) {
+            LOGTRACE2("initializePointHash() reject duplicate (%g,%g)", pts[i].x, pts[i].y);
+        }
+    }
+    nextX.resize(points.size());
+    nextY.resize(points.size());
+    for (int i=0; i < points.size(); i++) {
+        nextX[i] = points.nearest(points.points[i], 2*pitch, Point2f(1,0));
+        nextY[i] = points.nearest(points.points[i], 2*pitch, Point2f(0,1));
+    }
+    return points;
 }
 
 bool Pipeline::apply_matchGrid(json_t *pStage, json_t *pStageModel, Model &model) {
@@ -1299,6 +1519,8 @@ bool Pipeline::apply_matchGrid(json_t *pStage, json_t *pStageModel, Model &model
 	Point2f scale = jo_Point2f(pStage, "scale", Point2f(1,1), model.argMap);
     Point2f objSep = jo_Point2f(pStage, "sep", Point2f(5,5), model.argMap);
     double tolerance = jo_double(pStage, "tolerance", 0.35, model.argMap);
+    double rmsTarget = jo_double(pStage, "rmsTarget", 0, model.argMap);
+    string savePath = jo_string(pStage, "save", "", model.argMap);
     Size imgSize(model.image.cols, model.image.rows);
     Point2f imgCenter(model.image.cols/2.0, model.image.rows/2.0);
     json_t *pRectsModel = json_object_get(model.getJson(false), rectsModelName.c_str());
@@ -1329,18 +1551,18 @@ bool Pipeline::apply_matchGrid(json_t *pStage, json_t *pStageModel, Model &model
     int dyCount1 = 0;
     int dyCount2 = 0;
     Point2f dmedian(FLT_MAX,FLT_MAX);
-    const ComparePoint2f cmpYX(COMPARE_YX);
-    vector<Point2f> pointsXY;
-    vector<Point2f> pointsYX;
+    vector<int> nextX;
+    vector<int> nextY;
     Mat cameraMatrix;
     Mat distCoeffs;
 	GridMatcher gm(imgSize, objSep, tolerance);
+    gm.rmsTarget = rmsTarget;
 
+    PointHash points = initializePointHash(pRects, tolerance, nextX, nextY);
     if (errMsg.empty()) {
-        initializePointMaps(pRects, pointsXY, pointsYX);
-        errMsg = gm.identifyColumns(pStageModel, pointsYX, dmedian.x, dxTot1, dxTot2,
+        errMsg = gm.identifyColumns(pStageModel, points, nextX, dmedian.x, dxTot1, dxTot2,
                                  dxCount1, dxCount2);
-        string errMsg2 = gm.identifyRows(pStageModel, pointsXY, dmedian.y, dyTot1, dyTot2,
+        string errMsg2 = gm.identifyRows(pStageModel, points, nextY, dmedian.y, dyTot1, dyTot2,
                                       dyCount1, dyCount2);
 
         if (errMsg.empty()) {
@@ -1352,15 +1574,41 @@ bool Pipeline::apply_matchGrid(json_t *pStage, json_t *pStageModel, Model &model
     }
 
     if (errMsg.empty()) {
-        gm.matchPoints(dmedian, pointsYX, pointsXY);
+        gm.matchPoints(dmedian, points, nextX, nextY);
         errMsg = gm.calibrateImage(pStageModel, cameraMatrix, distCoeffs, model.image, opStr, color, scale);
     }
 
+    if (errMsg.empty() && !savePath.empty()) {
+        errMsg = CalibrationStore::save(savePath.c_str(), json_object_get(pStageModel, "calibrate"));
+        if (errMsg.empty()) {
+            json_object_set(pStageModel, "saved", json_string(savePath.c_str()));
+        }
+    }
+
     return stageOK("apply_matchGrid(%s) %s", errMsg.c_str(), pStage, pStageModel);
 }
 
 bool Pipeline::apply_undistort(const char *pName, json_t *pStage, json_t *pStageModel, Model &model) {
     string errMsg;
+    string calibrationPath = jo_string(pStage, "calibration", "", model.argMap);
+
+    if (!calibrationPath.empty()) {
+        Ptr<Calibration> pCalibration = CalibrationStore::load(calibrationPath.c_str(), errMsg);
+        if (errMsg.empty()) {
+            Mat map1;
+            Mat map2;
+            if (pCalibration->undistortMaps(model.image.size(), map1, map2)) {
+                Mat dst;
+                remap(model.image, dst, map1, map2, INTER_LINEAR, BORDER_CONSTANT);
+                model.image = dst;
+            } else {
+                LOGTRACE("apply_undistort() no cameraMatrix or distCoeffs => no transformation");
+            }
+            json_object_set(pStageModel, "calibration", json_string(calibrationPath.c_str()));
+        }
+        return stageOK("apply_undistort(%s) %s", errMsg.c_str(), pStage, pStageModel);
+    }
+
     string modelName = jo_string(pStage, "model", pName, model.argMap);
     vector<double> cm;
     vector<double> pm;
@@ -0,0 +1,327 @@
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/features2d/features2d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define COMPONENT_STRIP_ROWS 64 /* rows labelled by one task */
+
+typedef enum {COMPONENTS_RECTS, COMPONENTS_KEYPOINTS} ComponentsDetect;
+
+typedef struct ComponentStats {
+    int area;
+    double sx, sy, sxx, syy, sxy;
+    int left, top, right, bottom;
+    vector<Point> runEnds; // superset of the convex hull vertices
+
+    ComponentStats(): area(0), sx(0), sy(0), sxx(0), syy(0), sxy(0),
+        left(INT_MAX), top(INT_MAX), right(-1), bottom(-1) {}
+
+    void merge(const ComponentStats &that) {
+        area += that.area;
+        sx += that.sx;
+        sy += that.sy;
+        sxx += that.sxx;
+        syy += that.syy;
+        sxy += that.sxy;
+        left = min(left, that.left);
+        top = min(top, that.top);
+        right = max(right, that.right);
+        bottom = max(bottom, that.bottom);
+        runEnds.insert(runEnds.end(), that.runEnds.begin(), that.runEnds.end());
+    }
+} ComponentStats;
+
+/**
+ * Union-find on linear pixel indexes. Background pixels have parent -1.
+ * Roots are always the smallest index of their set, i.e., the first pixel of
+ * a component in raster order, so labels do not depend on scheduling.
+ */
+static inline int findRoot(int *parent, int i) {
+    while (parent[i] != i) {
+        i = parent[i];
+    }
+    return i;
+}
+
+static inline int findCompress(int *parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static inline void unite(int *parent, int a, int b) {
+    a = findCompress(parent, a);
+    b = findCompress(parent, b);
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+/**
+ * Link each foreground pixel to its left and upper neighbours within a strip of rows
+ */
+class LabelStripBody : public ParallelLoopBody {
+    private:
+        const Mat &image;
+        const BitImage &bits;
+        int rows;
+        int cols;
+        int *parent;
+        bool eight;
+
+    public:
+        /**
+         * @param image 8-bit binary image, used if bits is empty
+         * @param bits packed binary image
+         */
+        LabelStripBody(const Mat &image, const BitImage &bits, int *parent, bool eight)
+            : image(image), bits(bits), rows(image.rows), cols(image.cols), parent(parent), eight(eight) {
+            if (!bits.empty()) {
+                rows = bits.rows;
+                cols = bits.cols;
+            }
+        }
+
+        void operator()(const Range &range) const {
+            for (int s = range.start; s < range.end; s++) {
+                int rowStart = s * COMPONENT_STRIP_ROWS;
+                int rowEnd = min(rows, rowStart + COMPONENT_STRIP_ROWS);
+                for (int r = rowStart; r < rowEnd; r++) {
+                    int *pParent = parent + r*cols;
+                    if (bits.empty()) {
+                        const uchar *pRow = image.ptr<uchar>(r);
+                        for (int c = 0; c < cols; c++) {
+                            pParent[c] = pRow[c] ? r*cols + c : -1;
+                        }
+                    } else {
+                        const uint64 *pWords = bits.ptr(r);
+                        for (int c = 0; c < cols; c++) {
+                            pParent[c] = ((pWords[c >> 6] >> (c & 63)) & 1) ? r*cols + c : -1;
+                        }
+                    }
+                    for (int c = 0; c < cols; c++) {
+                        if (pParent[c] < 0) {
+                            continue;
+                        }
+                        int i = r*cols + c;
+                        if (c > 0 && pParent[c-1] >= 0) {
+                            unite(parent, i, i-1);
+                        }
+                        if (r > rowStart) {
+                            linkUp(i, r, c);
+                        }
+                    }
+                }
+            }
+        }
+
+        /** Link pixel i at (r,c) to its foreground neighbours in row r-1 */
+        void linkUp(int i, int r, int c) const {
+            int *pUp = parent + (r-1)*cols;
+            if (pUp[c] >= 0) {
+                unite(parent, i, i-cols);
+            }
+            if (eight) {
+                if (c > 0 && pUp[c-1] >= 0) {
+                    unite(parent, i, i-cols-1);
+                }
+                if (c+1 < cols && pUp[c+1] >= 0) {
+                    unite(parent, i, i-cols+1);
+                }
+            }
+        }
+};
+
+/**
+ * Resolve final labels and accumulate moments of each component within a strip of rows
+ */
+class StatsStripBody : public ParallelLoopBody {
+    private:
+        int rows;
+        int cols;
+        const int *parent;
+        int *labels;
+        vector<map<int, ComponentStats> > &stripStats;
+
+    public:
+        StatsStripBody(int rows, int cols, const int *parent, int *labels,
+                       vector<map<int, ComponentStats> > &stripStats)
+            : rows(rows), cols(cols), parent(parent), labels(labels), stripStats(stripStats) {}
+
+        void operator()(const Range &range) const {
+            for (int s = range.start; s < range.end; s++) {
+                map<int, ComponentStats> &stats = stripStats[s];
+                int rowStart = s * COMPONENT_STRIP_ROWS;
+                int rowEnd = min(rows, rowStart + COMPONENT_STRIP_ROWS);
+                for (int r = rowStart; r < rowEnd; r++) {
+                    int *pLabel = labels + r*cols;
+                    const int *pParent = parent + r*cols;
+                    for (int c = 0; c < cols; c++) {
+                        pLabel[c] = pParent[c] < 0 ? -1 : findRoot((int *) parent, r*cols + c);
+                    }
+                    ComponentStats *pStats = NULL;
+                    int lastLabel = -1;
+                    for (int c = 0; c < cols; c++) {
+                        int label = pLabel[c];
+                        if (label < 0) {
+                            lastLabel = -1;
+                            continue;
+                        }
+                        if (label != lastLabel) {
+                            pStats = &stats[label];
+                            pStats->runEnds.push_back(Point(c, r));
+                            lastLabel = label;
+                        }
+                        if (c+1 == cols || pLabel[c+1] != label) {
+                            pStats->runEnds.push_back(Point(c, r));
+                        }
+                        pStats->area++;
+                        pStats->sx += c;
+                        pStats->sy += r;
+                        pStats->sxx += (double) c*c;
+                        pStats->syy += (double) r*r;
+                        pStats->sxy += (double) c*r;
+                        pStats->left = min(pStats->left, c);
+                        pStats->right = max(pStats->right, c);
+                        pStats->top = min(pStats->top, r);
+                        pStats->bottom = max(pStats->bottom, r);
+                    }
+                }
+            }
+        }
+};
+
+bool Pipeline::apply_components(json_t *pStage, json_t *pStageModel, Model &model) {
+    validateImage(model.image);
+    int connectivity = jo_int(pStage, "connectivity", 8, model.argMap);
+    int minArea = jo_int(pStage, "minArea", 1, model.argMap);
+    int maxArea = jo_int(pStage, "maxArea", INT_MAX, model.argMap);
+    string detectStr = jo_string(pStage, "detect", "rects", model.argMap);
+    const char *errMsg = NULL;
+
+    int detect = -1;
+    if (detectStr.compare("rects") == 0) {
+        detect = COMPONENTS_RECTS;
+    } else if (detectStr.compare("keypoints") == 0) {
+        detect = COMPONENTS_KEYPOINTS;
+    }
+
+    if (detect < 0) {
+        errMsg = "expected detect: rects, keypoints";
+    } else if (connectivity != 4 && connectivity != 8) {
+        errMsg = "expected connectivity: 4 or 8";
+    } else if (minArea < 0 || maxArea < minArea) {
+        errMsg = "expected 0<=minArea and minArea<=maxArea";
+    } else if ((double) model.image.rows * model.image.cols >= INT_MAX) {
+        errMsg = "image is too large";
+    }
+
+    if (!errMsg) {
+        Mat image;
+        if (!model.bits.empty()) {
+            LOGTRACE("apply_components() packed");
+        } else if (model.image.channels() == 1 && model.image.depth() == CV_8U) {
+            image = model.image;
+        } else {
+            Mat matGray;
+            if (model.image.channels() == 1) {
+                matGray = model.image;
+            } else {
+                cvtColor(model.image, matGray, CV_BGR2GRAY);
+            }
+            image = matGray != 0;
+        }
+
+        int rows = model.bits.empty() ? image.rows : model.bits.rows;
+        int cols = model.bits.empty() ? image.cols : model.bits.cols;
+        int nStrips = (rows + COMPONENT_STRIP_ROWS - 1) / COMPONENT_STRIP_ROWS;
+        vector<int> parent(rows*cols);
+        vector<int> labels(rows*cols);
+
+        LabelStripBody labelBody(image, model.bits, &parent[0], connectivity == 8);
+        parallel_for_(Range(0, nStrips), labelBody);
+
+        // stitch strips together along their first row
+        for (int s = 1; s < nStrips; s++) {
+            int r = s * COMPONENT_STRIP_ROWS;
+            for (int c = 0; c < cols; c++) {
+                if (parent[r*cols + c] >= 0) {
+                    labelBody.linkUp(r*cols + c, r, c);
+                }
+            }
+        }
+
+        vector<map<int, ComponentStats> > stripStats(nStrips);
+        StatsStripBody statsBody(rows, cols, &parent[0], &labels[0], stripStats);
+        parallel_for_(Range(0, nStrips), statsBody);
+
+        map<int, ComponentStats> stats;
+        for (int s = 0; s < nStrips; s++) {
+            for (map<int, ComponentStats>::iterator it = stripStats[s].begin(); it != stripStats[s].end(); it++) {
+                stats[it->first].merge(it->second);
+            }
+            stripStats[s].clear();
+        }
+        LOGTRACE1("apply_components() labelled %d components", (int) stats.size());
+
+        json_t *pItems = json_array();
+        json_object_set(pStageModel, detect == COMPONENTS_RECTS ? "rects" : "keypoints", pItems);
+        for (map<int, ComponentStats>::iterator it = stats.begin(); it != stats.end(); it++) {
+            ComponentStats &cs = it->second;
+            if (cs.area < minArea || maxArea < cs.area) {
+                continue;
+            }
+            double cx = cs.sx / cs.area;
+            double cy = cs.sy / cs.area;
+            double mu20 = cs.sxx / cs.area - cx*cx;
+            double mu02 = cs.syy / cs.area - cy*cy;
+            double mu11 = cs.sxy / cs.area - cx*cy;
+            double degrees = 0.5 * atan2(2*mu11, mu20 - mu02) * 180./CV_PI;
+            if (degrees < 0) {
+                degrees += 180;
+            }
+
+            json_t *pItem = json_object();
+            if (detect == COMPONENTS_RECTS) {
+                RotatedRect rect = minAreaRect(cs.runEnds);
+                json_object_set(pItem, "x", json_real(rect.center.x));
+                json_object_set(pItem, "y", json_real(rect.center.y));
+                json_object_set(pItem, "width", json_real(rect.size.width));
+                json_object_set(pItem, "height", json_real(rect.size.height));
+                json_object_set(pItem, "angle", json_real(rect.angle));
+            } else {
+                json_object_set(pItem, "pt.x", json_real(cx));
+                json_object_set(pItem, "pt.y", json_real(cy));
+                json_object_set(pItem, "size", json_real(2*sqrt(cs.area/CV_PI)));
+                json_object_set(pItem, "angle", json_real(degrees));
+            }
+            json_object_set(pItem, "area", json_integer(cs.area));
+            json_object_set(pItem, "cx", json_real(cx));
+            json_object_set(pItem, "cy", json_real(cy));
+            json_object_set(pItem, "orientation", json_real(degrees));
+            json_t *pBounds = json_object();
+            json_object_set(pBounds, "x", json_integer(cs.left));
+            json_object_set(pBounds, "y", json_integer(cs.top));
+            json_object_set(pBounds, "width", json_integer(cs.right - cs.left + 1));
+            json_object_set(pBounds, "height", json_integer(cs.bottom - cs.top + 1));
+            json_object_set(pItem, "bounds", pBounds);
+            json_array_append(pItems, pItem);
+        }
+    }
+
+    return stageOK("apply_components(%s) %s", errMsg, pStage, pStageModel);
+}
@@ -102,11 +102,8 @@ bool Pipeline::apply_matchTemplate(json_t *pStage, json_t *pStageModel, Model &m
   if (tmpltPath.empty()) {
     errMsg = "Expected template path for imread";
   } else {
-    if (model.image.channels() == 1) {
-      tmplt = imread(tmpltPath.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-    } else {
-      tmplt = imread(tmpltPath.c_str(), CV_LOAD_IMAGE_COLOR);
-    }
+    string errStr;
+    tmplt = ImageStore::load(tmpltPath.c_str(), errStr, model.image.channels() == 1);
     if (tmplt.data) {
       LOGTRACE2("apply_matchTemplate(%s) %s", tmpltPath.c_str(), matInfo(tmplt).c_str());
       if (model.image.rows<tmplt.rows || model.image.cols<tmplt.cols) {
@@ -315,11 +312,11 @@ bool Pipeline::apply_dft(json_t *pStage, json_t *pStageModel, Model &model) {
     switch (model.image.channels()) {
       case 4:
 	LOGTRACE("apply_dft(): converting 4 channel image assuming CV_BGRA2GRAY");
-	cvtColor(model.image, model.image, CV_BGRA2GRAY, 1);
+	model.image = model.gray(CV_BGRA2GRAY);
 	break;
       case 3:
 	LOGTRACE("apply_dft(): converting 3 channel image assuming CV_BGR2GRAY");
-	cvtColor(model.image, model.image, CV_BGR2GRAY, 1);
+	model.image = model.gray(CV_BGR2GRAY);
 	break;
     }
     if (model.image.type() != CV_32F) {
@@ -0,0 +1,323 @@
+#include <string.h>
+#include <math.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/features2d/features2d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define FIT_LEAST_SQUARES 0
+#define FIT_RANSAC 1
+
+typedef struct CircleFit {
+    double x;
+    double y;
+    double radius;
+    double rms;     // rms radial residual of inliers
+    size_t inliers;
+    size_t points;
+} CircleFit;
+
+/**
+ * Algebraic (Kasa) least squares circle fit of the given points,
+ * solved in coordinates centered on the point mean for numerical stability.
+ */
+static bool fitCircleLS(const vector<Point> &pts, const vector<int> &ids, CircleFit &fit) {
+    size_t n = ids.size();
+    if (n < 3) {
+        return false;
+    }
+    double mx = 0, my = 0;
+    for (size_t i = 0; i < n; i++) {
+        mx += pts[ids[i]].x;
+        my += pts[ids[i]].y;
+    }
+    mx /= n;
+    my /= n;
+
+    double Suu = 0, Svv = 0, Suv = 0, Suuu = 0, Svvv = 0, Suvv = 0, Svuu = 0;
+    for (size_t i = 0; i < n; i++) {
+        double u = pts[ids[i]].x - mx;
+        double v = pts[ids[i]].y - my;
+        double uu = u*u;
+        double vv = v*v;
+        Suu += uu;
+        Svv += vv;
+        Suv += u*v;
+        Suuu += uu*u;
+        Svvv += vv*v;
+        Suvv += u*vv;
+        Svuu += v*uu;
+    }
+    double det = Suu*Svv - Suv*Suv;
+    if (fabs(det) < 1e-12) {
+        return false; // collinear
+    }
+    double bu = (Suuu + Suvv)/2;
+    double bv = (Svvv + Svuu)/2;
+    double uc = (bu*Svv - bv*Suv)/det;
+    double vc = (bv*Suu - bu*Suv)/det;
+
+    fit.x = uc + mx;
+    fit.y = vc + my;
+    fit.radius = sqrt(uc*uc + vc*vc + (Suu + Svv)/n);
+
+    double sse = 0;
+    for (size_t i = 0; i < n; i++) {
+        double dx = pts[ids[i]].x - fit.x;
+        double dy = pts[ids[i]].y - fit.y;
+        double e = sqrt(dx*dx + dy*dy) - fit.radius;
+        sse += e*e;
+    }
+    fit.rms = sqrt(sse/n);
+    fit.inliers = n;
+    fit.points = pts.size();
+    return true;
+}
+
+/**
+ * Circle through three points
+ */
+static bool circle3(const Point &a, const Point &b, const Point &c, double &x, double &y, double &r) {
+    double bx = b.x - a.x;
+    double by = b.y - a.y;
+    double cx = c.x - a.x;
+    double cy = c.y - a.y;
+    double d = 2*(bx*cy - by*cx);
+    if (fabs(d) < 1e-9) {
+        return false;
+    }
+    double b2 = bx*bx + by*by;
+    double c2 = cx*cx + cy*cy;
+    double ux = (cy*b2 - by*c2)/d;
+    double uy = (bx*c2 - cx*b2)/d;
+    x = ux + a.x;
+    y = uy + a.y;
+    r = sqrt(ux*ux + uy*uy);
+    return true;
+}
+
+/**
+ * RANSAC on circles through three points followed by a least squares fit of the inliers
+ */
+static bool fitCircleRANSAC(const vector<Point> &pts, double threshold, int maxIterations,
+                            double minRadius, double maxRadius, RNG &rng, CircleFit &fit) {
+    int n = (int) pts.size();
+    if (n < 3) {
+        return false;
+    }
+    int bestInliers = 0;
+    double bx = 0, by = 0, br = 0;
+    for (int iter = 0; iter < maxIterations; iter++) {
+        int i0 = rng.uniform(0, n);
+        int i1 = rng.uniform(0, n);
+        int i2 = rng.uniform(0, n);
+        if (i0 == i1 || i1 == i2 || i0 == i2) {
+            continue;
+        }
+        double x, y, r;
+        if (!circle3(pts[i0], pts[i1], pts[i2], x, y, r) || r < minRadius || maxRadius < r) {
+            continue;
+        }
+        int inliers = 0;
+        for (int i = 0; i < n; i++) {
+            double dx = pts[i].x - x;
+            double dy = pts[i].y - y;
+            if (fabs(sqrt(dx*dx + dy*dy) - r) < threshold) {
+                inliers++;
+            }
+        }
+        if (inliers > bestInliers) {
+            bestInliers = inliers;
+            bx = x;
+            by = y;
+            br = r;
+            if (inliers == n) {
+                break;
+            }
+        }
+    }
+    if (bestInliers < 3) {
+        return false;
+    }
+
+    vector<int> ids;
+    ids.reserve(bestInliers);
+    for (int i = 0; i < n; i++) {
+        double dx = pts[i].x - bx;
+        double dy = pts[i].y - by;
+        if (fabs(sqrt(dx*dx + dy*dy) - br) < threshold) {
+            ids.push_back(i);
+        }
+    }
+    if (!fitCircleLS(pts, ids, fit)) {
+        return false;
+    }
+    fit.points = n;
+    return true;
+}
+
+/**
+ * Outline of each MSER region
+ */
+static void mserContours(Mat &image, int delta, int minArea, int maxArea,
+                         vector<vector<Point> > &contours) {
+    MSER mser(delta, minArea, maxArea);
+    vector<vector<Point> > regions;
+    mser(image, regions, Mat());
+    LOGTRACE1("fitCircles() MSER matched %d regions", (int) regions.size());
+    for (size_t r = 0; r < regions.size(); r++) {
+        Rect bounds = boundingRect(regions[r]);
+        Mat mask = Mat::zeros(bounds.height+2, bounds.width+2, CV_8UC1);
+        for (size_t i = 0; i < regions[r].size(); i++) {
+            mask.at<uchar>(regions[r][i].y - bounds.y + 1, regions[r][i].x - bounds.x + 1) = 255;
+        }
+        vector<vector<Point> > outlines;
+        findContours(mask, outlines, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE,
+                     Point(bounds.x-1, bounds.y-1));
+        for (size_t i = 0; i < outlines.size(); i++) {
+            contours.push_back(outlines[i]);
+        }
+    }
+}
+
+bool Pipeline::apply_fitCircles(json_t *pStage, json_t *pStageModel, Model &model) {
+    validateImage(model.image);
+    double diamMin = jo_double(pStage, "diamMin", 0, model.argMap);
+    double diamMax = jo_double(pStage, "diamMax", 0, model.argMap);
+    string source = jo_string(pStage, "source", "contours", model.argMap);
+    string fitStr = jo_string(pStage, "fit", "leastSquares", model.argMap);
+    double maxError = jo_double(pStage, "maxError", 1.5, model.argMap);
+    double threshold = jo_double(pStage, "threshold", 1.0, model.argMap);
+    double minInliers = jo_double(pStage, "minInliers", 0.5, model.argMap);
+    int maxIterations = jo_int(pStage, "maxIterations", 200, model.argMap);
+    double minDist = jo_double(pStage, "minDist", diamMin/2, model.argMap);
+    int delta = jo_int(pStage, "delta", 5, model.argMap);
+    int minArea = jo_int(pStage, "minArea", 60, model.argMap);
+    int maxArea = jo_int(pStage, "maxArea", 14400, model.argMap);
+    int showCircles = jo_int(pStage, "show", 0, model.argMap);
+    const char *errMsg = NULL;
+
+    int fit = -1;
+    if (fitStr.compare("leastSquares") == 0) {
+        fit = FIT_LEAST_SQUARES;
+    } else if (fitStr.compare("RANSAC") == 0) {
+        fit = FIT_RANSAC;
+    }
+
+    if (diamMin <= 0 || diamMax <= 0 || diamMin > diamMax) {
+        errMsg = "expected: 0 < diamMin < diamMax ";
+    } else if (fit < 0) {
+        errMsg = "expected fit: leastSquares, RANSAC ";
+    } else if (source.compare("contours") != 0 && source.compare("MSER") != 0) {
+        errMsg = "expected source: contours, MSER ";
+    } else if (maxError <= 0 || threshold <= 0) {
+        errMsg = "expected: 0 < maxError and 0 < threshold ";
+    } else if (minInliers < 0 || 1 < minInliers) {
+        errMsg = "expected: 0 <= minInliers <= 1 ";
+    } else if (maxIterations <= 0) {
+        errMsg = "expected: 0 < maxIterations ";
+    } else if (minArea < 0 || maxArea <= minArea) {
+        errMsg = "expected 0<=minArea and minArea<maxArea";
+    }
+
+    if (!errMsg) {
+        Mat matGray;
+        if (model.image.channels() == 1) {
+            matGray = model.image;
+        } else {
+            cvtColor(model.image, matGray, CV_BGR2GRAY);
+        }
+
+        vector<vector<Point> > contours;
+        if (source.compare("MSER") == 0) {
+            mserContours(matGray, delta, minArea, maxArea, contours);
+        } else {
+            // edge or threshold image from a prior stage; findContours modifies its input
+            Mat matBinary = matGray > 0;
+            findContours(matBinary, contours, CV_RETR_LIST, CV_CHAIN_APPROX_NONE);
+        }
+        LOGTRACE1("apply_fitCircles() %d contours", (int) contours.size());
+
+        double minRadius = diamMin/2;
+        double maxRadius = diamMax/2;
+        double minPoints = 2*CV_PI*minRadius*0.5; // contours shorter than half the smallest circumference
+        RNG rng(0x5EED);
+        vector<CircleFit> fits;
+        for (size_t c = 0; c < contours.size(); c++) {
+            vector<Point> &pts = contours[c];
+            if (pts.size() < 5 || pts.size() < minPoints) {
+                continue;
+            }
+            Rect bounds = boundingRect(pts);
+            if (bounds.width < diamMin - 2*maxError || diamMax + 2*maxError < bounds.width ||
+                    bounds.height < diamMin - 2*maxError || diamMax + 2*maxError < bounds.height) {
+                continue;
+            }
+            CircleFit cf;
+            bool ok;
+            if (fit == FIT_RANSAC) {
+                ok = fitCircleRANSAC(pts, threshold, maxIterations, minRadius, maxRadius, rng, cf);
+            } else {
+                vector<int> ids(pts.size());
+                for (size_t i = 0; i < ids.size(); i++) {
+                    ids[i] = (int) i;
+                }
+                ok = fitCircleLS(pts, ids, cf);
+            }
+            if (!ok || cf.radius < minRadius || maxRadius < cf.radius || maxError < cf.rms ||
+                    cf.inliers < minInliers * cf.points) {
+                continue;
+            }
+
+            // inner and outer outlines of the same hole: keep the better supported fit
+            bool duplicate = false;
+            for (size_t i = 0; i < fits.size(); i++) {
+                double dx = fits[i].x - cf.x;
+                double dy = fits[i].y - cf.y;
+                if (dx*dx + dy*dy < minDist*minDist) {
+                    if (fits[i].inliers < cf.inliers) {
+                        fits[i] = cf;
+                    }
+                    duplicate = true;
+                    break;
+                }
+            }
+            if (!duplicate) {
+                fits.push_back(cf);
+            }
+        }
+
+        vector<Circle> circles;
+        for (size_t i = 0; i < fits.size(); i++) {
+            circles.push_back(Circle((float) fits[i].x, (float) fits[i].y, (float) fits[i].radius));
+        }
+        LOGTRACE1("apply_fitCircles() -> found %d circles", (int) circles.size());
+
+        json_t *circles_json = json_array();
+        json_object_set(pStageModel, "circles", circles_json);
+        for (size_t i = 0; i < circles.size(); i++) {
+            json_array_append(circles_json, circles[i].as_json_t());
+        }
+
+        if (showCircles) {
+            if (model.image.channels() == 1) {
+                cvtColor(model.image, model.image, CV_GRAY2BGR);
+            }
+            for (size_t i = 0; i < circles.size(); i++) {
+                Point center(cvRound(circles[i].x), cvRound(circles[i].y));
+                int radius = cvRound(circles[i].radius);
+                circle(model.image, center, 3, Scalar(0,255,0), -1, 8, 0);
+                circle(model.image, center, radius, Scalar(0,0,255), 3, 8, 0);
+            }
+        }
+    }
+
+    return stageOK("apply_fitCircles(%s) %s", errMsg, pStage, pStageModel);
+}
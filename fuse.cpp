@@ -0,0 +1,231 @@
+#include <string.h>
+#include <math.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define FUSE_BAND_ROWS 16 /* rows converted and mapped together while in cache */
+
+typedef enum {
+    FUSE_NONE,      // stage cannot be fused
+    FUSE_POINTWISE, // 8-bit output depends only on the pixel value
+    FUSE_RANGE      // 8-bit output depends on the pixel value and the range of values in the image
+} FuseKind;
+
+/**
+ * Return the cvtColor code of a stage converting the given image to 8-bit gray, or -1
+ */
+static int grayCode(json_t *pStage, const Mat &image, ArgMap &argMap) {
+    if (image.depth() != CV_8U || (image.channels() != 3 && image.channels() != 4)) {
+        return -1;
+    }
+    if (jo_int(pStage, "dstCn", 0, argMap) > 1) {
+        return -1;
+    }
+    string codeStr = jo_string(pStage, "code", "CV_BGR2GRAY", argMap);
+    if (codeStr.compare("CV_BGR2GRAY") == 0 || codeStr.compare("CV_BGRA2GRAY") == 0) {
+        return CV_BGR2GRAY;
+    } else if (codeStr.compare("CV_RGB2GRAY") == 0 || codeStr.compare("CV_RGBA2GRAY") == 0) {
+        return CV_RGB2GRAY;
+    }
+    return -1;
+}
+
+/**
+ * Classify a stage applied to an 8-bit single channel image
+ */
+static FuseKind fuseKind(const string &op, json_t *pStage, ArgMap &argMap) {
+    if (op.compare("threshold") == 0) {
+        string thresh = jo_string(pStage, "thresh", "OTSU", argMap);
+        if (thresh.compare("OTSU") == 0 || jo_bool(pStage, "packed", false, argMap)) {
+            return FUSE_NONE; // Otsu depends on the histogram
+        }
+        return FUSE_POINTWISE;
+    } else if (op.compare("convertTo") == 0) {
+        string rType = jo_string(pStage, "rType", "CV_8U", argMap);
+        string transform = jo_string(pStage, "transform", "", argMap);
+        if (rType.compare("CV_8U") != 0 || !transform.empty()) {
+            return FUSE_NONE;
+        }
+        return FUSE_POINTWISE;
+    } else if (op.compare("normalize") == 0) {
+        // NORM_L1 and NORM_L2 depend on pixel counts and image size
+        string normType = jo_string(pStage, "normType", "NORM_L2", argMap);
+        if (normType.compare("NORM_MINMAX") == 0 || normType.compare("NORM_INF") == 0) {
+            return FUSE_RANGE;
+        }
+    }
+    return FUSE_NONE;
+}
+
+/**
+ * Optional gray conversion followed by a lookup table, one band of rows at a time
+ */
+class FusedBody : public ParallelLoopBody {
+    private:
+        const Mat &src;
+        Mat &dst;
+        int code;
+        const Mat &lut;
+
+    public:
+        FusedBody(const Mat &src, Mat &dst, int code, const Mat &lut)
+            : src(src), dst(dst), code(code), lut(lut) {}
+
+        void operator()(const Range &range) const {
+            for (int band = range.start; band < range.end; band++) {
+                int r0 = band * FUSE_BAND_ROWS;
+                int r1 = min(src.rows, r0 + FUSE_BAND_ROWS);
+                Mat dstBand = dst.rowRange(r0, r1);
+                if (code >= 0) {
+                    cvtColor(src.rowRange(r0, r1), dstBand, code);
+                    if (!lut.empty()) {
+                        LUT(dstBand, lut, dstBand);
+                    }
+                } else {
+                    LUT(src.rowRange(r0, r1), lut, dstBand);
+                }
+            }
+        }
+};
+
+static void applyFused(const Mat &src, Mat &dst, int code, const Mat &lut) {
+    int bands = (src.rows + FUSE_BAND_ROWS - 1) / FUSE_BAND_ROWS;
+    FusedBody body(src, dst, code, lut);
+    parallel_for_(Range(0, bands), body);
+}
+
+/**
+ * Execute a run of consecutive per-pixel stages starting at index as a single pass
+ * over the working image. The run may begin with a gray cvtColor and may contain
+ * threshold, convertTo and range-based normalize stages on 8-bit images. A lookup
+ * table is built by applying the stages themselves to a probe image that holds
+ * every value that can occur, so results match stage-by-stage execution.
+ * A named stage ends the run so that its image can be saved.
+ * @param nStages end of the stages that may be executed
+ * @return number of stages executed, or 0 if the stage at index was not fused
+ */
+size_t Pipeline::processFused(size_t index, size_t nStages, Model &model) {
+    if (model.image.depth() != CV_8U) {
+        return 0;
+    }
+
+    int code = -1;
+    bool hasRange = false;
+    size_t end = index;
+    string lastName;
+    for (size_t i = index; i < nStages; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        string op = jo_string(pStage, "op", "", model.argMap);
+        if (i == index && op.compare("cvtColor") == 0) {
+            code = grayCode(pStage, model.image, model.argMap);
+            if (code < 0) {
+                break;
+            }
+        } else {
+            if (i == index && model.image.channels() != 1) {
+                break;
+            }
+            FuseKind kind = fuseKind(op, pStage, model.argMap);
+            if (kind == FUSE_NONE) {
+                break;
+            }
+            hasRange = hasRange || kind == FUSE_RANGE;
+        }
+        if (jo_bool(pStage, "gate", false, model.argMap)) {
+            break; // gate-sensitive stages are executed individually
+        }
+        end = i + 1;
+        lastName = jo_string(pStage, "name");
+        if (!lastName.empty()) {
+            break;
+        }
+    }
+    if (end - index < 2 || lastName.compare("input") == 0) {
+        return 0;
+    }
+
+    model.syncImage();
+    Mat gray;
+    Mat probe;
+    if (hasRange) {
+        // the probe must have the same range as the image, so it holds the values present
+        if (code >= 0) {
+            gray.create(model.image.size(), CV_8UC1);
+            applyFused(model.image, gray, code, Mat());
+        } else {
+            gray = model.image;
+        }
+        int histSize = 256;
+        float range[] = {0, 256};
+        const float *ranges[] = {range};
+        Mat hist;
+        calcHist(&gray, 1, 0, Mat(), hist, 1, &histSize, ranges);
+        for (int v = 0; v < 256; v++) {
+            if (hist.at<float>(v) > 0) {
+                probe.push_back((uchar) v);
+            }
+        }
+        probe = probe.reshape(1, 1);
+    } else {
+        probe.create(1, 256, CV_8UC1);
+        for (int v = 0; v < 256; v++) {
+            probe.at<uchar>(v) = (uchar) v;
+        }
+    }
+
+    Model probeModel(model.argMap);
+    probeModel.image = probe.clone();
+    for (size_t i = code >= 0 ? index+1 : index; i < end; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        string op = jo_string(pStage, "op", "", model.argMap);
+        json_t *pProbeModel = json_object();
+        const char *errMsg = dispatch("probe", op.c_str(), pStage, pProbeModel, probeModel);
+        json_decref(pProbeModel);
+        if (errMsg) {
+            LOGTRACE1("Pipeline::processFused() %s not fused", op.c_str());
+            return 0;
+        }
+    }
+    if (probeModel.image.type() != CV_8UC1 || probeModel.image.size() != probe.size()) {
+        return 0;
+    }
+    Mat lut = Mat::zeros(1, 256, CV_8UC1);
+    for (int i = 0; i < probe.cols; i++) {
+        lut.at<uchar>(probe.at<uchar>(i)) = probeModel.image.at<uchar>(i);
+    }
+
+    Mat result(model.image.size(), CV_8UC1);
+    if (hasRange) {
+        applyFused(gray, result, -1, lut);
+    } else {
+        applyFused(model.image, result, code, lut);
+    }
+    model.image = result;
+    model.imageChanged();
+
+    json_t *jmodel = model.getJson(false);
+    for (size_t i = index; i < end; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        string pName = jo_string(pStage, "name");
+        if (pName.empty()) {
+            char defaultName[100];
+            snprintf(defaultName, sizeof(defaultName), "s%d", (int)i+1);
+            pName = defaultName;
+        }
+        json_object_set(jmodel, pName.c_str(), json_object());
+    }
+    if (!lastName.empty()) {
+        model.imageMap[lastName.c_str()] = model.image.clone();
+    }
+    LOGDEBUG3("process() fused stages %d-%d %s", (int)index+1, (int)end, matInfo(model.image).c_str());
+
+    return end - index;
+}
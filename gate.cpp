@@ -0,0 +1,100 @@
+#include <string.h>
+#include <math.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+GateStageData::GateStageData(string stageName) : StageData(stageName) {
+    open = true;
+}
+
+GateStageData::~GateStageData() {
+    for (map<string, json_t *>::iterator it = stageModels.begin(); it != stageModels.end(); ++it) {
+        json_decref(it->second);
+    }
+}
+
+void GateStageData::save(const string &name, json_t *pStageModel, const Mat &image) {
+    map<string, json_t *>::iterator it = stageModels.find(name);
+    if (it != stageModels.end()) {
+        json_decref(it->second);
+    }
+    stageModels[name] = json_deep_copy(pStageModel);
+    if (image.data) {
+        stageImages[name] = image.clone();
+    } else {
+        stageImages.erase(name);
+    }
+}
+
+bool GateStageData::reuse(const string &name, json_t *pStageModel, Model &model) {
+    map<string, json_t *>::iterator it = stageModels.find(name);
+    if (it == stageModels.end()) {
+        return false;
+    }
+    json_t *pCopy = json_deep_copy(it->second);
+    json_object_update(pStageModel, pCopy);
+    json_decref(pCopy);
+    json_object_set(pStageModel, "reused", json_true());
+
+    map<string, Mat>::iterator itImage = stageImages.find(name);
+    if (itImage != stageImages.end()) {
+        // later stages may modify the working image in place
+        model.bits = BitImage();
+        model.image = itImage->second.clone();
+        model.imageChanged();
+    }
+    return true;
+}
+
+/**
+ * Compare a downscaled gray version of the working image with that of the last frame
+ * that passed the gate. If the mean absolute difference is below threshold, the gate
+ * is closed and gate-sensitive stages that follow reuse their results from that frame.
+ */
+bool Pipeline::apply_gate(const char *pName, json_t *pStage, json_t *pStageModel, Model &model) {
+    validateImage(model.image);
+    int downscale = jo_int(pStage, "downscale", 8, model.argMap);
+    double threshold = jo_double(pStage, "threshold", 2, model.argMap);
+    const char *errMsg = NULL;
+
+    if (downscale < 1) {
+        errMsg = "Expected downscale >= 1";
+    } else if (threshold < 0) {
+        errMsg = "Expected threshold >= 0";
+    } else if (model.image.depth() != CV_8U) {
+        errMsg = "Expected 8-bit image";
+    }
+
+    if (!errMsg) {
+        GateStageData *pGate = (GateStageData *) model.stageDataMap[pName];
+        if (!pGate) {
+            pGate = new GateStageData(pName);
+            model.stageDataMap[pName] = pGate;
+        }
+        const Mat &matGray = model.gray();
+        Mat small;
+        resize(matGray, small, Size(max(1, matGray.cols/downscale), max(1, matGray.rows/downscale)), 0, 0, INTER_AREA);
+        if (pGate->reference.size() == small.size()) {
+            double diff = norm(small, pGate->reference, NORM_L1) / small.total();
+            json_object_set(pStageModel, "diff", json_real(diff));
+            pGate->open = diff >= threshold;
+        } else {
+            pGate->open = true;
+        }
+        if (pGate->open) {
+            pGate->reference = small;
+        }
+        LOGTRACE2("apply_gate(%s) %s", pName, pGate->open ? "open" : "closed");
+        json_object_set(pStageModel, "open", pGate->open ? json_true() : json_false());
+    }
+
+    return stageOK("apply_gate(%s) %s", errMsg, pStage, pStageModel);
+}
@@ -49,7 +49,9 @@ string jo_parse(const char * pSource, const char * defaultValue, ArgMap &argMap)
         size_t nameStart = startDelim + sizeof(START_DELIM)-1;
         size_t nameEnd = defaultSep == string::npos ? endDelim : defaultSep;
         string name = result.substr(nameStart,nameEnd-nameStart);
-        const char * pRep = argMap[name.c_str()];
+        // find() leaves argMap unchanged, so that a shared argMap (e.g., emptyMap) can be read concurrently
+        ArgMap::const_iterator it = argMap.find(name);
+        const char * pRep = it == argMap.end() ? NULL : it->second;
         if (pRep) {
             result.replace(startDelim, varEnd-startDelim, pRep);
         } else { // scan for template default
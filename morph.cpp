@@ -16,6 +16,191 @@ using namespace cv;
 using namespace std;
 using namespace firesight;
 
+#define VHGW_MIN_KSIZE 7 /* smaller rectangles are faster with OpenCV's direct separable filter */
+#define VHGW_STRIP 256    /* bytes per column strip of the vertical pass */
+
+static Mutex elementMutex;
+static map<int64, Mat> elementCache;
+
+/**
+ * Return shared structuring element. Callers must not modify it.
+ */
+static Mat cachedStructuringElement(int shape, Size ksize) {
+  int64 key = ((int64)shape << 48) | ((int64)ksize.width << 24) | (int64)ksize.height;
+  AutoLock lock(elementMutex);
+  map<int64, Mat>::iterator it = elementCache.find(key);
+  if (it != elementCache.end()) {
+    return it->second;
+  }
+  Mat element = getStructuringElement(shape, ksize);
+  elementCache[key] = element;
+  return element;
+}
+
+/**
+ * van Herk/Gil-Werman running min (erode) or max (dilate) over windows [i-anchor, i-anchor+k)
+ * of n values spaced step apart. Values outside [0,n) are the identity of the operation.
+ * Cost is three comparisons per value regardless of k.
+ * @param g, h scratch of at least n+2*k values
+ */
+static inline void vhgw1D(const uchar *src, uchar *dst, int n, int step, int k, int anchor,
+                          bool isErode, uchar *g, uchar *h) {
+  uchar fill = isErode ? 255 : 0;
+  int len = ((n + k - 1 + k - 1) / k) * k;
+  for (int j = 0; j < len; j++) {
+    int i = j - anchor;
+    uchar v = (0 <= i && i < n) ? src[i*step] : fill;
+    if (j % k == 0) {
+      g[j] = v;
+    } else {
+      g[j] = isErode ? min(g[j-1], v) : max(g[j-1], v);
+    }
+    h[j] = v;
+  }
+  for (int j = len-2; j >= 0; j--) {
+    if ((j+1) % k != 0) {
+      h[j] = isErode ? min(h[j], h[j+1]) : max(h[j], h[j+1]);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    dst[i*step] = isErode ? min(h[i], g[i+k-1]) : max(h[i], g[i+k-1]);
+  }
+}
+
+class VHGWRowBody : public ParallelLoopBody {
+  private:
+    const Mat &src;
+    Mat &dst;
+    int k;
+    int anchor;
+    bool isErode;
+
+  public:
+    VHGWRowBody(const Mat &src, Mat &dst, int k, int anchor, bool isErode)
+      : src(src), dst(dst), k(k), anchor(anchor), isErode(isErode) {}
+
+    void operator()(const Range &range) const {
+      int cn = src.channels();
+      vector<uchar> g(src.cols + 2*k);
+      vector<uchar> h(src.cols + 2*k);
+      for (int r = range.start; r < range.end; r++) {
+        const uchar *pSrc = src.ptr<uchar>(r);
+        uchar *pDst = dst.ptr<uchar>(r);
+        for (int c = 0; c < cn; c++) {
+          vhgw1D(pSrc + c, pDst + c, src.cols, cn, k, anchor, isErode, &g[0], &h[0]);
+        }
+      }
+    }
+};
+
+/**
+ * Vertical pass over strips of columns. Whole rows of the strip are combined at once
+ * so that the inner loops run over contiguous bytes.
+ */
+class VHGWColBody : public ParallelLoopBody {
+  private:
+    const Mat &src;
+    Mat &dst;
+    int k;
+    int anchor;
+    bool isErode;
+
+  public:
+    VHGWColBody(const Mat &src, Mat &dst, int k, int anchor, bool isErode)
+      : src(src), dst(dst), k(k), anchor(anchor), isErode(isErode) {}
+
+    void operator()(const Range &range) const {
+      int rows = src.rows;
+      int width = src.cols * src.channels();
+      int len = ((rows + k - 1 + k - 1) / k) * k;
+      uchar fill = isErode ? 255 : 0;
+      vector<uchar> g(len * VHGW_STRIP);
+      vector<uchar> h(len * VHGW_STRIP);
+      for (int strip = range.start; strip < range.end; strip++) {
+        int x0 = strip * VHGW_STRIP;
+        int n = min(VHGW_STRIP, width - x0);
+        for (int j = 0; j < len; j++) {
+          int i = j - anchor;
+          uchar *pg = &g[j*VHGW_STRIP];
+          uchar *ph = &h[j*VHGW_STRIP];
+          if (0 <= i && i < rows) {
+            memcpy(ph, src.ptr<uchar>(i) + x0, n);
+          } else {
+            memset(ph, fill, n);
+          }
+          if (j % k == 0) {
+            memcpy(pg, ph, n);
+          } else {
+            const uchar *pgPrev = pg - VHGW_STRIP;
+            for (int x = 0; x < n; x++) {
+              pg[x] = isErode ? min(pgPrev[x], ph[x]) : max(pgPrev[x], ph[x]);
+            }
+          }
+        }
+        for (int j = len-2; j >= 0; j--) {
+          if ((j+1) % k != 0) {
+            uchar *ph = &h[j*VHGW_STRIP];
+            const uchar *phNext = ph + VHGW_STRIP;
+            for (int x = 0; x < n; x++) {
+              ph[x] = isErode ? min(ph[x], phNext[x]) : max(ph[x], phNext[x]);
+            }
+          }
+        }
+        for (int i = 0; i < rows; i++) {
+          const uchar *ph = &h[i*VHGW_STRIP];
+          const uchar *pg = &g[(i+k-1)*VHGW_STRIP];
+          uchar *pDst = dst.ptr<uchar>(i) + x0;
+          for (int x = 0; x < n; x++) {
+            pDst[x] = isErode ? min(ph[x], pg[x]) : max(ph[x], pg[x]);
+          }
+        }
+      }
+    }
+};
+
+/**
+ * Erode or dilate 8-bit image with a rectangle of the given size and anchor
+ * in time independent of the rectangle size.
+ */
+static void vhgwRect(Mat &image, Size ksize, Point anchor, bool isErode) {
+  Mat tmp(image.size(), image.type());
+  if (ksize.width > 1) {
+    VHGWRowBody rowBody(image, tmp, ksize.width, anchor.x, isErode);
+    parallel_for_(Range(0, image.rows), rowBody);
+  } else {
+    image.copyTo(tmp);
+  }
+  if (ksize.height > 1) {
+    int width = image.cols * image.channels();
+    VHGWColBody colBody(tmp, image, ksize.height, anchor.y, isErode);
+    parallel_for_(Range(0, (width + VHGW_STRIP - 1) / VHGW_STRIP), colBody);
+  } else {
+    tmp.copyTo(image);
+  }
+}
+
+/**
+ * Apply erode (or dilate) iterations times. Iterated rectangles are folded into
+ * a single rectangle of size (k-1)*iterations+1.
+ */
+static void morphIterations(Mat &image, int shape, Size ksize, int iterations, bool isErode) {
+  if (shape == MORPH_RECT && image.depth() == CV_8U) {
+    Size folded((ksize.width-1)*iterations+1, (ksize.height-1)*iterations+1);
+    Point anchor((ksize.width/2)*iterations, (ksize.height/2)*iterations);
+    if (max(folded.width, folded.height) >= VHGW_MIN_KSIZE) {
+      LOGTRACE2("morph() van Herk/Gil-Werman %dx%d", folded.width, folded.height);
+      vhgwRect(image, folded, anchor, isErode);
+      return;
+    }
+  }
+  Mat structuringElement = cachedStructuringElement(shape, ksize);
+  if (isErode) {
+    erode(image, image, structuringElement, Point(-1,-1), iterations);
+  } else {
+    dilate(image, image, structuringElement, Point(-1,-1), iterations);
+  }
+}
+
 bool Pipeline::morph(json_t *pStage, json_t *pStageModel, Model &model, String mop, const char* fmt) {
   validateImage(model.image);
   const char *errMsg = NULL;
@@ -68,17 +253,65 @@ bool Pipeline::morph(json_t *pStage, json_t *pStageModel, Model &model, String m
     }
   }
 
+  if (!errMsg && iterations < 1) {
+    errMsg = "expected 1 <= iterations";
+  }
+
+  if (!errMsg && !model.bits.empty()) {
+    bool isPacked = BitImage::isSupportedShape(shape);
+    switch (morphOp) {
+      case MORPH_ERODE:
+        if (isPacked) {
+          model.bits.erode(shape, Size(kwidth, kheight), iterations);
+        }
+        break;
+      case MORPH_DILATE:
+        if (isPacked) {
+          model.bits.dilate(shape, Size(kwidth, kheight), iterations);
+        }
+        break;
+      case MORPH_OPEN:
+        if (isPacked) {
+          model.bits.erode(shape, Size(kwidth, kheight), iterations);
+          model.bits.dilate(shape, Size(kwidth, kheight), iterations);
+        }
+        break;
+      case MORPH_CLOSE:
+        if (isPacked) {
+          model.bits.dilate(shape, Size(kwidth, kheight), iterations);
+          model.bits.erode(shape, Size(kwidth, kheight), iterations);
+        }
+        break;
+      default:
+        isPacked = false;
+        break;
+    }
+    if (isPacked) {
+      LOGTRACE2("morph() packed %dx%d", kwidth, kheight);
+      return stageOK(fmt, errMsg, pStage, pStageModel);
+    }
+    model.syncImage();
+  }
+
   if (!errMsg) {
-    Mat structuringElement = getStructuringElement(shape, Size(kwidth, kheight));
+    Size ksize(kwidth, kheight);
     switch (morphOp) {
       case MORPH_ERODE:
-	erode(model.image, model.image, structuringElement);
+	morphIterations(model.image, shape, ksize, iterations, true);
 	break;
       case MORPH_DILATE:
-	dilate(model.image, model.image, structuringElement);
+	morphIterations(model.image, shape, ksize, iterations, false);
+	break;
+      case MORPH_OPEN:
+	morphIterations(model.image, shape, ksize, iterations, true);
+	morphIterations(model.image, shape, ksize, iterations, false);
+	break;
+      case MORPH_CLOSE:
+	morphIterations(model.image, shape, ksize, iterations, false);
+	morphIterations(model.image, shape, ksize, iterations, true);
 	break;
       default:
-	morphologyEx(model.image, model.image, morphOp, structuringElement, anchor, iterations);
+	morphologyEx(model.image, model.image, morphOp, cachedStructuringElement(shape, ksize), anchor, iterations);
 	break;
     }
   }
@@ -0,0 +1,133 @@
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+/**
+ * Sum of the integral image over rect in four lookups
+ */
+static inline double rectSum(const Mat &sum, const Rect &rect) {
+    int x1 = rect.x + rect.width;
+    int y1 = rect.y + rect.height;
+    return sum.at<double>(y1, x1) - sum.at<double>(rect.y, x1) -
+           sum.at<double>(y1, rect.x) + sum.at<double>(rect.y, rect.x);
+}
+
+/**
+ * Axis aligned bounds of a rect from a stage model. Rects are centered on x,y and
+ * may be rotated by angle. Rects with bounds (e.g., from components) use their bounds.
+ */
+static bool rectBounds(json_t *pRect, Rect &bounds, ArgMap &argMap) {
+    json_t *pBounds = json_object_get(pRect, "bounds");
+    if (json_is_object(pBounds)) {
+        bounds.x = jo_int(pBounds, "x", 0, argMap);
+        bounds.y = jo_int(pBounds, "y", 0, argMap);
+        bounds.width = jo_int(pBounds, "width", -1, argMap);
+        bounds.height = jo_int(pBounds, "height", -1, argMap);
+        return bounds.width >= 0 && bounds.height >= 0;
+    }
+    float x = jo_float(pRect, "x", FLT_MAX, argMap);
+    float y = jo_float(pRect, "y", FLT_MAX, argMap);
+    float width = jo_float(pRect, "width", -1, argMap);
+    float height = jo_float(pRect, "height", -1, argMap);
+    float angle = jo_float(pRect, "angle", 0, argMap);
+    if (x == FLT_MAX || y == FLT_MAX || width < 0 || height < 0) {
+        return false;
+    }
+    bounds = RotatedRect(Point2f(x, y), Size2f(width, height), angle).boundingRect();
+    return true;
+}
+
+bool Pipeline::apply_roiStats(json_t *pStage, json_t *pStageModel, Model &model) {
+    validateImage(model.image);
+    string rectsModelName = jo_string(pStage, "model", "", model.argMap);
+    bool minMax = jo_bool(pStage, "minMax", false, model.argMap);
+    json_t *pRois = json_object_get(pStage, "rois");
+    const char *errMsg = NULL;
+
+    vector<Rect> rois;
+    if (!rectsModelName.empty()) {
+        json_t *pRectsModel = json_object_get(model.getJson(false), rectsModelName.c_str());
+        json_t *pRects = json_object_get(pRectsModel, "rects");
+        if (!json_is_object(pRectsModel)) {
+            errMsg = "Named stage is not in model";
+        } else if (!json_is_array(pRects)) {
+            errMsg = "Expected array of rects";
+        } else {
+            size_t index;
+            json_t *pRect;
+            json_array_foreach(pRects, index, pRect) {
+                Rect bounds;
+                if (!rectBounds(pRect, bounds, model.argMap)) {
+                    errMsg = "rects: expected x, y, width, height";
+                    break;
+                }
+                rois.push_back(bounds);
+            }
+        }
+    } else if (json_is_array(pRois)) {
+        size_t index;
+        json_t *pRoi;
+        json_array_foreach(pRois, index, pRoi) {
+            if (!json_is_array(pRoi) || json_array_size(pRoi) != 4) {
+                errMsg = "rois: expected array of [x,y,width,height]";
+                break;
+            }
+            rois.push_back(Rect(
+                (int) json_number_value(json_array_get(pRoi, 0)),
+                (int) json_number_value(json_array_get(pRoi, 1)),
+                (int) json_number_value(json_array_get(pRoi, 2)),
+                (int) json_number_value(json_array_get(pRoi, 3))));
+        }
+    } else if (pRois) {
+        errMsg = "rois: expected array of [x,y,width,height]";
+    } else {
+        rois.push_back(Rect(0, 0, model.image.cols, model.image.rows));
+    }
+
+    if (!errMsg) {
+        const Mat &matGray = model.gray();
+        Mat sum;
+        Mat sqsum;
+        model.integral(sum, sqsum);
+        Rect imageRect(0, 0, matGray.cols, matGray.rows);
+        LOGTRACE2("apply_roiStats() %d rois %s", (int) rois.size(), matInfo(matGray).c_str());
+
+        json_t *pStats = json_array();
+        json_object_set(pStageModel, "rois", pStats);
+        for (size_t i = 0; i < rois.size(); i++) {
+            Rect roi = rois[i] & imageRect;
+            json_t *pRoiStats = json_object();
+            json_object_set(pRoiStats, "x", json_integer(roi.x));
+            json_object_set(pRoiStats, "y", json_integer(roi.y));
+            json_object_set(pRoiStats, "width", json_integer(roi.width));
+            json_object_set(pRoiStats, "height", json_integer(roi.height));
+            double area = roi.area();
+            if (area > 0) {
+                double mean = rectSum(sum, roi) / area;
+                double variance = rectSum(sqsum, roi) / area - mean*mean;
+                json_object_set(pRoiStats, "mean", json_real(mean));
+                json_object_set(pRoiStats, "stdDev", json_real(variance > 0 ? sqrt(variance) : 0));
+                if (minMax) {
+                    double minVal;
+                    double maxVal;
+                    minMaxLoc(matGray(roi), &minVal, &maxVal);
+                    json_object_set(pRoiStats, "min", json_real(minVal));
+                    json_object_set(pRoiStats, "max", json_real(maxVal));
+                }
+            }
+            json_array_append(pStats, pRoiStats);
+        }
+    }
+
+    return stageOK("apply_roiStats(%s) %s", errMsg, pStage, pStageModel);
+}
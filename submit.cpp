@@ -0,0 +1,222 @@
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define SUBMIT_QUEUE_SIZE 4 /* images waiting for each stage group */
+
+/**
+ * Bounded single producer, single consumer queue. Items are exchanged through a ring
+ * without locking; a side waits on a condition variable only when the ring is full
+ * (producer) or empty (consumer), and the other side then wakes it.
+ */
+template <class T>
+class SPSCQueue {
+    private:
+        vector<T> slots;
+        std::atomic<size_t> head; // next slot to pop
+        std::atomic<size_t> tail; // next slot to push
+        std::atomic<bool> producerWaiting;
+        std::atomic<bool> consumerWaiting;
+        std::mutex waitMutex;
+        std::condition_variable notFull;
+        std::condition_variable notEmpty;
+
+    public:
+        SPSCQueue(size_t capacity) : slots(capacity+1), head(0), tail(0),
+            producerWaiting(false), consumerWaiting(false) {}
+
+        void push(const T &item) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            size_t next = (t + 1) % slots.size();
+            if (next == head.load(std::memory_order_acquire)) {
+                std::unique_lock<std::mutex> lock(waitMutex);
+                producerWaiting.store(true);
+                while (next == head.load()) {
+                    notFull.wait(lock);
+                }
+                producerWaiting.store(false);
+            }
+            slots[t] = item;
+            tail.store(next);
+            if (consumerWaiting.load()) {
+                std::lock_guard<std::mutex> lock(waitMutex);
+                notEmpty.notify_one();
+            }
+        }
+
+        T pop() {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                std::unique_lock<std::mutex> lock(waitMutex);
+                consumerWaiting.store(true);
+                while (h == tail.load()) {
+                    notEmpty.wait(lock);
+                }
+                consumerWaiting.store(false);
+            }
+            T item = slots[h];
+            head.store((h + 1) % slots.size());
+            if (producerWaiting.load()) {
+                std::lock_guard<std::mutex> lock(waitMutex);
+                notFull.notify_one();
+            }
+            return item;
+        }
+};
+
+/**
+ * Image in flight between stage groups
+ */
+typedef struct StreamFrame {
+    Model model;
+    bool ok;
+    std::promise<FrameResult> result;
+
+    StreamFrame(ArgMap &argMap) : model(argMap), ok(true) {}
+} StreamFrame;
+
+namespace firesight {
+
+/**
+ * Threads that each execute a group of consecutive stages on one image after another.
+ * Each group keeps the state of its own stages, so stage state is only used by one thread.
+ */
+class PipelineStream {
+    private:
+        Pipeline &pipeline;
+        vector<size_t> bounds; // group g executes stages [bounds[g], bounds[g+1])
+        vector<SPSCQueue<StreamFrame *> *> queues;
+        vector<map<string, StageDataPtr> > stageData;
+        vector<std::thread> threads;
+
+        void run(size_t group) {
+            SPSCQueue<StreamFrame *> *pNext = group+1 < queues.size() ? queues[group+1] : NULL;
+            for (;;) {
+                StreamFrame *pFrame = queues[group]->pop();
+                if (!pFrame) {
+                    if (pNext) {
+                        pNext->push(NULL);
+                    }
+                    return;
+                }
+                Model &model = pFrame->model;
+                if (pFrame->ok) {
+                    model.stageDataMap.swap(stageData[group]);
+                    try {
+                        pFrame->ok = pipeline.processStages(model, bounds[group], bounds[group+1]);
+                    } catch (exception &ex) {
+                        LOGERROR1("Pipeline::submit() %s", ex.what());
+                        json_object_set(model.getJson(false), "ERROR", json_string(ex.what()));
+                        pFrame->ok = false;
+                    }
+                    model.stageDataMap.swap(stageData[group]);
+                }
+                if (pNext) {
+                    pNext->push(pFrame);
+                } else {
+                    model.syncImage();
+                    FrameResult result;
+                    result.image = model.image;
+                    result.pModel = model.getJson(true);
+                    pFrame->result.set_value(result);
+                    delete pFrame;
+                }
+            }
+        }
+
+    public:
+        /**
+         * Start groups of about the same number of stages. A gate stage and the stages
+         * that follow it stay in one group, since they share the gate state.
+         */
+        PipelineStream(Pipeline &pipeline, size_t groups) : pipeline(pipeline) {
+            size_t nStages = json_array_size(pipeline.pPipeline);
+            size_t gateIndex = nStages;
+            for (size_t i = 0; i < nStages && gateIndex == nStages; i++) {
+                json_t *pStage = json_array_get(pipeline.pPipeline, i);
+                if (jo_string(pStage, "op").compare("gate") == 0) {
+                    gateIndex = i;
+                }
+            }
+            groups = max((size_t) 1, min(groups, nStages));
+            bounds.push_back(0);
+            for (size_t g = 1; g < groups; g++) {
+                size_t bound = g * nStages / groups;
+                if (bound > bounds.back() && bound <= gateIndex) {
+                    bounds.push_back(bound);
+                }
+            }
+            bounds.push_back(nStages);
+            size_t nGroups = bounds.size() - 1;
+            LOGDEBUG2("Pipeline::submit() %d stages in %d groups", (int) nStages, (int) nGroups);
+
+            stageData.resize(nGroups);
+            for (size_t g = 0; g < nGroups; g++) {
+                queues.push_back(new SPSCQueue<StreamFrame *>(SUBMIT_QUEUE_SIZE));
+            }
+            for (size_t g = 0; g < nGroups; g++) {
+                threads.push_back(std::thread(&PipelineStream::run, this, g));
+            }
+        }
+
+        /**
+         * Finish the images already submitted and stop
+         */
+        ~PipelineStream() {
+            queues[0]->push(NULL);
+            for (size_t g = 0; g < threads.size(); g++) {
+                threads[g].join();
+            }
+            for (size_t g = 0; g < queues.size(); g++) {
+                delete queues[g];
+                for (map<string, StageDataPtr>::iterator it = stageData[g].begin(); it != stageData[g].end(); ++it) {
+                    delete it->second;
+                }
+            }
+        }
+
+        void push(StreamFrame *pFrame) {
+            queues[0]->push(pFrame);
+        }
+};
+
+} // namespace firesight
+
+std::future<FrameResult> Pipeline::submit(const Mat &mat, ArgMap &argMap) {
+    AutoLock lock(submitMutex); // the first queue has a single producer
+    if (!pStream) {
+        if (!json_is_array(pPipeline)) {
+            throw invalid_argument("Pipeline::submit() expected json array for pipeline definition");
+        }
+        int groups = submitGroups > 0 ? submitGroups : (int) std::thread::hardware_concurrency();
+        pStream = new PipelineStream(*this, max(1, groups));
+    }
+    StreamFrame *pFrame = new StreamFrame(argMap);
+    pFrame->model.image = mat.clone();
+    pFrame->model.imageMap["input"] = mat.clone();
+    std::future<FrameResult> result = pFrame->result.get_future();
+    pStream->push(pFrame);
+    return result;
+}
+
+void Pipeline::setSubmitGroups(int groups) {
+    AutoLock lock(submitMutex);
+    submitGroups = groups;
+}
+
+void Pipeline::stopStream() {
+    AutoLock lock(submitMutex);
+    delete pStream;
+    pStream = NULL;
+}
@@ -22,6 +22,37 @@ extern void test_matMaxima();
 extern void test_matMinima(); 
 extern void test_jo_util();
 extern void test_calibrate();
+extern void test_pipeline();
+extern void test_morph();
+extern void test_fitCircles();
+extern void test_components();
+extern void test_roiStats();
+extern void test_calcHist();
+extern void test_PSNR();
+extern void test_bgSub();
+extern void test_Pt2Res();
+extern void test_HoughCircles();
+
+/**
+ * Process a copy of image with the given pipeline and return the model of the named stage,
+ * or of the last stage if stageName is NULL. Caller must json_decref() the stage model.
+ */
+json_t *stageModel(const char *pDefinition, const Mat &image, const char *stageName) {
+  Pipeline pipeline(pDefinition);
+  Mat workingImage = image.clone();
+  ArgMap argMap;
+  json_t *pModel = pipeline.process(workingImage, argMap);
+  char name[20];
+  if (!stageName) {
+    json_t *pPipeline = json_loads(pDefinition, 0, NULL);
+    snprintf(name, sizeof(name), "s%d", (int) json_array_size(pPipeline));
+    json_decref(pPipeline);
+    stageName = name;
+  }
+  json_t *pStageModel = json_incref(json_object_get(pModel, stageName));
+  json_decref(pModel);
+  return pStageModel;
+}
 
 int main(int argc, char *argv[])
 {
@@ -42,6 +73,26 @@ int main(int argc, char *argv[])
     test_matMinima();
     cout << "test_jo_util()" << endl;
     test_jo_util();
+    cout << "test_pipeline()" << endl;
+    test_pipeline();
+    cout << "test_morph()" << endl;
+    test_morph();
+    cout << "test_fitCircles()" << endl;
+    test_fitCircles();
+    cout << "test_components()" << endl;
+    test_components();
+    cout << "test_roiStats()" << endl;
+    test_roiStats();
+    cout << "test_calcHist()" << endl;
+    test_calcHist();
+    cout << "test_PSNR()" << endl;
+    test_PSNR();
+    cout << "test_bgSub()" << endl;
+    test_bgSub();
+    cout << "test_Pt2Res()" << endl;
+    test_Pt2Res();
+    cout << "test_HoughCircles()" << endl;
+    test_HoughCircles();
 
     cout << "END OF TEST main()" << endl;
 }
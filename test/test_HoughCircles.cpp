@@ -0,0 +1,102 @@
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+extern json_t *stageModel(const char *pDefinition, const Mat &image, const char *stageName);
+
+#define HOUGH_TOLERANCE 2.0
+
+/**
+ * Circles found by a HoughCircles pipeline with the given options
+ */
+static vector<Circle> houghCircles(const char *pOptions, const Mat &image) {
+  char definition[255];
+  snprintf(definition, sizeof(definition),
+    "[{\"op\":\"HoughCircles\",\"diamMin\":40,\"diamMax\":104,\"houghcircles_minDist\":40,"
+    "\"houghcircles_param2\":20%s}]", pOptions);
+  json_t *pStageModel = stageModel(definition, image, "s1");
+  json_t *pCircles = json_object_get(pStageModel, "circles");
+  assert(json_is_array(pCircles));
+  vector<Circle> circles;
+  for (size_t i = 0; i < json_array_size(pCircles); i++) {
+    json_t *pCircle = json_array_get(pCircles, i);
+    circles.push_back(Circle(json_real_value(json_object_get(pCircle, "x")),
+                             json_real_value(json_object_get(pCircle, "y")),
+                             json_real_value(json_object_get(pCircle, "radius"))));
+  }
+  json_decref(pStageModel);
+  cout << "test_HoughCircles() " << definition << " circles:" << circles.size() << endl;
+  return circles;
+}
+
+/**
+ * Assert that the found circles are the expected circles within tolerance, in any order
+ */
+static void assertCircles(const vector<Circle> &found, const vector<Circle> &expected) {
+  assert(found.size() == expected.size());
+  for (size_t e = 0; e < expected.size(); e++) {
+    bool matched = false;
+    for (size_t i = 0; !matched && i < found.size(); i++) {
+      matched = fabs(found[i].x - expected[e].x) <= HOUGH_TOLERANCE &&
+                fabs(found[i].y - expected[e].y) <= HOUGH_TOLERANCE &&
+                fabs(found[i].radius - expected[e].radius) <= HOUGH_TOLERANCE;
+    }
+    if (!matched) {
+      cout << "test_HoughCircles() missing x:" << expected[e].x << " y:" << expected[e].y <<
+        " radius:" << expected[e].radius << endl;
+    }
+    assert(matched);
+  }
+}
+
+static void assertError(const char *pOptions, const Mat &image) {
+  char definition[255];
+  snprintf(definition, sizeof(definition), "[{\"op\":\"HoughCircles\",\"diamMin\":40,\"diamMax\":104%s}]", pOptions);
+  json_t *pStageModel = stageModel(definition, image, "s1");
+  assert(json_is_string(json_object_get(pStageModel, "error")));
+  json_decref(pStageModel);
+}
+
+void test_HoughCircles() {
+  Mat image(360, 480, CV_8UC1, Scalar(60));
+  Circle drawn[] = { Circle(80, 80, 24), Circle(240, 90, 32), Circle(380, 120, 40), Circle(170, 250, 48) };
+  vector<Circle> expected(drawn, drawn + sizeof(drawn)/sizeof(Circle));
+  for (size_t i = 0; i < expected.size(); i++) {
+    circle(image, Point((int) expected[i].x, (int) expected[i].y), (int) expected[i].radius, Scalar(200), -1);
+  }
+  Mat noise(image.size(), CV_8SC1);
+  RNG rng(0xC1C);
+  rng.fill(noise, RNG::NORMAL, 0, 8);
+  add(image, noise, image, noArray(), CV_8U);
+
+  vector<Circle> full = houghCircles(",\"filter\":\"gaussian\"", image);
+  assertCircles(full, expected);
+  assertCircles(houghCircles(",\"filter\":\"median\"", image), expected);
+  assertCircles(houghCircles(",\"filter\":\"bilateralFast\"", image), expected);
+
+  // pyramid detection is refined at full resolution
+  assertCircles(houghCircles(",\"filter\":\"gaussian\",\"pyramid\":1", image), full);
+  assertCircles(houghCircles(",\"filter\":\"gaussian\",\"pyramid\":2", image), full);
+
+  // circles are reported in image coordinates, and only those inside the roi are found
+  vector<Circle> inside;
+  inside.push_back(expected[1]);
+  inside.push_back(expected[2]);
+  assertCircles(houghCircles(",\"filter\":\"gaussian\",\"roi\":[180,40,280,140]", image), inside);
+  assertCircles(houghCircles(",\"filter\":\"gaussian\",\"roi\":[180,40,280,140],\"pyramid\":2", image), inside);
+  assert(houghCircles(",\"roi\":[500,400,10,10]", image).empty());
+
+  assertError(",\"filter\":\"sharpen\"", image);
+  assertError(",\"pyramid\":5", image);
+}
@@ -0,0 +1,73 @@
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+extern json_t *stageModel(const char *pDefinition, const Mat &image, const char *stageName);
+
+static double expectedPSNR(const Mat &a, const Mat &b) {
+  double mse = norm(a, b, NORM_L2SQR) / (a.total() * a.channels());
+  return 10.0*log10(255*255/mse);
+}
+
+void test_PSNR() {
+  RNG rng(0x951);
+  Mat image(120, 160, CV_8UC3);
+  rng.fill(image, RNG::UNIFORM, 0, 256);
+  Mat blurred;
+  blur(image, blurred, Size(3,3));
+  double psnr = expectedPSNR(image, blurred);
+  cout << "test_PSNR() expected PSNR:" << psnr << endl;
+
+  // compare the working image with a named stage image
+  const char *stageDefinition =
+    "[{\"op\":\"blur\",\"ksize.width\":3,\"ksize.height\":3,\"name\":\"blurred\"},"
+    "{\"op\":\"stageImage\",\"stage\":\"input\"},"
+    "{\"op\":\"PSNR\",\"stage\":\"blurred\"}]";
+  json_t *pStageModel = stageModel(stageDefinition, image, NULL);
+  assert(fabs(json_real_value(json_object_get(pStageModel, "PSNR")) - psnr) < 1e-6);
+  json_decref(pStageModel);
+
+  pStageModel = stageModel("[{\"op\":\"PSNR\",\"stage\":\"input\"}]", image, NULL);
+  assert(strcmp(json_string_value(json_object_get(pStageModel, "PSNR")), "SAME") == 0);
+  json_decref(pStageModel);
+
+  pStageModel = stageModel("[{\"op\":\"PSNR\",\"stage\":\"nosuchstage\"}]", image, NULL);
+  assert(json_is_string(json_object_get(pStageModel, "error")));
+  json_decref(pStageModel);
+
+  // earlyExit stops once PSNR must be below threshold; the partial PSNR bounds it from above
+  const char *exitDefinition =
+    "[{\"op\":\"blur\",\"ksize.width\":3,\"ksize.height\":3,\"name\":\"blurred\"},"
+    "{\"op\":\"stageImage\",\"stage\":\"input\"},"
+    "{\"op\":\"PSNR\",\"stage\":\"blurred\",\"threshold\":60,\"earlyExit\":true}]";
+  pStageModel = stageModel(exitDefinition, image, NULL);
+  double exitPSNR = json_real_value(json_object_get(pStageModel, "PSNR"));
+  cout << "test_PSNR() earlyExit PSNR:" << exitPSNR << endl;
+  assert(json_is_true(json_object_get(pStageModel, "earlyExit")));
+  assert(psnr <= exitPSNR && exitPSNR < 60);
+  json_decref(pStageModel);
+
+  const char *passDefinition =
+    "[{\"op\":\"blur\",\"ksize.width\":3,\"ksize.height\":3,\"name\":\"blurred\"},"
+    "{\"op\":\"stageImage\",\"stage\":\"input\"},"
+    "{\"op\":\"PSNR\",\"stage\":\"blurred\",\"threshold\":5,\"earlyExit\":true}]";
+  pStageModel = stageModel(passDefinition, image, NULL);
+  assert(!json_object_get(pStageModel, "earlyExit"));
+  assert(strcmp(json_string_value(json_object_get(pStageModel, "PSNR")), "SAME") == 0);
+  json_decref(pStageModel);
+
+  pStageModel = stageModel("[{\"op\":\"PSNR\",\"stage\":\"input\",\"earlyExit\":true}]", image, NULL);
+  assert(json_is_string(json_object_get(pStageModel, "error")));
+  json_decref(pStageModel);
+}
@@ -0,0 +1,50 @@
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+/**
+ * Points spaced 4 pixels apart along a line, mixed with uniformly scattered outliers
+ */
+static vector<XY> tapePoints(int nInliers, int nOutliers) {
+  RNG rng(0x7A9E);
+  vector<XY> coords;
+  for (int i = 0; i < nInliers; i++) {
+    coords.push_back(XY(10 + 3.2*i, 20 + 2.4*i));
+  }
+  for (int i = 0; i < nOutliers; i++) {
+    coords.push_back(XY(rng.uniform(0.0, 3.2*nInliers), rng.uniform(0.0, 2.4*nInliers)));
+  }
+  return coords;
+}
+
+void test_Pt2Res() {
+  vector<XY> coords = tapePoints(60, 20);
+  Pt2Res pt2res;
+  double resolution = pt2res.getResolution(0.5, 0.1, 0.999, 4.0, coords);
+  cout << "test_Pt2Res() resolution:" << resolution << endl;
+  assert(fabs(resolution - 1.0) < 1e-6);
+  assert(pt2res.getLineStats().converged && pt2res.getPatternStats().converged);
+
+  // a single round over this many points exceeds 1ms, so the pattern pass starts
+  // after the time limit and must still evaluate one round of hypotheses
+  coords = tapePoints(100000, 100000);
+  Pt2Res timed(0x5EED, 100000, 1);
+  resolution = timed.getResolution(0.5, 0.1, 0.999, 4.0, coords);
+  const RANSACStats &line = timed.getLineStats();
+  const RANSACStats &pattern = timed.getPatternStats();
+  cout << "test_Pt2Res() maxMillis:1 resolution:" << resolution << " millis:" << timed.getMillis() <<
+    " line:" << line.iterations << "/" << line.inliers << " pattern:" << pattern.iterations << "/" << pattern.inliers << endl;
+  assert(line.iterations > 0 && line.inliers >= 2);
+  assert(pattern.iterations > 0 && pattern.inliers >= 2);
+  assert(!isnan(resolution) && resolution > 0);
+}
@@ -0,0 +1,109 @@
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define BGSUB_FRAMES 60
+
+static Mat fgMask(Pipeline &pipeline, const Mat &frame, ArgMap argMap = ArgMap()) {
+  Mat workingImage = frame.clone();
+  json_t *pModel = pipeline.process(workingImage, argMap);
+  json_decref(pModel);
+  assert(workingImage.type() == CV_8UC1 && workingImage.size() == frame.size());
+  return workingImage;
+}
+
+/**
+ * Starting from a black background, a static scene must fade into the background,
+ * after which an object placed in the scene must appear in the foreground mask
+ */
+static void assertBackgroundModel(const char *method, double learningRate, int downscale, const Mat &scene) {
+  char definition[255];
+  snprintf(definition, sizeof(definition),
+    "[{\"op\":\"backgroundSubtractor\",\"method\":\"%s\",\"learningRate\":%g,\"downscale\":%d,\"varThreshold\":16}]",
+    method, learningRate, downscale);
+  Pipeline pipeline(definition);
+
+  assert(countNonZero(fgMask(pipeline, Mat::zeros(scene.size(), scene.type()))) == 0);
+  Mat mask = fgMask(pipeline, scene);
+  int initial = countNonZero(mask);
+  for (int i = 1; i < BGSUB_FRAMES; i++) {
+    mask = fgMask(pipeline, scene);
+  }
+  int converged = countNonZero(mask);
+
+  Rect object(40, 32, 24, 24);
+  Mat frame = scene.clone();
+  rectangle(frame, object, Scalar::all(0), -1);
+  mask = fgMask(pipeline, frame);
+  // pixels of a downscaled cell that straddles the object edge may go either way
+  Rect inner(object.x + downscale, object.y + downscale, object.width - 2*downscale, object.height - 2*downscale);
+  Rect outer(object.x - downscale, object.y - downscale, object.width + 2*downscale, object.height + 2*downscale);
+  int objectPixels = countNonZero(mask(inner));
+  int strayPixels = countNonZero(mask) - countNonZero(mask(outer));
+  cout << "test_bgSub() " << definition << " initial:" << initial << " converged:" << converged <<
+    " object:" << objectPixels << "/" << inner.area() << " stray:" << strayPixels << endl;
+  assert(initial == (int) scene.total());
+  assert(converged == 0);
+  assert(objectPixels == inner.area());
+  assert(strayPixels == 0);
+}
+
+/**
+ * Changing the method of a stage between frames starts a new background for that method
+ */
+static void assertMethodChange(const Mat &scene) {
+  Pipeline pipeline("[{\"op\":\"backgroundSubtractor\",\"name\":\"bg\",\"method\":\"{{method}}\"}]");
+  const char *methods[] = { "MOG2", "runningAverage", "median", "MOG2", "runningAverage" };
+  for (size_t i = 0; i < sizeof(methods)/sizeof(char *); i++) {
+    ArgMap argMap;
+    argMap["method"] = methods[i];
+    Mat mask = fgMask(pipeline, scene, argMap);
+    cout << "test_bgSub() method:" << methods[i] << " nonZero:" << countNonZero(mask) << endl;
+    if (strcmp(methods[i], "MOG2") != 0) {
+      assert(countNonZero(mask) == 0); // background starts with the first frame
+    }
+  }
+}
+
+/**
+ * Learning rates below 1/256 must still move the runningAverage background
+ */
+static void assertSlowLearning() {
+  Pipeline pipeline(
+    "[{\"op\":\"backgroundSubtractor\",\"method\":\"runningAverage\",\"learningRate\":0.001,\"varThreshold\":16}]");
+  Mat scene(60, 80, CV_8UC1, Scalar(30));
+  fgMask(pipeline, Mat::zeros(scene.size(), scene.type()));
+  Mat mask;
+  for (int i = 0; i < 4*BGSUB_FRAMES; i++) {
+    mask = fgMask(pipeline, scene);
+  }
+  cout << "test_bgSub() learningRate:0.001 nonZero:" << countNonZero(mask) << endl;
+  assert(countNonZero(mask) == 0);
+}
+
+void test_bgSub() {
+  Mat gray(120, 160, CV_8UC1);
+  RNG rng(0xB65B);
+  rng.fill(gray, RNG::UNIFORM, 40, 200);
+  Mat color(120, 160, CV_8UC3);
+  rng.fill(color, RNG::UNIFORM, 40, 200);
+
+  assertBackgroundModel("runningAverage", 0.1, 1, gray);
+  assertBackgroundModel("runningAverage", 0.1, 4, gray);
+  assertBackgroundModel("runningAverage", 0.1, 2, color);
+  assertBackgroundModel("median", 8, 1, gray);
+  assertBackgroundModel("median", 8, 4, gray);
+  assertBackgroundModel("median", 8, 2, color);
+  assertMethodChange(color);
+  assertSlowLearning();
+}
@@ -0,0 +1,134 @@
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+extern json_t *stageModel(const char *pDefinition, const Mat &image, const char *stageName);
+
+/**
+ * Histogram of each channel as computed by cv::calcHist
+ */
+static vector<Mat> expectedHists(const Mat &image, int bins, float rangeMin, float rangeMax) {
+  vector<Mat> hists;
+  float range[] = { rangeMin, rangeMax };
+  const float *ranges[] = { range };
+  for (int channel = 0; channel < image.channels(); channel++) {
+    Mat hist;
+    calcHist(&image, 1, &channel, Mat(), hist, 1, &bins, ranges);
+    hists.push_back(hist);
+  }
+  return hists;
+}
+
+/**
+ * Assert that the bins of a calcHist stage match cv::calcHist. Bins with no counts are omitted.
+ */
+static void assertHist(const Mat &image, int bins, float rangeMin, float rangeMax, bool isArray) {
+  char definition[255];
+  snprintf(definition, sizeof(definition),
+    "[{\"op\":\"calcHist\",\"bins\":%d,\"rangeMin\":%g,\"rangeMax\":%g,\"format\":\"%s\"}]",
+    bins, rangeMin, rangeMax, isArray ? "array" : "object");
+  json_t *pStageModel = stageModel(definition, image, "s1");
+  json_t *pHist = json_object_get(pStageModel, "hist");
+  vector<Mat> hists = expectedHists(image, bins, rangeMin, rangeMax);
+  int cn = image.channels();
+  size_t nBins = 0;
+  for (int i = 0; i < bins; i++) {
+    bool isEmpty = true;
+    for (int channel = 0; channel < cn; channel++) {
+      isEmpty = isEmpty && hists[channel].at<float>(i) == 0;
+    }
+    if (isEmpty) {
+      continue;
+    }
+    json_t *pBin;
+    int first = 0;
+    if (isArray) {
+      pBin = json_array_get(pHist, nBins);
+      assert(json_integer_value(json_array_get(pBin, 0)) == i);
+      first = 1;
+    } else {
+      char key[20];
+      snprintf(key, sizeof(key), "%d", i);
+      pBin = json_object_get(pHist, key);
+      assert(pBin);
+    }
+    for (int channel = 0; channel < cn; channel++) {
+      json_t *pCount = cn == 1 && !isArray ? pBin : json_array_get(pBin, first + channel);
+      assert(json_integer_value(pCount) == (int) hists[channel].at<float>(i));
+    }
+    nBins++;
+  }
+  size_t actualBins = isArray ? json_array_size(pHist) : json_object_size(pHist);
+  cout << "test_calcHist() " << definition << " " << matInfo(image) << " bins:" << actualBins << endl;
+  assert(actualBins == nBins);
+  json_decref(pStageModel);
+}
+
+/**
+ * Assert that locations are the raster order locations of the given pixels
+ */
+static void assertLocations(const char *pDefinition, const Mat &image, const vector<Vec4i> &expected) {
+  json_t *pStageModel = stageModel(pDefinition, image, "s1");
+  json_t *pLocations = json_object_get(pStageModel, "locations");
+  assert(json_array_size(pLocations) == expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    json_t *pLoc = json_array_get(pLocations, i);
+    size_t n = image.channels() > 1 ? 4 : 3;
+    assert(json_array_size(pLoc) == n);
+    for (size_t j = 0; j < n; j++) {
+      assert(json_integer_value(json_array_get(pLoc, j)) == expected[i][j]);
+    }
+  }
+  json_decref(pStageModel);
+}
+
+void test_calcHist() {
+  RNG rng(0xC41C);
+  Mat gray(97, 131, CV_8UC1); // more than one band of rows
+  rng.fill(gray, RNG::UNIFORM, 0, 256);
+  Mat color(70, 90, CV_8UC3);
+  rng.fill(color, RNG::NORMAL, 128, 50);
+
+  assertHist(gray, 256, 0, 256, false);
+  assertHist(gray, 20, 10, 250, true);
+  assertHist(gray, 7, 0, 256, false);
+  assertHist(color, 16, 0, 256, false);
+  assertHist(color, 24, 40, 200, true);
+
+  // bins with more than binMax pixels are not located
+  Mat sparse(100, 80, CV_8UC1, Scalar(100));
+  vector<Vec4i> expected;
+  Point points[] = { Point(3, 1), Point(70, 1), Point(5, 64), Point(0, 65), Point(79, 99) };
+  for (size_t i = 0; i < sizeof(points)/sizeof(Point); i++) {
+    sparse.at<uchar>(points[i]) = 200;
+    expected.push_back(Vec4i(points[i].x, points[i].y, 200, 0));
+  }
+  assertLocations("[{\"op\":\"calcHist\",\"binMax\":10,\"locations\":100}]", sparse, expected);
+  expected.resize(3);
+  assertLocations("[{\"op\":\"calcHist\",\"binMax\":10,\"locations\":3}]", sparse, expected);
+
+  Mat sparseColor(100, 80, CV_8UC3, Scalar(10, 20, 30));
+  expected.clear();
+  for (size_t i = 0; i < sizeof(points)/sizeof(Point); i++) {
+    sparseColor.at<Vec3b>(points[i])[1] = 200;
+    expected.push_back(Vec4i(points[i].x, points[i].y, 200, 1));
+  }
+  assertLocations("[{\"op\":\"calcHist\",\"binMax\":10,\"locations\":100}]", sparseColor, expected);
+
+  // locations are only available for 8-bit images
+  Mat gray32F;
+  sparse.convertTo(gray32F, CV_32F);
+  json_t *pStageModel = stageModel("[{\"op\":\"calcHist\",\"locations\":10}]", gray32F, "s1");
+  assert(json_is_string(json_object_get(pStageModel, "error")));
+  json_decref(pStageModel);
+}
@@ -2,6 +2,12 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
 #include "FireLog.h"
 #include "FireSight.hpp"
 #include "version.h"
@@ -66,6 +72,81 @@ void test_calibrateCamera() {
     dump_calibration(result, cameraMatrix, distCoeffs, rvecs, tvecs);
 }
 
+static json_t *translation(double dx, double dy) {
+	json_t *pCalibrate = json_object();
+	json_t *pPerspective = json_array();
+	double m[] = { 1, 0, dx, 0, 1, dy, 0, 0, 1 };
+	for (int i = 0; i < 9; i++) {
+		json_array_append_new(pPerspective, json_real(m[i]));
+	}
+	json_object_set_new(pCalibrate, "perspective", pPerspective);
+	return pCalibrate;
+}
+
+static void assertWarp(Pipeline &pipeline, const Mat &image, double dx, double dy) {
+	Mat expected;
+	Mat matrix = (Mat_<double>(3,3) << 1, 0, dx, 0, 1, dy, 0, 0, 1);
+	warpPerspective(image, expected, matrix, image.size(), INTER_LINEAR, BORDER_REPLICATE);
+	Mat workingImage = image.clone();
+	ArgMap argMap;
+	json_t *pModel = pipeline.process(workingImage, argMap);
+	json_t *pStageModel = json_object_get(pModel, "s1");
+	cout << "test_calibrationStore() dx:" << dx << " dy:" << dy << endl;
+	assert(!json_object_get(pStageModel, "error"));
+	assert(json_is_string(json_object_get(pStageModel, "calibration")));
+	assert(norm(workingImage, expected, NORM_INF) == 0);
+	json_decref(pModel);
+}
+
+/**
+ * warpPerspective loads a saved calibration through the store and picks up file changes
+ */
+void test_calibrationStore() {
+	cout << "test_calibrationStore() BEGIN-------------" << endl;
+	const char *path = "target/test-calibration.json";
+	Mat image(60, 80, CV_8UC3);
+	RNG rng(0xCA1);
+	rng.fill(image, RNG::UNIFORM, 0, 256);
+
+	json_t *pCalibrate = translation(5, 3);
+	assert(CalibrationStore::save(path, pCalibrate).empty());
+	json_decref(pCalibrate);
+	Pipeline pipeline("[{\"op\":\"warpPerspective\",\"calibration\":\"target/test-calibration.json\"}]");
+	assertWarp(pipeline, image, 5, 3);
+
+	// unchanged files are served from the cache
+	string errMsg;
+	Ptr<Calibration> pCal1 = CalibrationStore::load(path, errMsg);
+	Ptr<Calibration> pCal2 = CalibrationStore::load(path, errMsg);
+	assert(errMsg.empty() && &*pCal1 == &*pCal2);
+
+	// replace the file behind the store's back with a different modification time
+	json_t *pRoot = json_object();
+	json_object_set_new(pRoot, "version", json_integer(CalibrationStore::VERSION));
+	json_object_set_new(pRoot, "calibrate", translation(-4, 7));
+	assert(json_dump_file(pRoot, path, JSON_INDENT(2)) == 0);
+	json_decref(pRoot);
+	struct stat st;
+	assert(stat(path, &st) == 0);
+	struct utimbuf times;
+	times.actime = st.st_atime;
+	times.modtime = st.st_mtime - 10;
+	assert(utime(path, &times) == 0);
+	assertWarp(pipeline, image, -4, 7);
+
+	Ptr<Calibration> pCal3 = CalibrationStore::load(path, errMsg);
+	assert(errMsg.empty() && &*pCal3 != &*pCal1);
+	assert(pCal3->perspective.at<double>(0, 2) == -4);
+
+	Pipeline missing("[{\"op\":\"warpPerspective\",\"calibration\":\"target/no-such-calibration.json\"}]");
+	Mat workingImage = image.clone();
+	ArgMap argMap;
+	json_t *pModel = missing.process(workingImage, argMap);
+	assert(json_is_string(json_object_get(json_object_get(pModel, "s1"), "error")));
+	json_decref(pModel);
+}
+
 void test_calibrate() {
 	test_calibrateCamera();
+	test_calibrationStore();
 }
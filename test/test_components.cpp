@@ -0,0 +1,91 @@
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+extern json_t *stageModel(const char *pDefinition, const Mat &image, const char *stageName);
+
+/**
+ * Assert that a component matches the blob drawn alone in the given mask
+ */
+static void assertComponent(json_t *pRect, const Mat &blob) {
+  vector<Point> pts;
+  findNonZero(blob, pts);
+  Rect bounds = boundingRect(pts);
+  Moments m = moments(blob, true);
+  json_t *pBounds = json_object_get(pRect, "bounds");
+  Rect actual((int) json_integer_value(json_object_get(pBounds, "x")),
+              (int) json_integer_value(json_object_get(pBounds, "y")),
+              (int) json_integer_value(json_object_get(pBounds, "width")),
+              (int) json_integer_value(json_object_get(pBounds, "height")));
+  double cx = json_real_value(json_object_get(pRect, "cx"));
+  double cy = json_real_value(json_object_get(pRect, "cy"));
+  cout << "test_components() bounds:" << bounds << " actual:" << actual << " area:" << pts.size() <<
+    " centroid:" << m.m10/m.m00 << "," << m.m01/m.m00 << " actual:" << cx << "," << cy << endl;
+  assert(actual == bounds);
+  assert(json_integer_value(json_object_get(pRect, "area")) == (int) pts.size());
+  assert(fabs(cx - m.m10/m.m00) < 1e-6 && fabs(cy - m.m01/m.m00) < 1e-6);
+}
+
+/**
+ * Components are labelled in strips of 64 rows that are then stitched together
+ */
+void test_components() {
+  Size size(200, 200);
+  vector<Mat> blobs;
+  Mat blob = Mat::zeros(size, CV_8UC1);
+  rectangle(blob, Point(10, 50), Point(29, 89), Scalar(255), -1); // crosses row 64
+  blobs.push_back(blob);
+
+  blob = Mat::zeros(size, CV_8UC1); // U joined only below rows 128
+  rectangle(blob, Point(50, 20), Point(54, 140), Scalar(255), -1);
+  rectangle(blob, Point(70, 20), Point(74, 140), Scalar(255), -1);
+  rectangle(blob, Point(50, 136), Point(74, 140), Scalar(255), -1);
+  blobs.push_back(blob);
+
+  blob = Mat::zeros(size, CV_8UC1); // halves meet at the first row of a strip
+  rectangle(blob, Point(150, 40), Point(160, 63), Scalar(255), -1);
+  rectangle(blob, Point(155, 64), Point(170, 80), Scalar(255), -1);
+  blobs.push_back(blob);
+
+  blob = Mat::zeros(size, CV_8UC1); // 8-connected diagonal through row 128
+  for (int i = 0; i < 10; i++) {
+    blob.at<uchar>(123+i, 100+i) = 255;
+  }
+  blobs.push_back(blob);
+
+  blob = Mat::zeros(size, CV_8UC1); // ends at the last row of a strip
+  rectangle(blob, Point(120, 160), Point(140, 191), Scalar(255), -1);
+  blobs.push_back(blob);
+
+  Mat image = Mat::zeros(size, CV_8UC1);
+  for (size_t i = 0; i < blobs.size(); i++) {
+    image |= blobs[i];
+  }
+
+  // labels are the first pixel of each component in raster order, so blobs are listed
+  // in order of their top row: U, halves, rectangle, diagonal, bottom rectangle
+  int order[] = { 1, 2, 0, 3, 4 };
+  json_t *pStageModel = stageModel("[{\"op\":\"components\",\"connectivity\":8}]", image, "s1");
+  json_t *pRects = json_object_get(pStageModel, "rects");
+  assert(json_array_size(pRects) == blobs.size());
+  for (size_t i = 0; i < blobs.size(); i++) {
+    assertComponent(json_array_get(pRects, i), blobs[order[i]]);
+  }
+  json_decref(pStageModel);
+
+  // the diagonal falls apart into single pixels with 4-connectivity
+  pStageModel = stageModel("[{\"op\":\"components\",\"connectivity\":4}]", image, "s1");
+  assert(json_array_size(json_object_get(pStageModel, "rects")) == blobs.size() - 1 + 10);
+  json_decref(pStageModel);
+}
@@ -0,0 +1,68 @@
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+extern json_t *stageModel(const char *pDefinition, const Mat &image, const char *stageName);
+
+/**
+ * Assert that the fitted circles are the given circles within tolerance, in any order
+ */
+static void assertCircles(json_t *pCircles, const vector<Circle> &expected, double tolerance) {
+  assert(json_is_array(pCircles));
+  assert(json_array_size(pCircles) == expected.size());
+  for (size_t e = 0; e < expected.size(); e++) {
+    bool found = false;
+    for (size_t i = 0; !found && i < json_array_size(pCircles); i++) {
+      json_t *pCircle = json_array_get(pCircles, i);
+      double x = json_real_value(json_object_get(pCircle, "x"));
+      double y = json_real_value(json_object_get(pCircle, "y"));
+      double radius = json_real_value(json_object_get(pCircle, "radius"));
+      if (fabs(x - expected[e].x) <= tolerance && fabs(y - expected[e].y) <= tolerance) {
+        cout << "test_fitCircles() expected radius:" << expected[e].radius << " actual x:" << x <<
+          " y:" << y << " radius:" << radius << endl;
+        assert(fabs(radius - expected[e].radius) <= tolerance);
+        found = true;
+      }
+    }
+    assert(found);
+  }
+}
+
+void test_fitCircles() {
+  Mat image = Mat::zeros(240, 360, CV_8UC1);
+  Circle expected[] = { Circle(60, 60, 20), Circle(170, 70, 32), Circle(90, 170, 25), Circle(270, 160, 30) };
+  size_t nExpected = sizeof(expected)/sizeof(Circle);
+  for (size_t i = 0; i < nExpected; i++) {
+    circle(image, Point((int) expected[i].x, (int) expected[i].y), (int) expected[i].radius, Scalar(255), -1);
+  }
+  // outline pixels lie inside the drawn radius
+  vector<Circle> fitted;
+  for (size_t i = 0; i < nExpected; i++) {
+    fitted.push_back(Circle(expected[i].x, expected[i].y, expected[i].radius - 0.5f));
+  }
+
+  json_t *pStageModel = stageModel("[{\"op\":\"fitCircles\",\"diamMin\":30,\"diamMax\":80}]", image, "s1");
+  assertCircles(json_object_get(pStageModel, "circles"), fitted, 1.0);
+  json_decref(pStageModel);
+
+  pStageModel = stageModel("[{\"op\":\"fitCircles\",\"diamMin\":30,\"diamMax\":80,\"fit\":\"RANSAC\"}]", image, "s1");
+  assertCircles(json_object_get(pStageModel, "circles"), fitted, 1.0);
+  json_decref(pStageModel);
+
+  // a tab on the outline of the last circle is rejected as outliers by RANSAC
+  rectangle(image, Rect(290, 150, 20, 20), Scalar(255), -1);
+  pStageModel = stageModel("[{\"op\":\"fitCircles\",\"diamMin\":30,\"diamMax\":80,\"fit\":\"RANSAC\"}]", image, "s1");
+  assertCircles(json_object_get(pStageModel, "circles"), fitted, 1.0);
+  json_decref(pStageModel);
+}
@@ -22,6 +22,10 @@ void test_jo_parse() {
   result = jo_parse("Look at the {{blue}}.", "", args);
   cout << result << endl;
   assert(strcmp("Look at the sky.", result.c_str()) == 0);
+  result = jo_parse("a {{green||lime}} tree", "", args);
+  cout << result << endl;
+  assert(strcmp("a lime tree", result.c_str()) == 0);
+  assert(args.size() == 2); // missing arguments are not added
 }
 
 void test_jo_util() {
@@ -0,0 +1,132 @@
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+static Mat morphImage(const char *op, const char *shape, Size ksize, int iterations, const Mat &image) {
+  char definition[255];
+  snprintf(definition, sizeof(definition),
+    "[{\"op\":\"%s\",\"shape\":\"%s\",\"ksize\":[%d,%d],\"iterations\":%d}]",
+    op, shape, ksize.width, ksize.height, iterations);
+  Pipeline pipeline(definition);
+  Mat workingImage = image.clone();
+  ArgMap argMap;
+  json_t *pModel = pipeline.process(workingImage, argMap);
+  json_decref(pModel);
+  return workingImage;
+}
+
+static bool isSameImage(const Mat &a, const Mat &b) {
+  return a.size() == b.size() && a.type() == b.type() && norm(a, b, NORM_INF) == 0;
+}
+
+static Mat randomImage(Size size, int type, uint64 seed) {
+  Mat image(size, type);
+  RNG rng(seed);
+  rng.fill(image, RNG::UNIFORM, 0, 256);
+  return image;
+}
+
+/**
+ * Rectangles of 7 or more pixels take the van Herk/Gil-Werman path, which must match OpenCV
+ */
+void test_morph_rect() {
+  Size ksizes[] = { Size(7,7), Size(15,15), Size(31,31), Size(8,8), Size(16,6), Size(1,15), Size(9,1) };
+  Size sizes[] = { Size(97,61), Size(5,40), Size(40,3), Size(300,257) };
+  int types[] = { CV_8UC1, CV_8UC3 };
+  int cases = 0;
+  for (size_t s = 0; s < sizeof(sizes)/sizeof(Size); s++) {
+    for (size_t t = 0; t < sizeof(types)/sizeof(int); t++) {
+      Mat image = randomImage(sizes[s], types[t], s*10+t);
+      for (size_t k = 0; k < sizeof(ksizes)/sizeof(Size); k++) {
+        Mat element = getStructuringElement(MORPH_RECT, ksizes[k]);
+        for (int iterations = 1; iterations <= 3; iterations++) {
+          Mat expected;
+          erode(image, expected, element, Point(-1,-1), iterations);
+          Mat actual = morphImage("erode", "MORPH_RECT", ksizes[k], iterations, image);
+          if (!isSameImage(actual, expected)) {
+            cout << "test_morph_rect() erode " << matInfo(image) << " ksize:" << ksizes[k] <<
+              " iterations:" << iterations << " FAILED" << endl;
+            assert(false);
+          }
+          dilate(image, expected, element, Point(-1,-1), iterations);
+          actual = morphImage("dilate", "MORPH_RECT", ksizes[k], iterations, image);
+          if (!isSameImage(actual, expected)) {
+            cout << "test_morph_rect() dilate " << matInfo(image) << " ksize:" << ksizes[k] <<
+              " iterations:" << iterations << " FAILED" << endl;
+            assert(false);
+          }
+          cases += 2;
+        }
+      }
+    }
+  }
+  cout << "test_morph_rect() " << cases << " cases" << endl;
+}
+
+static Mat processImage(const string &definition, const Mat &image, string &modelStr) {
+  Pipeline pipeline(definition.c_str());
+  Mat workingImage = image.clone();
+  ArgMap argMap;
+  json_t *pModel = pipeline.process(workingImage, argMap);
+  char *pModelStr = json_dumps(pModel, JSON_SORT_KEYS|JSON_COMPACT);
+  modelStr = pModelStr;
+  free(pModelStr);
+  json_decref(pModel);
+  return workingImage;
+}
+
+/**
+ * Morphology and components on packed binary images must match the unpacked pipeline
+ */
+void test_morph_packed() {
+  const char *stages[] = {
+    "",
+    "{\"op\":\"erode\",\"shape\":\"MORPH_RECT\",\"ksize\":[3,3]},",
+    "{\"op\":\"dilate\",\"shape\":\"MORPH_RECT\",\"ksize\":[7,5],\"iterations\":2},",
+    "{\"op\":\"morph\",\"mop\":\"MORPH_OPEN\",\"shape\":\"MORPH_RECT\",\"ksize\":[4,4]},",
+    "{\"op\":\"morph\",\"mop\":\"MORPH_CLOSE\",\"shape\":\"MORPH_RECT\",\"ksize\":[5,9]},",
+    "{\"op\":\"erode\",\"shape\":\"MORPH_CROSS\",\"ksize\":[5,5],\"iterations\":2},",
+    "{\"op\":\"dilate\",\"shape\":\"MORPH_CROSS\",\"ksize\":[3,7]},",
+    "{\"op\":\"morph\",\"mop\":\"MORPH_OPEN\",\"shape\":\"MORPH_CROSS\",\"ksize\":[3,3]},",
+    "{\"op\":\"morph\",\"mop\":\"MORPH_CLOSE\",\"shape\":\"MORPH_CROSS\",\"ksize\":[5,3],\"iterations\":2},",
+  };
+  Size sizes[] = { Size(70,90), Size(129,65), Size(200,131), Size(5,40) };
+  int cases = 0;
+  for (size_t s = 0; s < sizeof(sizes)/sizeof(Size); s++) {
+    Mat image = randomImage(sizes[s], CV_8UC1, 100+s);
+    GaussianBlur(image, image, Size(5,5), 2); // blobs rather than isolated pixels
+    for (size_t i = 0; i < sizeof(stages)/sizeof(char *); i++) {
+      string unpacked = string("[{\"op\":\"threshold\",\"thresh\":127,\"maxval\":255},") +
+        stages[i] + "{\"op\":\"components\",\"minArea\":1}]";
+      string packed = string("[{\"op\":\"threshold\",\"thresh\":127,\"maxval\":255,\"packed\":true},") +
+        stages[i] + "{\"op\":\"components\",\"minArea\":1}]";
+      string expectedModel;
+      string actualModel;
+      Mat expected = processImage(unpacked, image, expectedModel);
+      Mat actual = processImage(packed, image, actualModel);
+      if (!isSameImage(actual, expected) || actualModel.compare(expectedModel) != 0) {
+        cout << "test_morph_packed() " << matInfo(image) << " " << packed << " FAILED" << endl;
+        cout << "expected:" << expectedModel << endl;
+        cout << "actual:" << actualModel << endl;
+        assert(false);
+      }
+      cases++;
+    }
+  }
+  cout << "test_morph_packed() " << cases << " cases" << endl;
+}
+
+void test_morph() {
+  test_morph_rect();
+  test_morph_packed();
+}
@@ -0,0 +1,370 @@
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+#include "jo_util.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define STRESS_PIPELINES 8
+#define STRESS_ITERATIONS 20
+
+static const char *STRESS_PIPELINE =
+  "["
+  "{\"op\":\"cvtColor\",\"code\":\"CV_BGR2GRAY\"},"
+  "{\"op\":\"blur\",\"ksize.width\":5,\"ksize.height\":5},"
+  "{\"op\":\"threshold\",\"thresh\":\"{{thresh||128}}\",\"maxval\":255},"
+  "{\"op\":\"components\",\"minArea\":\"{{minArea||10}}\"},"
+  "{\"op\":\"meanStdDev\"}"
+  "]";
+
+static Mat stressImage(int index) {
+  Mat image(240, 320, CV_8UC3, Scalar(20, 30, 40));
+  for (int i = 0; i <= index; i++) {
+    Point center(40 + (i * 37) % 240, 40 + (i * 53) % 160);
+    circle(image, center, 10 + i*2, Scalar(200, 220, 240), -1);
+  }
+  return image;
+}
+
+static void stressArgs(int index, ArgMap &argMap) {
+  if (index % 2) {
+    argMap["thresh"] = "100";
+  }
+}
+
+static string stressModel(Pipeline &pipeline, const Mat &image, ArgMap &argMap) {
+  Mat workingImage = image.clone();
+  json_t *pModel = pipeline.process(workingImage, argMap);
+  char *pModelStr = json_dumps(pModel, JSON_SORT_KEYS|JSON_COMPACT);
+  string result(pModelStr);
+  free(pModelStr);
+  json_decref(pModel);
+  return result;
+}
+
+/**
+ * Each task runs a pipeline repeatedly and compares its models with the expected model
+ */
+class StressBody : public ParallelLoopBody {
+  private:
+    const vector<Mat> &images;
+    const vector<string> &expected;
+    Pipeline *pShared;
+    int *pFailures;
+
+  public:
+    /**
+     * @param pShared pipeline used by all tasks, or NULL for a pipeline per task
+     */
+    StressBody(const vector<Mat> &images, const vector<string> &expected, Pipeline *pShared, int *pFailures)
+      : images(images), expected(expected), pShared(pShared), pFailures(pFailures) {}
+
+    void operator()(const Range &range) const {
+      for (int i = range.start; i < range.end; i++) {
+        Pipeline own(STRESS_PIPELINE);
+        Pipeline &pipeline = pShared ? *pShared : own;
+        ArgMap argMap;
+        stressArgs(i, argMap);
+        for (int n = 0; n < STRESS_ITERATIONS; n++) {
+          if (stressModel(pipeline, images[i], argMap).compare(expected[i]) != 0) {
+            CV_XADD(pFailures, 1);
+          }
+        }
+      }
+    }
+};
+
+void test_pipeline_threads() {
+  vector<Mat> images;
+  vector<string> expected;
+  for (int i = 0; i < STRESS_PIPELINES; i++) {
+    images.push_back(stressImage(i));
+    Pipeline pipeline(STRESS_PIPELINE);
+    ArgMap argMap;
+    stressArgs(i, argMap);
+    expected.push_back(stressModel(pipeline, images[i], argMap));
+    cout << "test_pipeline_threads() expected[" << i << "] " << expected[i] << endl;
+  }
+  size_t emptyMapSize = emptyMap.size();
+
+  int oldLevel = firelog_level(FIRELOG_DEBUG);
+  int failures = 0;
+  StressBody body(images, expected, NULL, &failures);
+  parallel_for_(Range(0, STRESS_PIPELINES), body, STRESS_PIPELINES);
+  cout << "test_pipeline_threads() " << STRESS_PIPELINES << " pipelines failures:" << failures << endl;
+  assert(failures == 0);
+
+  Pipeline pipeline(STRESS_PIPELINE);
+  StressBody sharedBody(images, expected, &pipeline, &failures);
+  parallel_for_(Range(0, STRESS_PIPELINES), sharedBody, STRESS_PIPELINES);
+  firelog_level(oldLevel);
+  cout << "test_pipeline_threads() shared pipeline failures:" << failures << endl;
+  assert(failures == 0);
+  assert(emptyMap.size() == emptyMapSize);
+
+  // independent images of a batch yield the same models as serial processing
+  vector<Mat> batch;
+  vector<ArgMap> argMaps(STRESS_PIPELINES);
+  for (int i = 0; i < STRESS_PIPELINES; i++) {
+    batch.push_back(images[i].clone());
+    stressArgs(i, argMaps[i]);
+  }
+  vector<json_t *> models = pipeline.processBatch(batch, argMaps, 4);
+  assert(models.size() == images.size());
+  for (size_t i = 0; i < models.size(); i++) {
+    char *pModelStr = json_dumps(models[i], JSON_SORT_KEYS|JSON_COMPACT);
+    assert(expected[i].compare(pModelStr) == 0);
+    free(pModelStr);
+    json_decref(models[i]);
+  }
+}
+
+void test_pipeline_submit() {
+  vector<Mat> images;
+  vector<string> expected;
+  vector<ArgMap> argMaps(STRESS_PIPELINES);
+  for (int i = 0; i < STRESS_PIPELINES; i++) {
+    images.push_back(stressImage(i));
+    Pipeline pipeline(STRESS_PIPELINE);
+    stressArgs(i, argMaps[i]);
+    expected.push_back(stressModel(pipeline, images[i], argMaps[i]));
+  }
+
+  // results arrive in submission order with the models of serial processing
+  Pipeline pipeline(STRESS_PIPELINE);
+  pipeline.setSubmitGroups(3);
+  vector<std::future<FrameResult> > futures;
+  for (int n = 0; n < STRESS_ITERATIONS; n++) {
+    for (int i = 0; i < STRESS_PIPELINES; i++) {
+      futures.push_back(pipeline.submit(images[i], argMaps[i]));
+    }
+  }
+  for (size_t f = 0; f < futures.size(); f++) {
+    FrameResult result = futures[f].get();
+    char *pModelStr = json_dumps(result.pModel, JSON_SORT_KEYS|JSON_COMPACT);
+    assert(expected[f % STRESS_PIPELINES].compare(pModelStr) == 0);
+    assert(result.image.type() == CV_8UC1 && result.image.size() == images[0].size());
+    free(pModelStr);
+    json_decref(result.pModel);
+  }
+  cout << "test_pipeline_submit() " << futures.size() << " images" << endl;
+}
+
+/**
+ * Return working image after processing a copy of the given image
+ */
+static Mat processImage(Pipeline &pipeline, const Mat &image, string *pModelStr=NULL) {
+  Mat workingImage = image.clone();
+  ArgMap argMap;
+  json_t *pModel = pipeline.process(workingImage, argMap);
+  if (pModelStr) {
+    char *pStr = json_dumps(pModel, JSON_SORT_KEYS|JSON_COMPACT);
+    *pModelStr = pStr;
+    free(pStr);
+  }
+  json_decref(pModel);
+  return workingImage;
+}
+
+static bool isSameImage(const Mat &a, const Mat &b) {
+  return a.size() == b.size() && a.type() == b.type() && (a.empty() || norm(a, b, NORM_INF) == 0);
+}
+
+static Mat noiseImage(int rows, int cols, int type, uint64 seed) {
+  Mat image(rows, cols, type);
+  RNG rng(seed);
+  rng.fill(image, RNG::UNIFORM, 0, 256);
+  GaussianBlur(image, image, Size(9,9), 3); // blobs that survive threshold
+  return image;
+}
+
+void test_pipeline_tiled() {
+  // 4.2MP with partial edge tiles one and three pixels wide
+  Mat image = noiseImage(2051, 2049, CV_8UC1, 1234);
+  Pipeline tiled(
+    "[{\"op\":\"blur\",\"ksize.width\":5,\"ksize.height\":5},"
+    "{\"op\":\"erode\",\"ksize\":[3,3],\"shape\":\"MORPH_RECT\"},"
+    "{\"op\":\"threshold\",\"thresh\":128,\"maxval\":255}]");
+  Pipeline split( // named stages end runs, so nothing is tiled
+    "[{\"op\":\"blur\",\"name\":\"b\",\"ksize.width\":5,\"ksize.height\":5},"
+    "{\"op\":\"erode\",\"name\":\"e\",\"ksize\":[3,3],\"shape\":\"MORPH_RECT\"},"
+    "{\"op\":\"threshold\",\"thresh\":128,\"maxval\":255}]");
+  Mat expected = processImage(split, image);
+  Mat actual = processImage(tiled, image);
+  cout << "test_pipeline_tiled() " << matInfo(actual) << " nonZero:" << countNonZero(actual) << endl;
+  assert(countNonZero(expected) > 0);
+  assert(isSameImage(actual, expected));
+}
+
+static int stageInt(json_t *pModel, const char *stageName, const char *key) {
+  return (int) json_integer_value(json_object_get(json_object_get(pModel, stageName), key));
+}
+
+void test_pipeline_dirtyTiles() {
+  const char *pDefinition =
+    "[{\"op\":\"dirtyTiles\",\"tileSize\":64},"
+    "{\"op\":\"blur\",\"ksize.width\":5,\"ksize.height\":5},"
+    "{\"op\":\"erode\",\"ksize\":[3,3],\"shape\":\"MORPH_RECT\"}]";
+  Mat frame1 = noiseImage(480, 650, CV_8UC1, 5678);
+  Mat frame2 = frame1.clone();
+  rectangle(frame2, Rect(60, 100, 4, 4), Scalar(255), -1); // ends at a tile edge
+  rectangle(frame2, Rect(300, 300, 3, 3), Scalar(0), -1);
+
+  Pipeline pipeline(pDefinition);
+  ArgMap argMap;
+  Mat image1 = frame1.clone();
+  json_t *pModel1 = pipeline.process(image1, argMap);
+  int tiles = stageInt(pModel1, "s1", "tiles");
+  assert(tiles == 11*8);
+  assert(stageInt(pModel1, "s1", "dirty") == tiles);
+  json_decref(pModel1);
+
+  Mat image2 = frame2.clone();
+  json_t *pModel2 = pipeline.process(image2, argMap);
+  int dirty = stageInt(pModel2, "s1", "dirty");
+  json_decref(pModel2);
+  cout << "test_pipeline_dirtyTiles() tiles:" << tiles << " dirty:" << dirty << endl;
+  assert(0 < dirty && dirty < tiles);
+
+  Pipeline fresh(pDefinition);
+  Mat expected = processImage(fresh, frame2);
+  assert(isSameImage(image2, expected));
+}
+
+/**
+ * Return compact dump of the model of each stage in pipeline order
+ */
+static vector<string> stageModels(json_t *pPipeline, json_t *pModel) {
+  vector<string> result;
+  for (size_t i = 0; i < json_array_size(pPipeline); i++) {
+    string name = jo_string(json_array_get(pPipeline, i), "name");
+    if (name.empty()) {
+      char defaultName[100];
+      snprintf(defaultName, sizeof(defaultName), "s%d", (int)i+1);
+      name = defaultName;
+    }
+    char *pStr = json_dumps(json_object_get(pModel, name.c_str()), JSON_SORT_KEYS|JSON_COMPACT|JSON_ENCODE_ANY);
+    result.push_back(pStr ? pStr : "");
+    free(pStr);
+  }
+  return result;
+}
+
+void test_pipeline_fused() {
+  // the final stageImage returns the named snapshot of the fused run
+  const char *fusedDefinition =
+    "[{\"op\":\"cvtColor\",\"code\":\"CV_BGR2GRAY\"},"
+    "{\"op\":\"threshold\",\"type\":\"THRESH_TOZERO\",\"thresh\":120,\"maxval\":255},"
+    "{\"op\":\"normalize\",\"normType\":\"NORM_MINMAX\",\"range\":[10,240],\"name\":\"norm\"},"
+    "{\"op\":\"threshold\",\"thresh\":200,\"maxval\":255},"
+    "{\"op\":\"stageImage\",\"stage\":\"norm\"}]";
+  const char *splitDefinition = // named stages end runs, so nothing is fused
+    "[{\"op\":\"cvtColor\",\"code\":\"CV_BGR2GRAY\",\"name\":\"gray\"},"
+    "{\"op\":\"threshold\",\"type\":\"THRESH_TOZERO\",\"thresh\":120,\"maxval\":255,\"name\":\"tozero\"},"
+    "{\"op\":\"normalize\",\"normType\":\"NORM_MINMAX\",\"range\":[10,240],\"name\":\"norm\"},"
+    "{\"op\":\"threshold\",\"thresh\":200,\"maxval\":255},"
+    "{\"op\":\"stageImage\",\"stage\":\"norm\"}]";
+  Mat image = noiseImage(243, 301, CV_8UC3, 4321);
+  ArgMap argMap;
+
+  Pipeline fused(fusedDefinition);
+  Mat actual = image.clone();
+  json_t *pActual = fused.process(actual, argMap);
+  Pipeline split(splitDefinition);
+  Mat expected = image.clone();
+  json_t *pExpected = split.process(expected, argMap);
+
+  cout << "test_pipeline_fused() " << matInfo(actual) << endl;
+  assert(actual.type() == CV_8UC1);
+  assert(isSameImage(actual, expected));
+  json_t *pFusedJson = json_loads(fusedDefinition, 0, NULL);
+  json_t *pSplitJson = json_loads(splitDefinition, 0, NULL);
+  assert(stageModels(pFusedJson, pActual) == stageModels(pSplitJson, pExpected));
+  json_decref(pFusedJson);
+  json_decref(pSplitJson);
+  json_decref(pActual);
+  json_decref(pExpected);
+}
+
+static Mat gateFrame(const Rect *rects, size_t nRects) {
+  Mat image = Mat::zeros(160, 200, CV_8UC1);
+  for (size_t i = 0; i < nRects; i++) {
+    rectangle(image, rects[i], Scalar(255), -1);
+  }
+  return image;
+}
+
+/**
+ * A closed gate restores the models and images of gate-sensitive stages from the last open frame
+ */
+void test_pipeline_gate() {
+  const char *pDefinition =
+    "[{\"op\":\"gate\",\"name\":\"gate\",\"downscale\":4,\"threshold\":2},"
+    "{\"op\":\"components\",\"name\":\"fresh\",\"gate\":false},"
+    "{\"op\":\"components\",\"name\":\"comps\"},"
+    "{\"op\":\"blur\",\"name\":\"blurred\",\"ksize.width\":5,\"ksize.height\":5,\"gate\":true}]";
+  Rect rectsA[] = { Rect(10, 10, 30, 20), Rect(80, 40, 25, 25), Rect(150, 100, 20, 40) };
+  Rect rectsB[] = { Rect(20, 90, 50, 30), Rect(120, 20, 40, 40) };
+  Mat frameA = gateFrame(rectsA, 3);
+  Mat frameA2 = frameA.clone();
+  frameA2.at<uchar>(130, 60) = 255; // a new component too small to open the gate
+  Mat frameB = gateFrame(rectsB, 2);
+  Pipeline pipeline(pDefinition);
+  ArgMap argMap;
+
+  Mat imageA = frameA.clone();
+  json_t *pModelA = pipeline.process(imageA, argMap);
+  assert(json_is_true(json_object_get(json_object_get(pModelA, "gate"), "open")));
+  json_t *pCompsA = json_object_get(pModelA, "comps");
+  assert(!json_object_get(pCompsA, "reused"));
+  size_t nA = json_array_size(json_object_get(pCompsA, "rects"));
+  assert(nA == 3);
+
+  Mat imageA2 = frameA2.clone();
+  json_t *pModelA2 = pipeline.process(imageA2, argMap);
+  json_t *pGateA2 = json_object_get(pModelA2, "gate");
+  cout << "test_pipeline_gate() A' diff:" << json_real_value(json_object_get(pGateA2, "diff")) << endl;
+  assert(json_is_false(json_object_get(pGateA2, "open")));
+  json_t *pCompsA2 = json_object_get(pModelA2, "comps");
+  assert(json_is_true(json_object_get(pCompsA2, "reused")));
+  assert(json_equal(json_object_get(pCompsA2, "rects"), json_object_get(pCompsA, "rects")));
+  assert(json_is_true(json_object_get(json_object_get(pModelA2, "blurred"), "reused")));
+  assert(isSameImage(imageA2, imageA));
+  // "gate":false opts out of reuse
+  json_t *pFreshA2 = json_object_get(pModelA2, "fresh");
+  assert(!json_object_get(pFreshA2, "reused"));
+  assert(json_array_size(json_object_get(pFreshA2, "rects")) == nA + 1);
+  json_decref(pModelA2);
+  json_decref(pModelA);
+
+  Mat imageB = frameB.clone();
+  json_t *pModelB = pipeline.process(imageB, argMap);
+  assert(json_is_true(json_object_get(json_object_get(pModelB, "gate"), "open")));
+  assert(!json_object_get(json_object_get(pModelB, "comps"), "reused"));
+  assert(!json_object_get(json_object_get(pModelB, "blurred"), "reused"));
+  Pipeline fresh(pDefinition);
+  Mat expected = frameB.clone();
+  json_t *pExpected = fresh.process(expected, argMap);
+  assert(isSameImage(imageB, expected));
+  assert(json_equal(json_object_get(pModelB, "comps"), json_object_get(pExpected, "comps")));
+  assert(json_equal(json_object_get(pModelB, "fresh"), json_object_get(pExpected, "fresh")));
+  json_decref(pExpected);
+  json_decref(pModelB);
+}
+
+void test_pipeline() {
+  test_pipeline_threads();
+  test_pipeline_submit();
+  test_pipeline_tiled();
+  test_pipeline_dirtyTiles();
+  test_pipeline_fused();
+  test_pipeline_gate();
+}
@@ -0,0 +1,69 @@
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+static void assertRoiStats(const Mat &image, const Rect *rois, size_t nRois) {
+  Pipeline pipeline(
+    "[{\"op\":\"roiStats\",\"rois\":[[0,0,64,48],[10,20,1,1],[33,7,50,61],[90,70,40,40]]},"
+    "{\"op\":\"roiStats\",\"rois\":[[33,7,50,61]],\"minMax\":true}]");
+  Mat workingImage = image.clone();
+  ArgMap argMap;
+  json_t *pModel = pipeline.process(workingImage, argMap);
+  json_t *pStats = json_object_get(json_object_get(pModel, "s1"), "rois");
+  assert(json_array_size(pStats) == nRois);
+
+  Mat gray;
+  if (image.channels() == 1) {
+    gray = image;
+  } else {
+    cvtColor(image, gray, CV_BGR2GRAY);
+  }
+  Rect imageRect(0, 0, gray.cols, gray.rows);
+  for (size_t i = 0; i < nRois; i++) {
+    Rect roi = rois[i] & imageRect;
+    Scalar mean;
+    Scalar stdDev;
+    meanStdDev(gray(roi), mean, stdDev);
+    json_t *pRoiStats = json_array_get(pStats, i);
+    double actualMean = json_real_value(json_object_get(pRoiStats, "mean"));
+    double actualStdDev = json_real_value(json_object_get(pRoiStats, "stdDev"));
+    cout << "test_roiStats() " << matInfo(image) << " roi:" << roi << " mean:" << mean[0] << " stdDev:" <<
+      stdDev[0] << " actual mean:" << actualMean << " stdDev:" << actualStdDev << endl;
+    assert(json_integer_value(json_object_get(pRoiStats, "width")) == roi.width);
+    assert(json_integer_value(json_object_get(pRoiStats, "height")) == roi.height);
+    assert(fabs(actualMean - mean[0]) < 1e-6);
+    assert(fabs(actualStdDev - stdDev[0]) < 1e-4);
+    assert(!json_object_get(pRoiStats, "min")); // minMax is off by default
+  }
+
+  json_t *pMinMax = json_array_get(json_object_get(json_object_get(pModel, "s2"), "rois"), 0);
+  double minVal;
+  double maxVal;
+  minMaxLoc(gray(rois[2]), &minVal, &maxVal);
+  assert(json_real_value(json_object_get(pMinMax, "min")) == minVal);
+  assert(json_real_value(json_object_get(pMinMax, "max")) == maxVal);
+  json_decref(pModel);
+}
+
+void test_roiStats() {
+  Rect rois[] = { Rect(0,0,64,48), Rect(10,20,1,1), Rect(33,7,50,61), Rect(90,70,40,40) };
+  size_t nRois = sizeof(rois)/sizeof(Rect);
+  RNG rng(0x7015);
+  Mat gray(100, 120, CV_8UC1); // the last roi is clipped
+  rng.fill(gray, RNG::UNIFORM, 0, 256);
+  assertRoiStats(gray, rois, nRois);
+  Mat color(100, 120, CV_8UC3);
+  rng.fill(color, RNG::NORMAL, 128, 40);
+  assertRoiStats(color, rois, nRois);
+}
@@ -0,0 +1,421 @@
+#include <string.h>
+#include <math.h>
+#include "FireLog.h"
+#include "FireSight.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "jansson.h"
+#include "jo_util.hpp"
+#include "MatUtil.hpp"
+
+using namespace cv;
+using namespace std;
+using namespace firesight;
+
+#define TILE_HASH_BASIS 0xcbf29ce484222325ULL
+#define TILE_HASH_PRIME 0x100000001b3ULL
+#define TILED_MIN_PIXELS (4*1024*1024) /* smaller images are processed a stage at a time */
+#define TILED_TILE_BYTES (256*1024)     /* input bytes per tile, so that a tile stays in L2 */
+
+/**
+ * Input tile hashes and output image of a dirtyTiles run, kept across frames
+ */
+class TileStageData : public StageData {
+  public:
+    string signature;       // stage definitions that produced output
+    Size inputSize;
+    int inputType;
+    vector<uint64> hashes;
+    Mat output;
+
+    TileStageData(string stageName) : StageData(stageName), inputType(-1) {}
+};
+
+/**
+ * Return the number of pixels around an output pixel that a stage reads, or -1 if the
+ * stage is not local. Canny is not local because hysteresis follows edges across the
+ * image, and normalize depends on the whole image.
+ */
+static int stageHalo(const string &op, json_t *pStage, ArgMap &argMap) {
+    if (op.compare("cvtColor") == 0) {
+        string code = jo_string(pStage, "code", "CV_BGR2GRAY", argMap);
+        return code.find("Bayer") == string::npos ? 0 : -1;
+    } else if (op.compare("threshold") == 0) {
+        string thresh = jo_string(pStage, "thresh", "OTSU", argMap);
+        if (thresh.compare("OTSU") == 0 || jo_bool(pStage, "packed", false, argMap)) {
+            return -1;
+        }
+        return 0;
+    } else if (op.compare("blur") == 0) {
+        int width = jo_int(pStage, "ksize.width", 3, argMap);
+        int height = jo_int(pStage, "ksize.height", 3, argMap);
+        return max(width, height)/2;
+    } else if (op.compare("erode") == 0 || op.compare("dilate") == 0 || op.compare("morph") == 0) {
+        vector<int> ksize = jo_vectori(pStage, "ksize", vector<int>(2,3), argMap);
+        if (ksize.empty() || ksize.size() > 2) {
+            return -1;
+        }
+        int kwidth = jo_int(pStage, "ksize.width", ksize[0], argMap);
+        kwidth = jo_int(pStage, "kwidth", kwidth, argMap);
+        int kheight = jo_int(pStage, "ksize.height", ksize.size() > 1 ? ksize[1] : ksize[0], argMap);
+        kheight = jo_int(pStage, "kheight", kheight, argMap);
+        int iterations = jo_int(pStage, "iterations", 1, argMap);
+        int passes = 1;
+        if (op.compare("morph") == 0) {
+            string mop = jo_string(pStage, "mop", "MORPH_OPEN", argMap);
+            passes = mop.compare("MORPH_ERODE") == 0 || mop.compare("MORPH_DILATE") == 0 ? 1 : 2;
+        }
+        return max(kwidth, kheight)/2 * max(1, iterations) * passes;
+    }
+    return -1;
+}
+
+/**
+ * FNV-1a hash of the pixels of a tile, eight bytes at a time
+ */
+static uint64 tileHash(const Mat &image, const Rect &tile) {
+    uint64 h = TILE_HASH_BASIS;
+    size_t rowBytes = tile.width * image.elemSize();
+    for (int r = tile.y; r < tile.y + tile.height; r++) {
+        const uchar *p = image.ptr<uchar>(r) + tile.x * image.elemSize();
+        size_t i = 0;
+        for (; i + 8 <= rowBytes; i += 8) {
+            uint64 w;
+            memcpy(&w, p + i, 8);
+            h = (h ^ w) * TILE_HASH_PRIME;
+        }
+        for (; i < rowBytes; i++) {
+            h = (h ^ p[i]) * TILE_HASH_PRIME;
+        }
+    }
+    return h;
+}
+
+static Rect tileRect(int t, int tilesX, int tileSize, const Size &size) {
+    int x = (t % tilesX) * tileSize;
+    int y = (t / tilesX) * tileSize;
+    return Rect(x, y, min(tileSize, size.width - x), min(tileSize, size.height - y));
+}
+
+class TileHashBody : public ParallelLoopBody {
+    private:
+        const Mat &image;
+        int tilesX;
+        int tileSize;
+        vector<uint64> &hashes;
+
+    public:
+        TileHashBody(const Mat &image, int tilesX, int tileSize, vector<uint64> &hashes)
+            : image(image), tilesX(tilesX), tileSize(tileSize), hashes(hashes) {}
+
+        void operator()(const Range &range) const {
+            for (int t = range.start; t < range.end; t++) {
+                hashes[t] = tileHash(image, tileRect(t, tilesX, tileSize, image.size()));
+            }
+        }
+};
+
+/**
+ * Apply stages [begin,end) to the given image
+ * @return false if a stage failed
+ */
+bool Pipeline::processTile(size_t begin, size_t end, Mat &image, ArgMap &argMap) {
+    Model tileModel(argMap);
+    tileModel.image = image;
+    for (size_t i = begin; i < end; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        string op = jo_string(pStage, "op", "", tileModel.argMap);
+        json_t *pTileModel = json_object();
+        const char *errMsg = dispatch("tile", op.c_str(), pStage, pTileModel, tileModel);
+        json_decref(pTileModel);
+        if (errMsg) {
+            LOGTRACE2("Pipeline::processTile() %s failed: %s", op.c_str(), errMsg);
+            return false;
+        }
+    }
+    image = tileModel.image;
+    return true;
+}
+
+/**
+ * Execute a dirtyTiles stage and the run of local stages (cvtColor, threshold, blur, erode,
+ * dilate, morph) that follows it. The input is divided into tiles. Only tiles whose input
+ * changed since the last frame, and their neighbours within the halo, are recomputed, each
+ * from the tile plus a halo that covers the support of all stages of the run, so results
+ * match full frame execution.
+ * A named stage ends the run so that its image can be saved.
+ * @param nStages end of the stages that may be executed
+ * @return number of stages executed, or 0 if the stage at index was not executed
+ */
+size_t Pipeline::processTiles(size_t index, size_t nStages, Model &model) {
+    json_t *pTilesStage = json_array_get(pPipeline, index);
+    if (jo_string(pTilesStage, "op", "", model.argMap).compare("dirtyTiles") != 0) {
+        return 0;
+    }
+    int tileSize = jo_int(pTilesStage, "tileSize", 64, model.argMap);
+    double maxDirty = jo_double(pTilesStage, "maxDirty", 0.5, model.argMap);
+    if (tileSize < 8 || maxDirty < 0 || 1 < maxDirty) {
+        return 0; // apply_dirtyTiles() reports the error
+    }
+
+    size_t end = index + 1;
+    int halo = 0;
+    string signature;
+    string lastName;
+    for (size_t i = index + 1; i < nStages; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        int stageHaloSize = stageHalo(jo_string(pStage, "op", "", model.argMap), pStage, model.argMap);
+        if (stageHaloSize < 0) {
+            break;
+        }
+        halo += stageHaloSize;
+        signature += jo_object_dump(pStage, model.argMap);
+        end = i + 1;
+        lastName = jo_string(pStage, "name");
+        if (!lastName.empty()) {
+            break;
+        }
+    }
+    if (end == index + 1 || lastName.compare("input") == 0) {
+        return 0;
+    }
+
+    string tilesName = jo_string(pTilesStage, "name");
+    if (tilesName.empty()) {
+        char defaultName[100];
+        snprintf(defaultName, sizeof(defaultName), "s%d", (int)index+1);
+        tilesName = defaultName;
+    }
+    TileStageData *pData = (TileStageData *) model.stageDataMap[tilesName];
+    if (!pData) {
+        pData = new TileStageData(tilesName);
+        model.stageDataMap[tilesName] = pData;
+    }
+
+    model.syncImage();
+    Mat input = model.image;
+    int tilesX = (input.cols + tileSize - 1) / tileSize;
+    int tilesY = (input.rows + tileSize - 1) / tileSize;
+    int nTiles = tilesX * tilesY;
+    vector<uint64> hashes(nTiles);
+    TileHashBody hashBody(input, tilesX, tileSize, hashes);
+    parallel_for_(Range(0, nTiles), hashBody);
+
+    bool full = pData->output.empty() || pData->inputSize != input.size() ||
+                pData->inputType != input.type() || pData->signature != signature ||
+                (int) pData->hashes.size() != nTiles;
+    vector<int> dirty;
+    if (!full) {
+        // output pixels within halo of a changed tile change too
+        int reach = (halo + tileSize - 1) / tileSize;
+        vector<bool> isDirty(nTiles, false);
+        for (int t = 0; t < nTiles; t++) {
+            if (hashes[t] != pData->hashes[t]) {
+                int tx = t % tilesX;
+                int ty = t / tilesX;
+                for (int y = max(0, ty - reach); y <= min(tilesY - 1, ty + reach); y++) {
+                    for (int x = max(0, tx - reach); x <= min(tilesX - 1, tx + reach); x++) {
+                        isDirty[y * tilesX + x] = true;
+                    }
+                }
+            }
+        }
+        for (int t = 0; t < nTiles; t++) {
+            if (isDirty[t]) {
+                dirty.push_back(t);
+            }
+        }
+    }
+    if (!full && dirty.size() > maxDirty * nTiles) {
+        full = true;
+    }
+
+    if (full) {
+        Mat result = input.clone();
+        if (!processTile(index + 1, end, result, model.argMap) || result.size() != input.size()) {
+            pData->output.release();
+            return 0;
+        }
+        pData->output = result;
+    } else {
+        Rect imageRect(0, 0, input.cols, input.rows);
+        for (size_t i = 0; i < dirty.size(); i++) {
+            Rect tile = tileRect(dirty[i], tilesX, tileSize, input.size());
+            Rect outer = Rect(tile.x - halo, tile.y - halo, tile.width + 2*halo, tile.height + 2*halo) & imageRect;
+            Mat result = input(outer).clone();
+            if (!processTile(index + 1, end, result, model.argMap) ||
+                    result.size() != outer.size() || result.type() != pData->output.type()) {
+                pData->output.release();
+                return 0;
+            }
+            result(Rect(tile.x - outer.x, tile.y - outer.y, tile.width, tile.height)).copyTo(pData->output(tile));
+        }
+    }
+    pData->hashes.swap(hashes);
+    pData->inputSize = input.size();
+    pData->inputType = input.type();
+    pData->signature = signature;
+    model.image = pData->output.clone();
+    model.imageChanged();
+
+    json_t *jmodel = model.getJson(false);
+    for (size_t i = index; i < end; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        string pName = jo_string(pStage, "name");
+        if (pName.empty()) {
+            char defaultName[100];
+            snprintf(defaultName, sizeof(defaultName), "s%d", (int)i+1);
+            pName = defaultName;
+        }
+        json_t *pStageModel = json_object();
+        if (i == index) {
+            json_object_set(pStageModel, "tiles", json_integer(nTiles));
+            json_object_set(pStageModel, "dirty", json_integer(full ? nTiles : (int) dirty.size()));
+        }
+        json_object_set(jmodel, pName.c_str(), pStageModel);
+    }
+    if (!lastName.empty()) {
+        model.imageMap[lastName.c_str()] = model.image.clone();
+    }
+    LOGDEBUG3("process() dirtyTiles stages %d-%d %s", (int)index+1, (int)end, matInfo(model.image).c_str());
+
+    return end - index;
+}
+
+namespace firesight {
+
+/**
+ * Process tiles of a run of local stages, each tile through the whole run
+ */
+class TiledRunBody : public ParallelLoopBody {
+    private:
+        Pipeline &pipeline;
+        size_t begin;
+        size_t end;
+        const Mat &input;
+        Mat &output;
+        int tilesX;
+        int tileSize;
+        int halo;
+        ArgMap &argMap;
+        volatile bool &failed;
+
+    public:
+        TiledRunBody(Pipeline &pipeline, size_t begin, size_t end, const Mat &input, Mat &output,
+                     int tilesX, int tileSize, int halo, ArgMap &argMap, volatile bool &failed)
+            : pipeline(pipeline), begin(begin), end(end), input(input), output(output), tilesX(tilesX),
+              tileSize(tileSize), halo(halo), argMap(argMap), failed(failed) {}
+
+        void operator()(const Range &range) const {
+            Rect imageRect(0, 0, input.cols, input.rows);
+            for (int t = range.start; t < range.end && !failed; t++) {
+                Rect tile = tileRect(t, tilesX, tileSize, input.size());
+                Rect outer = Rect(tile.x - halo, tile.y - halo, tile.width + 2*halo, tile.height + 2*halo) & imageRect;
+                Mat result = input(outer).clone();
+                if (!pipeline.processTile(begin, end, result, argMap) ||
+                        result.size() != outer.size() || result.type() != output.type()) {
+                    failed = true;
+                    break;
+                }
+                result(Rect(tile.x - outer.x, tile.y - outer.y, tile.width, tile.height)).copyTo(output(tile));
+            }
+        }
+};
+
+} // namespace firesight
+
+/**
+ * Execute a run of consecutive local stages (cvtColor, threshold, blur, erode, dilate, morph)
+ * on a large image one cache sized tile at a time, with tiles distributed across cores.
+ * Each tile is processed with a halo that covers the support of the whole run, so results
+ * are identical to executing the stages one after another. Runs must read neighbouring
+ * pixels, since runs of per-pixel stages are better served by processFused().
+ * A named stage ends the run so that its image can be saved.
+ * @param nStages end of the stages that may be executed
+ * @return number of stages executed, or 0 if the stage at index was not executed
+ */
+size_t Pipeline::processTiled(size_t index, size_t nStages, Model &model) {
+    if (model.image.total() < TILED_MIN_PIXELS || !model.bits.empty()) {
+        return 0;
+    }
+    size_t end = index;
+    int halo = 0;
+    string lastName;
+    for (size_t i = index; i < nStages; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        int stageHaloSize = stageHalo(jo_string(pStage, "op", "", model.argMap), pStage, model.argMap);
+        if (stageHaloSize < 0 || jo_bool(pStage, "gate", false, model.argMap)) {
+            break;
+        }
+        halo += stageHaloSize;
+        end = i + 1;
+        lastName = jo_string(pStage, "name");
+        if (!lastName.empty()) {
+            break;
+        }
+    }
+    if (end - index < 2 || halo == 0 || lastName.compare("input") == 0) {
+        return 0;
+    }
+
+    Mat input = model.image;
+    int tileSize = (int) sqrt((double) TILED_TILE_BYTES / input.elemSize());
+    tileSize = max(2*halo, max(64, tileSize & ~15));
+    int tilesX = (input.cols + tileSize - 1) / tileSize;
+    int tilesY = (input.rows + tileSize - 1) / tileSize;
+    int nTiles = tilesX * tilesY;
+
+    // the first tile determines the output type
+    Rect imageRect(0, 0, input.cols, input.rows);
+    Rect tile = tileRect(0, tilesX, tileSize, input.size());
+    Rect outer = Rect(tile.x, tile.y, tile.width + halo, tile.height + halo) & imageRect;
+    Mat first = input(outer).clone();
+    if (!processTile(index, end, first, model.argMap) || first.size() != outer.size()) {
+        return 0;
+    }
+    Mat output(input.size(), first.type());
+    first(Rect(0, 0, tile.width, tile.height)).copyTo(output(tile));
+
+    volatile bool failed = false;
+    TiledRunBody body(*this, index, end, input, output, tilesX, tileSize, halo, model.argMap, failed);
+    parallel_for_(Range(1, nTiles), body);
+    if (failed) {
+        LOGTRACE("Pipeline::processTiled() tile failed; processing stages individually");
+        return 0;
+    }
+    model.image = output;
+    model.imageChanged();
+
+    json_t *jmodel = model.getJson(false);
+    for (size_t i = index; i < end; i++) {
+        json_t *pStage = json_array_get(pPipeline, i);
+        string pName = jo_string(pStage, "name");
+        if (pName.empty()) {
+            char defaultName[100];
+            snprintf(defaultName, sizeof(defaultName), "s%d", (int)i+1);
+            pName = defaultName;
+        }
+        json_object_set(jmodel, pName.c_str(), json_object());
+    }
+    if (!lastName.empty()) {
+        model.imageMap[lastName.c_str()] = model.image.clone();
+    }
+    LOGDEBUG4("process() tiled stages %d-%d %d tiles %s", (int)index+1, (int)end, nTiles, matInfo(model.image).c_str());
+
+    return end - index;
+}
+
+bool Pipeline::apply_dirtyTiles(json_t *pStage, json_t *pStageModel, Model &model) {
+    int tileSize = jo_int(pStage, "tileSize", 64, model.argMap);
+    double maxDirty = jo_double(pStage, "maxDirty", 0.5, model.argMap);
+    const char *errMsg = NULL;
+
+    if (tileSize < 8) {
+        errMsg = "Expected tileSize >= 8";
+    } else if (maxDirty < 0 || 1 < maxDirty) {
+        errMsg = "Expected 0 <= maxDirty <= 1";
+    } else {
+        LOGTRACE("apply_dirtyTiles() no local stages follow; nothing to do");
+    }
+
+    return stageOK("apply_dirtyTiles(%s) %s", errMsg, pStage, pStageModel);
+}